@@ -0,0 +1,100 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright(c) 2021-2022 John Sanpe <sanpeqf@gmail.com>
+ */
+
+#include "fxprog.h"
+#include <errno.h>
+
+int fx_coalesce_init(struct fx_coalesce *co, fx_write_t write, is_external_t is_external, void *pdata, size_t limit)
+{
+    co->buffer = malloc(limit);
+    if (!co->buffer)
+        return -ENOMEM;
+
+    co->write = write;
+    co->is_external = is_external;
+    co->pdata = pdata;
+    co->limit = limit;
+    co->address = 0;
+    co->length = 0;
+    co->external = false;
+    co->records = 0;
+    co->transfers = 0;
+    return 0;
+}
+
+void fx_coalesce_release(struct fx_coalesce *co)
+{
+    free(co->buffer);
+    co->buffer = NULL;
+}
+
+int fx_coalesce_flush(struct fx_coalesce *co)
+{
+    int retval;
+
+    if (!co->length)
+        return 0;
+
+    retval = co->write(co->address, co->buffer, co->length, co->pdata);
+    if (retval)
+        return retval;
+
+    co->transfers++;
+    co->length = 0;
+    return 0;
+}
+
+static bool coalesce_mergeable(struct fx_coalesce *co, uint16_t address, size_t length, int external)
+{
+    if (!co->length)
+        return false;
+
+    /* only extend a run with data that directly follows it, never across 0x10000 */
+    if ((uint32_t)co->address + co->length != address)
+        return false;
+
+    if (co->length + length > co->limit || (uint32_t)address + length > 0x10000)
+        return false;
+
+    /* never let one run straddle internal and external memory */
+    if (co->is_external && (external != co->external ||
+        co->is_external(co->address, co->length + length) != external))
+        return false;
+
+    return true;
+}
+
+int fx_coalesce_push(uint16_t address, const void *data, size_t length, void *pdata)
+{
+    struct fx_coalesce *co = pdata;
+    size_t xfer;
+    int external;
+    int retval;
+
+    co->records++;
+
+    while (length) {
+        xfer = min(length, co->limit);
+        external = co->is_external ? co->is_external(address, xfer) : 0;
+        if (external < 0)
+            return external;
+
+        if (!coalesce_mergeable(co, address, xfer, external)) {
+            if ((retval = fx_coalesce_flush(co)))
+                return retval;
+            co->address = address;
+            co->external = external;
+        }
+
+        memcpy(co->buffer + co->length, data, xfer);
+        co->length += xfer;
+
+        address += xfer;
+        data += xfer;
+        length -= xfer;
+    }
+
+    return 0;
+}
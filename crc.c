@@ -0,0 +1,91 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright(c) 2021-2022 John Sanpe <sanpeqf@gmail.com>
+ */
+
+#include "fxprog.h"
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define CRC_X86 1
+#endif
+
+#define CRC32C_POLY 0x82f63b78
+
+typedef uint32_t (*crc32c_t)(uint32_t crc, const uint8_t *data, size_t length);
+
+static uint32_t crc32c_table[256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static crc32c_t crc32c_update;
+
+static uint32_t crc32c_soft(uint32_t crc, const uint8_t *data, size_t length)
+{
+    while (length--)
+        crc = crc32c_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+
+    return crc;
+}
+
+#if defined(CRC_X86)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data, size_t length)
+{
+# if defined(__x86_64__)
+    uint64_t value;
+
+    for (; length >= 8; length -= 8, data += 8) {
+        memcpy(&value, data, 8);
+        crc = _mm_crc32_u64(crc, value);
+    }
+# endif
+
+    for (; length; --length)
+        crc = _mm_crc32_u8(crc, *data++);
+
+    return crc;
+}
+#endif
+
+static void crc32c_setup(void)
+{
+    unsigned int index, bit;
+    uint32_t crc;
+
+    for (index = 0; index < 256; ++index) {
+        crc = index;
+        for (bit = 0; bit < 8; ++bit)
+            crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+        crc32c_table[index] = crc;
+    }
+
+    crc32c_update = crc32c_soft;
+#if defined(CRC_X86)
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c_update = crc32c_sse42;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length)
+{
+    pthread_once(&crc32c_once, crc32c_setup);
+    return ~crc32c_update(~crc, data, length);
+}
+
+/*
+ * CRC-16/CCITT-FALSE, what the loader firmware can afford to compute
+ * bit by bit on the 8051. Start from 0xffff.
+ */
+uint16_t crc16_ccitt(uint16_t crc, const void *data, size_t length)
+{
+    const uint8_t *bytes = data;
+    unsigned int bit;
+
+    while (length--) {
+        crc ^= (uint16_t)*bytes++ << 8;
+        for (bit = 0; bit < 8; ++bit)
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+
+    return crc;
+}
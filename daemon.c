@@ -0,0 +1,768 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright(c) 2021-2022 John Sanpe <sanpeqf@gmail.com>
+ */
+
+#include "fxjob.h"
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* arrivals on a port are ignored this long after its last job */
+#define FXD_HOLDOFF         3.0
+#define FXD_POLL_MS         500
+#define FXD_CLIENT_TIMEOUT  10
+
+static const double fxd_buckets[] = {
+    0.1, 0.5, 1, 2, 5, 10,
+};
+
+struct fxd_request {
+    struct fxd_request *next;
+    const struct fx_job *job;
+    struct fx_job own;
+    libusb_device *usbdev;
+    char path[32];
+    const char *errmsg;
+    double queued;
+    double started;
+    double finished;
+    bool done;
+    int retval;
+};
+
+struct fxd_port {
+    struct fxd_port *next;
+    char path[32];
+    unsigned long seen;
+    double holdoff;
+    bool busy;
+};
+
+struct fxd_stats {
+    unsigned long done;
+    unsigned long failed;
+    unsigned long arrivals;
+    double wait;
+    double latency;
+    double max;
+    double last;
+    unsigned long histogram[ARRAY_SIZE(fxd_buckets) + 1];
+};
+
+struct fxd_daemon {
+    const struct fxd_config *config;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t finished;
+    struct fxd_request *head;
+    struct fxd_request **tail;
+    struct fxd_port *ports;
+    unsigned long scan;
+    unsigned int pending;
+    unsigned int inflight;
+    unsigned int clients;
+    struct fxd_stats stats;
+    bool stopping;
+};
+
+struct fxd_client {
+    struct fxd_daemon *daemon;
+    int fd;
+};
+
+static volatile sig_atomic_t fxd_stop;
+
+static void fxd_signal(int sig)
+{
+    fxd_stop = 1;
+}
+
+static struct fxd_port *fxd_port(struct fxd_daemon *daemon, const char *path)
+{
+    struct fxd_port *port;
+
+    for (port = daemon->ports; port; port = port->next) {
+        if (!strcmp(port->path, path))
+            return port;
+    }
+
+    port = calloc(1, sizeof(*port));
+    if (!port)
+        return NULL;
+
+    strcpy(port->path, path);
+    port->next = daemon->ports;
+    daemon->ports = port;
+    return port;
+}
+
+static bool fxd_enqueue(struct fxd_daemon *daemon, struct fxd_request *request)
+{
+    if (daemon->stopping)
+        return false;
+
+    request->queued = fx_clock();
+    *daemon->tail = request;
+    daemon->tail = &request->next;
+    daemon->pending++;
+    pthread_cond_signal(&daemon->queued);
+    return true;
+}
+
+/* called with the lock held, from the hotplug callback or the poller */
+static void fxd_arrive(struct fxd_daemon *daemon, libusb_device *usbdev)
+{
+    struct fxd_request *request;
+    struct fxd_port *port;
+    char path[32];
+
+    fx_usb_path(usbdev, path, sizeof(path));
+    if (!(port = fxd_port(daemon, path)))
+        return;
+
+    /* a board we just programmed coming back from renumeration */
+    if (port->busy || fx_clock() < port->holdoff)
+        return;
+
+    request = calloc(1, sizeof(*request));
+    if (!request)
+        return;
+
+    request->job = daemon->config->autojob;
+    request->usbdev = libusb_ref_device(usbdev);
+    strcpy(request->path, path);
+
+    if (!fxd_enqueue(daemon, request)) {
+        libusb_unref_device(usbdev);
+        free(request);
+        return;
+    }
+
+    port->busy = true;
+    daemon->stats.arrivals++;
+    printf("Daemon: board arrived on %s, queued\n", path);
+}
+
+static int LIBUSB_CALL fxd_hotplug(libusb_context *ctx, libusb_device *usbdev,
+                                   libusb_hotplug_event event, void *pdata)
+{
+    struct fxd_daemon *daemon = pdata;
+
+    pthread_mutex_lock(&daemon->lock);
+    fxd_arrive(daemon, usbdev);
+    pthread_mutex_unlock(&daemon->lock);
+    return 0;
+}
+
+static void *fxd_events(void *pdata)
+{
+    struct fxd_daemon *daemon = pdata;
+    struct timeval timeout = { 0, FXD_POLL_MS * 1000 };
+
+    while (!fxd_stop)
+        libusb_handle_events_timeout_completed(daemon->config->proto->ctx, &timeout, NULL);
+
+    return NULL;
+}
+
+/* without hotplug support, a board arrives when its port shows up in a scan */
+static void *fxd_poller(void *pdata)
+{
+    struct fxd_daemon *daemon = pdata;
+    const struct fxd_config *config = daemon->config;
+    struct libusb_device_descriptor desc;
+    struct fxd_port *port;
+    libusb_device **list;
+    char path[32];
+    ssize_t number, index;
+
+    while (!fxd_stop) {
+        number = libusb_get_device_list(config->proto->ctx, &list);
+        if (number < 0) {
+            usleep(FXD_POLL_MS * 1000);
+            continue;
+        }
+
+        pthread_mutex_lock(&daemon->lock);
+        daemon->scan++;
+
+        for (index = 0; index < number; ++index) {
+            if (libusb_get_device_descriptor(list[index], &desc))
+                continue;
+            if (desc.idVendor != config->vendor || desc.idProduct != config->product)
+                continue;
+
+            fx_usb_path(list[index], path, sizeof(path));
+            if (!(port = fxd_port(daemon, path)))
+                continue;
+
+            /* ports never seen start at zero, the first scan is two */
+            if (port->seen + 1 != daemon->scan)
+                fxd_arrive(daemon, list[index]);
+            port->seen = daemon->scan;
+        }
+
+        pthread_mutex_unlock(&daemon->lock);
+        libusb_free_device_list(list, 1);
+        usleep(FXD_POLL_MS * 1000);
+    }
+
+    return NULL;
+}
+
+/* socket jobs take the first matching board nobody else is working on */
+static libusb_device *fxd_claim(struct fxd_daemon *daemon, char *path, size_t size)
+{
+    const struct fxd_config *config = daemon->config;
+    struct libusb_device_descriptor desc;
+    libusb_device **list, *usbdev = NULL;
+    struct fxd_port *port;
+    ssize_t number, index;
+
+    if ((number = libusb_get_device_list(config->proto->ctx, &list)) < 0)
+        return NULL;
+
+    pthread_mutex_lock(&daemon->lock);
+    for (index = 0; index < number && !usbdev; ++index) {
+        if (libusb_get_device_descriptor(list[index], &desc))
+            continue;
+        if (desc.idVendor != config->vendor || desc.idProduct != config->product)
+            continue;
+
+        fx_usb_path(list[index], path, size);
+        if (!(port = fxd_port(daemon, path)) || port->busy)
+            continue;
+
+        port->busy = true;
+        usbdev = libusb_ref_device(list[index]);
+    }
+    pthread_mutex_unlock(&daemon->lock);
+
+    if (!usbdev)
+        path[0] = '\0';
+
+    libusb_free_device_list(list, 1);
+    return usbdev;
+}
+
+static void fxd_execute(struct fxd_daemon *daemon, struct fxd_request *request)
+{
+    struct fxdev fdev = *daemon->config->proto;
+
+    if (!request->usbdev &&
+        !(request->usbdev = fxd_claim(daemon, request->path, sizeof(request->path)))) {
+        request->errmsg = "Cannot found bootloader mode chip";
+        request->retval = -ENODEV;
+        return;
+    }
+
+    request->errmsg = "Cannot open device";
+    if (!(request->retval = fxdev_open(&fdev, request->usbdev))) {
+        request->retval = fx_run(&fdev, request->job, &request->errmsg, NULL);
+        fxdev_close(&fdev);
+    }
+}
+
+static void fxd_account(struct fxd_daemon *daemon, struct fxd_request *request)
+{
+    struct fxd_stats *stats = &daemon->stats;
+    struct fxd_port *port;
+    double latency;
+    unsigned int bucket;
+
+    latency = request->finished - request->queued;
+    for (bucket = 0; bucket < ARRAY_SIZE(fxd_buckets); ++bucket) {
+        if (latency < fxd_buckets[bucket])
+            break;
+    }
+
+    stats->histogram[bucket]++;
+    stats->wait += request->started - request->queued;
+    stats->latency += latency;
+    stats->max = max(stats->max, latency);
+    stats->last = latency;
+
+    if (request->retval)
+        stats->failed++;
+    else
+        stats->done++;
+
+    if (request->usbdev && (port = fxd_port(daemon, request->path))) {
+        port->busy = false;
+        port->holdoff = request->finished + FXD_HOLDOFF;
+    }
+
+    printf(
+        "Daemon: job on %s %s in %.3fs (waited %.3fs)\n",
+        request->path[0] ? request->path : "-", request->retval ? "failed" : "done",
+        request->finished - request->started, request->started - request->queued
+    );
+}
+
+static void *fxd_worker(void *pdata)
+{
+    struct fxd_daemon *daemon = pdata;
+    struct fxd_request *request;
+    bool arrival;
+
+    pthread_mutex_lock(&daemon->lock);
+    for (;;) {
+        while (!daemon->head && !daemon->stopping)
+            pthread_cond_wait(&daemon->queued, &daemon->lock);
+        if (!(request = daemon->head))
+            break;
+
+        if (!(daemon->head = request->next))
+            daemon->tail = &daemon->head;
+        daemon->pending--;
+        daemon->inflight++;
+        pthread_mutex_unlock(&daemon->lock);
+
+        arrival = request->usbdev;
+        request->started = fx_clock();
+        fxd_execute(daemon, request);
+        request->finished = fx_clock();
+
+        pthread_mutex_lock(&daemon->lock);
+        daemon->inflight--;
+        fxd_account(daemon, request);
+
+        if (request->usbdev)
+            libusb_unref_device(request->usbdev);
+
+        /* arrivals have nobody waiting for the result */
+        if (arrival) {
+            free(request);
+            continue;
+        }
+
+        request->done = true;
+        pthread_cond_broadcast(&daemon->finished);
+    }
+    pthread_mutex_unlock(&daemon->lock);
+
+    return NULL;
+}
+
+static void fxd_report(struct fxd_daemon *daemon, FILE *stream)
+{
+    struct fxd_stats *stats = &daemon->stats;
+    unsigned long count;
+    unsigned int bucket;
+
+    count = stats->done + stats->failed;
+
+    fprintf(stream, "Daemon:\n");
+    fprintf(stream, "  queue: %u, inflight: %u, workers: %u, clients: %u\n",
+            daemon->pending, daemon->inflight, daemon->config->workers, daemon->clients);
+    fprintf(stream, "  done: %lu, failed: %lu, arrivals: %lu\n",
+            stats->done, stats->failed, stats->arrivals);
+    fprintf(stream, "  wait: avg %.3fs\n", count ? stats->wait / count : 0);
+    fprintf(stream, "  latency: avg %.3fs, max %.3fs, last %.3fs\n",
+            count ? stats->latency / count : 0, stats->max, stats->last);
+
+    fprintf(stream, "  histogram:");
+    for (bucket = 0; bucket < ARRAY_SIZE(fxd_buckets); ++bucket)
+        fprintf(stream, " <%gs %lu,", fxd_buckets[bucket], stats->histogram[bucket]);
+    fprintf(stream, " >=%gs %lu\n", fxd_buckets[bucket - 1], stats->histogram[bucket]);
+}
+
+/*
+ * A client sends batch lines and closes its write side, the reply is a
+ * single "ok" or "fail" line. A request of just "stats" returns the
+ * daemon counters instead.
+ */
+static void fxd_serve(struct fxd_daemon *daemon, FILE *input, FILE *output)
+{
+    struct fxd_request *request;
+    char *buff = NULL, *line, *cmd, *save;
+    FILE *stream;
+    size_t size = 0;
+    ssize_t len;
+    bool stats;
+    int retval;
+
+    len = getdelim(&buff, &size, '\0', input);
+    if (len <= 0 || ferror(input)) {
+        if (len > 0)
+            fprintf(output, "fail Request timed out (%d)\n", -ETIMEDOUT);
+        goto finish;
+    }
+
+    if (!(line = strdup(buff)))
+        goto failed;
+
+    cmd = strtok_r(line, " \t\r\n", &save);
+    stats = cmd && !strcmp(cmd, "stats") && !strtok_r(NULL, " \t\r\n", &save);
+    free(line);
+
+    if (stats) {
+        pthread_mutex_lock(&daemon->lock);
+        fxd_report(daemon, output);
+        pthread_mutex_unlock(&daemon->lock);
+        goto finish;
+    }
+
+    if (!(request = calloc(1, sizeof(*request))))
+        goto failed;
+
+    if (!(stream = fmemopen(buff, len, "r"))) {
+        free(request);
+        goto failed;
+    }
+
+    retval = fx_job_parse(&request->own, stream, "request", output);
+    fclose(stream);
+
+    /*
+     * Parsed images stay cached for every later job naming the same file.
+     * The lock covers the lookups only, one client reading and parsing a
+     * large image holds up nobody else.
+     */
+    pthread_mutex_lock(&daemon->lock);
+    fx_job_hold(&request->own, true);
+    fx_job_share(&request->own, daemon->config->cache);
+    pthread_mutex_unlock(&daemon->lock);
+
+    if (!retval)
+        retval = fx_job_load(&request->own);
+    if (!retval)
+        retval = fx_job_own(&request->own);
+
+    pthread_mutex_lock(&daemon->lock);
+    fx_job_share(&request->own, daemon->config->cache);
+    pthread_mutex_unlock(&daemon->lock);
+
+    /* the daemon's stdin is nobody's image */
+    if (!retval && (!request->own.count || fx_job_streams(&request->own)))
+        retval = -EINVAL;
+
+    if (retval) {
+        fprintf(output, "fail Cannot load job (%d)\n", retval);
+        goto release;
+    }
+
+    request->job = &request->own;
+
+    pthread_mutex_lock(&daemon->lock);
+    if (!fxd_enqueue(daemon, request)) {
+        pthread_mutex_unlock(&daemon->lock);
+        fprintf(output, "fail Daemon is stopping (%d)\n", -ESHUTDOWN);
+        goto release;
+    }
+
+    while (!request->done)
+        pthread_cond_wait(&daemon->finished, &daemon->lock);
+    pthread_mutex_unlock(&daemon->lock);
+
+    if (request->retval)
+        fprintf(output, "fail %s (%d)", request->errmsg, request->retval);
+    else
+        fprintf(output, "ok");
+
+    fprintf(
+        output, " on %s wait=%.3fs run=%.3fs\n", request->path[0] ? request->path : "-",
+        request->started - request->queued, request->finished - request->started
+    );
+
+release:
+    /* whatever this job superseded goes once the last job using it is done */
+    pthread_mutex_lock(&daemon->lock);
+    fx_job_hold(&request->own, false);
+    fx_job_prune(daemon->config->cache);
+    pthread_mutex_unlock(&daemon->lock);
+    /* files still listed here never made it into the cache */
+    fx_job_release(&request->own, true);
+    free(request);
+    goto finish;
+
+failed:
+    fprintf(output, "fail Cannot allocate request (%d)\n", -ENOMEM);
+finish:
+    free(buff);
+}
+
+static void *fxd_client(void *pdata)
+{
+    struct fxd_client *client = pdata;
+    struct fxd_daemon *daemon = client->daemon;
+    FILE *input, *output = NULL;
+
+    if ((input = fdopen(client->fd, "r")))
+        output = fdopen(dup(client->fd), "w");
+
+    if (output) {
+        fxd_serve(daemon, input, output);
+        fclose(output);
+    }
+
+    if (input)
+        fclose(input);
+    else
+        close(client->fd);
+
+    pthread_mutex_lock(&daemon->lock);
+    daemon->clients--;
+    pthread_cond_broadcast(&daemon->finished);
+    pthread_mutex_unlock(&daemon->lock);
+
+    free(client);
+    return NULL;
+}
+
+static int fxd_listen(const char *name)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd, retval;
+
+    if (strlen(name) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", name);
+        return -ENAMETOOLONG;
+    }
+
+    strcpy(addr.sun_path, name);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        retval = -errno;
+        fprintf(stderr, "Cannot create socket: %s\n", strerror(errno));
+        return retval;
+    }
+
+    /* a socket nobody answers on is left over from an earlier daemon */
+    if (!connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        fprintf(stderr, "Daemon already running on %s\n", name);
+        close(fd);
+        return -EADDRINUSE;
+    }
+
+    if (errno == ECONNREFUSED)
+        unlink(name);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 16)) {
+        retval = -errno;
+        fprintf(stderr, "Cannot listen on %s: %s\n", name, strerror(errno));
+        close(fd);
+        return retval;
+    }
+
+    return fd;
+}
+
+int fx_daemon(const struct fxd_config *config)
+{
+    struct fxd_daemon daemon = {
+        .config = config,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .queued = PTHREAD_COND_INITIALIZER,
+        .finished = PTHREAD_COND_INITIALIZER,
+    };
+    libusb_hotplug_callback_handle hotplug;
+    pthread_t *workers, monitor, thread;
+    struct sigaction action = {};
+    struct fxd_client *client;
+    struct pollfd pfd;
+    bool hotplugged = false, monitored = false;
+    unsigned int count, started;
+    struct fxd_port *port;
+    int fd, retval = 0;
+
+    daemon.tail = &daemon.head;
+    daemon.scan = 1;
+
+    /* the log is usually redirected, keep it readable while it runs */
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    if ((pfd.fd = fxd_listen(config->socket)) < 0)
+        return pfd.fd;
+    pfd.events = POLLIN;
+
+    workers = calloc(config->workers, sizeof(*workers));
+    if (!workers) {
+        retval = -ENOMEM;
+        goto finish;
+    }
+
+    action.sa_handler = fxd_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    for (started = 0; started < config->workers; ++started) {
+        if ((retval = -pthread_create(&workers[started], NULL, fxd_worker, &daemon))) {
+            fprintf(stderr, "Cannot create worker: %s\n", strerror(-retval));
+            goto stop;
+        }
+    }
+
+    if (config->autojob) {
+        if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+            !libusb_hotplug_register_callback(
+                config->proto->ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+                LIBUSB_HOTPLUG_ENUMERATE, config->vendor, config->product,
+                LIBUSB_HOTPLUG_MATCH_ANY, fxd_hotplug, &daemon, &hotplug))
+            hotplugged = true;
+
+        if ((retval = -pthread_create(&monitor, NULL, hotplugged ? fxd_events : fxd_poller, &daemon))) {
+            fprintf(stderr, "Cannot create monitor: %s\n", strerror(-retval));
+            goto stop;
+        }
+        monitored = true;
+    }
+
+    printf(
+        "Daemon listening on %s, %u workers, auto-program %s\n", config->socket,
+        config->workers, !config->autojob ? "off" : hotplugged ? "hotplug" : "polling"
+    );
+    fflush(stdout);
+
+    while (!fxd_stop) {
+        if (poll(&pfd, 1, FXD_POLL_MS) <= 0)
+            continue;
+
+        if ((fd = accept(pfd.fd, NULL, NULL)) < 0)
+            continue;
+
+        /* a client that never finishes its request cannot hold up shutdown */
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO,
+                   &(struct timeval){ FXD_CLIENT_TIMEOUT, 0 }, sizeof(struct timeval));
+
+        if (!(client = malloc(sizeof(*client)))) {
+            close(fd);
+            continue;
+        }
+
+        client->daemon = &daemon;
+        client->fd = fd;
+
+        pthread_mutex_lock(&daemon.lock);
+        daemon.clients++;
+        pthread_mutex_unlock(&daemon.lock);
+
+        if (pthread_create(&thread, NULL, fxd_client, client)) {
+            pthread_mutex_lock(&daemon.lock);
+            daemon.clients--;
+            pthread_mutex_unlock(&daemon.lock);
+            close(fd);
+            free(client);
+            continue;
+        }
+
+        pthread_detach(thread);
+    }
+
+    printf("Daemon stopping, finishing %u queued jobs\n", daemon.pending + daemon.inflight);
+
+stop:
+    fxd_stop = 1;
+    close(pfd.fd);
+    pfd.fd = -1;
+
+    if (monitored)
+        pthread_join(monitor, NULL);
+    if (hotplugged)
+        libusb_hotplug_deregister_callback(config->proto->ctx, hotplug);
+
+    /* queued jobs still run, clients get their answer before we leave */
+    pthread_mutex_lock(&daemon.lock);
+    daemon.stopping = true;
+    pthread_cond_broadcast(&daemon.queued);
+    pthread_mutex_unlock(&daemon.lock);
+
+    for (count = 0; count < started; ++count)
+        pthread_join(workers[count], NULL);
+
+    pthread_mutex_lock(&daemon.lock);
+    while (daemon.clients)
+        pthread_cond_wait(&daemon.finished, &daemon.lock);
+    fxd_report(&daemon, stdout);
+    pthread_mutex_unlock(&daemon.lock);
+
+    while ((port = daemon.ports)) {
+        daemon.ports = port->next;
+        free(port);
+    }
+
+finish:
+    if (pfd.fd >= 0)
+        close(pfd.fd);
+    unlink(config->socket);
+    free(workers);
+    return retval;
+}
+
+int fx_daemon_connect(const char *name, const struct fx_job *job)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    const struct fx_opdesc *desc;
+    const struct fx_op *op;
+    char path[PATH_MAX], *line = NULL;
+    FILE *input, *output;
+    unsigned int index;
+    uint16_t offset = 0;
+    size_t size = 0;
+    int fd, retval = 0;
+
+    if (strlen(name) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", name);
+        return -ENAMETOOLONG;
+    }
+
+    strcpy(addr.sun_path, name);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+        connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        retval = -errno;
+        fprintf(stderr, "Cannot connect to %s: %s\n", name, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return retval;
+    }
+
+    if (!(output = fdopen(dup(fd), "w")) || !(input = fdopen(fd, "r"))) {
+        fprintf(stderr, "Cannot open socket stream: %s\n", strerror(errno));
+        if (output)
+            fclose(output);
+        close(fd);
+        return -ENOMEM;
+    }
+
+    /* the daemon runs elsewhere, send files as absolute paths */
+    for (index = 0; index < job->count; ++index) {
+        op = &job->ops[index];
+        desc = &fx_opdescs[op->type];
+
+        if (op->file && op->file->offset != offset) {
+            offset = op->file->offset;
+            fprintf(output, "offset 0x%04x\n", offset);
+        }
+
+        if (desc->arg == FX_ARG_FILE)
+            fprintf(output, "%s %s\n", desc->name,
+                    realpath(op->file->name, path) ? path : op->file->name);
+        else if (desc->arg == FX_ARG_VALUE)
+            fprintf(output, "%s 0x%lx\n", desc->name, op->value);
+        else
+            fprintf(output, "%s\n", desc->name);
+    }
+
+    if (!job->count)
+        fprintf(output, "stats\n");
+
+    /* end of request, the reply comes back on the same socket */
+    fflush(output);
+    shutdown(fileno(output), SHUT_WR);
+    fclose(output);
+
+    while (getline(&line, &size, input) >= 0) {
+        fputs(line, stdout);
+        if (!strncmp(line, "fail", 4))
+            retval = -EIO;
+    }
+
+    free(line);
+    fclose(input);
+    return retval;
+}
@@ -0,0 +1,590 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright(c) 2021-2022 John Sanpe <sanpeqf@gmail.com>
+ */
+
+#include "fxprog.h"
+#include <stdatomic.h>
+#include <unistd.h>
+
+struct ezusb_xfer {
+    struct ezusb_engine *engine;
+    struct libusb_transfer *transfer;
+    struct fxretry_rtt *rtt;
+    const char *label;
+    void *result;
+    size_t length;
+    size_t capacity;
+    unsigned int retry;
+    unsigned int attempts;
+    double submitted;
+    double due;
+    bool stalled;
+    atomic_bool waiting;
+    atomic_bool busy;
+};
+
+/**
+ * struct ezusb_engine - transfer queue of one device
+ * @fdev: device the transfers go to
+ * @xfers: transfer slots, @depth of them
+ * @depth: transfers kept in flight at most
+ * @inflight: slots submitted and not finished yet, waiting retries included
+ * @waiting: retries sitting out their backoff
+ * @halted: bulk endpoints to clear, see ezusb_halt_bit()
+ * @seed: backoff jitter state, completions only
+ * @completed: set by a completion to end libusb_handle_events_completed()
+ * @error: first error a transfer finished with
+ *
+ * Gang and daemon workers share one libusb context, a completion runs on
+ * whichever thread handles events at the time. Everything it shares with
+ * the submitting thread is atomic. @completed is the one exception, libusb
+ * takes it as a plain int and reads it under its own event lock.
+ */
+struct ezusb_engine {
+    struct fxdev *fdev;
+    struct ezusb_xfer *xfers;
+    unsigned int depth;
+    atomic_uint inflight;
+    atomic_uint waiting;
+    atomic_uint halted;
+    unsigned int seed;
+    int completed;
+    atomic_int error;
+};
+
+static int ezusb_status_error(enum libusb_transfer_status status)
+{
+    switch (status) {
+        case LIBUSB_TRANSFER_COMPLETED:
+            return 0;
+
+        case LIBUSB_TRANSFER_TIMED_OUT:
+            return LIBUSB_ERROR_TIMEOUT;
+
+        case LIBUSB_TRANSFER_STALL:
+            return LIBUSB_ERROR_PIPE;
+
+        case LIBUSB_TRANSFER_NO_DEVICE:
+            return LIBUSB_ERROR_NO_DEVICE;
+
+        case LIBUSB_TRANSFER_OVERFLOW:
+            return LIBUSB_ERROR_OVERFLOW;
+
+        case LIBUSB_TRANSFER_CANCELLED:
+            return LIBUSB_ERROR_INTERRUPTED;
+
+        default:
+            return LIBUSB_ERROR_IO;
+    }
+}
+
+static inline bool ezusb_is_bulk(struct libusb_transfer *transfer)
+{
+    return transfer->type == LIBUSB_TRANSFER_TYPE_BULK;
+}
+
+/* halted endpoints as a mask, out endpoints in the low half */
+static inline unsigned int ezusb_halt_bit(uint8_t endpoint)
+{
+    return 1U << ((endpoint & 0x0f) | (endpoint & LIBUSB_ENDPOINT_IN ? 16 : 0));
+}
+
+static inline uint8_t ezusb_halt_endpoint(unsigned int bit)
+{
+    return (bit & 0x0f) | (bit & 16 ? LIBUSB_ENDPOINT_IN : 0);
+}
+
+static void ezusb_report(struct ezusb_xfer *xfer, int error)
+{
+    struct libusb_control_setup *setup;
+
+    if (ezusb_is_bulk(xfer->transfer)) {
+        fprintf(
+            stderr, "ezusb_bulk '%s' on ep 0x%02x failed: %s\n",
+            xfer->label, xfer->transfer->endpoint, libusb_error_name(error)
+        );
+        return;
+    }
+
+    setup = libusb_control_transfer_get_setup(xfer->transfer);
+    fprintf(
+        stderr, "ezusb_%s '%s' 0x%02x at 0x%04x failed: %s\n",
+        setup->bmRequestType & LIBUSB_ENDPOINT_IN ? "read" : "write",
+        xfer->label, setup->bRequest, libusb_le16_to_cpu(setup->wValue),
+        libusb_error_name(error)
+    );
+}
+
+static void ezusb_finish(struct ezusb_xfer *xfer, int error)
+{
+    struct libusb_transfer *transfer = xfer->transfer;
+    struct ezusb_engine *engine = xfer->engine;
+    struct fxdev *fdev = engine->fdev;
+    struct fxdev_stats *stats = &fdev->stats;
+    struct libusb_control_setup *setup;
+    bool bulk = ezusb_is_bulk(transfer);
+    int first = 0;
+    uint8_t *data;
+
+    /* a retried transfer says nothing clear about latency, leave it out */
+    if (unlikely(fdev->policy.adapt) && !error && !bulk && xfer->attempts == 1)
+        fxretry_sample(xfer->rtt, fx_clock() - xfer->submitted, xfer->length);
+
+    if (unlikely(fdev->profile) && bulk) {
+        fxdev_stats_bulk(
+            stats, transfer->endpoint, error ? 0 : transfer->actual_length,
+            fx_clock() - xfer->submitted, error
+        );
+    } else if (unlikely(fdev->profile)) {
+        setup = libusb_control_transfer_get_setup(transfer);
+        fxdev_stats_record(
+            stats, setup->bmRequestType, setup->bRequest,
+            error ? 0 : transfer->actual_length, fx_clock() - xfer->submitted,
+            xfer->attempts - 1, error
+        );
+    }
+
+    /* the trace format describes control requests only */
+    if (unlikely(fdev->trace) && !bulk)
+        fxtrace_record(fdev->trace, transfer, xfer->submitted, xfer->attempts - 1, error);
+
+    if (error) {
+        ezusb_report(xfer, error);
+        stats->errors++;
+        atomic_compare_exchange_strong(&engine->error, &first, error);
+    } else {
+        stats->transfers++;
+        stats->bytes += transfer->actual_length;
+        data = bulk ? transfer->buffer : libusb_control_transfer_get_data(transfer);
+        if (xfer->result)
+            memcpy(xfer->result, data, min((size_t)transfer->actual_length, xfer->length));
+    }
+
+    xfer->busy = false;
+    engine->inflight--;
+    engine->completed = 1;
+}
+
+/*
+ * Decide what a failed attempt gets. Returns 0 once the transfer is on
+ * its way again, now or when its backoff runs out, otherwise the error
+ * it completes with.
+ */
+static int ezusb_retry(struct ezusb_xfer *xfer, int error)
+{
+    struct libusb_transfer *transfer = xfer->transfer;
+    struct ezusb_engine *engine = xfer->engine;
+    struct fxdev *fdev = engine->fdev;
+    struct fxdev_policy *policy = &fdev->stats.policy;
+    bool bulk = ezusb_is_bulk(transfer);
+    double backoff;
+
+    switch (fxretry_classify(error)) {
+        case FXRETRY_FATAL:
+            policy->fatal++;
+            return error;
+
+        case FXRETRY_STALL:
+            policy->stalls++;
+            /* a bulk endpoint stays halted until it is cleared */
+            if (bulk) {
+                engine->halted |= ezusb_halt_bit(transfer->endpoint);
+                return error;
+            }
+            /* ep0 drops a stall with the next setup, stalling twice is a refusal */
+            if (xfer->stalled)
+                return error;
+            xfer->stalled = true;
+            fdev->stats.retries++;
+            xfer->attempts++;
+            return fdev->transport->submit(fdev, transfer);
+
+        case FXRETRY_TRANSIENT:
+            break;
+    }
+
+    if (!--xfer->retry) {
+        policy->exhausted++;
+        return error;
+    }
+
+    fdev->stats.retries++;
+    xfer->attempts++;
+    backoff = fxretry_backoff(&fdev->policy, xfer->attempts - 1, &engine->seed);
+    policy->transient++;
+    policy->backoff += backoff;
+
+    /* the adapted timeout undershot, the retry gets twice as long */
+    if (error == LIBUSB_ERROR_TIMEOUT && fdev->policy.adapt && !bulk) {
+        transfer->timeout = min(transfer->timeout * 2, max(fdev->policy.timeout_max, fdev->timeout));
+        policy->stretched++;
+    }
+
+    if (backoff > 0) {
+        xfer->due = fx_clock() + backoff;
+        xfer->waiting = true;
+        engine->waiting++;
+        return 0;
+    }
+
+    return fdev->transport->submit(fdev, transfer);
+}
+
+/* completions may be reaped by whichever thread runs the libusb event loop */
+static void LIBUSB_CALL ezusb_complete(struct libusb_transfer *transfer)
+{
+    struct ezusb_xfer *xfer = transfer->user_data;
+    int error;
+
+    error = ezusb_status_error(transfer->status);
+
+    /* a short bulk read leaves the loader's reply stream out of step */
+    if (!error && ezusb_is_bulk(transfer) && transfer->actual_length != transfer->length)
+        error = LIBUSB_ERROR_IO;
+
+    if (error && !(error = ezusb_retry(xfer, error)))
+        return;
+
+    ezusb_finish(xfer, error);
+}
+
+static int ezusb_setup(struct fxdev *fdev)
+{
+    struct ezusb_engine *engine;
+    unsigned int depth, count;
+
+    depth = max(fdev->queue_depth, 1U);
+    if (fdev->engine && fdev->engine->depth == depth)
+        return 0;
+
+    engine = calloc(1, sizeof(*engine));
+    if (!engine)
+        return -ENOMEM;
+
+    engine->xfers = calloc(depth, sizeof(*engine->xfers));
+    if (!engine->xfers)
+        goto failed;
+
+    for (count = 0; count < depth; ++count) {
+        engine->xfers[count].transfer = libusb_alloc_transfer(0);
+        if (!engine->xfers[count].transfer)
+            goto failed;
+        engine->xfers[count].transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+        engine->xfers[count].engine = engine;
+    }
+
+    ezusb_release(fdev);
+    engine->fdev = fdev;
+    engine->depth = depth;
+    engine->seed = fx_clock() * 1e9;
+    fdev->engine = engine;
+    return 0;
+
+failed:
+    while (engine->xfers && count--)
+        libusb_free_transfer(engine->xfers[count].transfer);
+    free(engine->xfers);
+    free(engine);
+    return -ENOMEM;
+}
+
+void ezusb_release(struct fxdev *fdev)
+{
+    struct ezusb_engine *engine = fdev->engine;
+    unsigned int count;
+
+    if (!engine)
+        return;
+
+    ezusb_flush(fdev);
+
+    for (count = 0; count < engine->depth; ++count)
+        libusb_free_transfer(engine->xfers[count].transfer);
+
+    free(engine->xfers);
+    free(engine);
+    fdev->engine = NULL;
+}
+
+/*
+ * Retries whose backoff ran out go back on the wire. With nothing else
+ * in flight whose completion could wake us, sleep until the first is due
+ * unless @sleep is false. Returns when the next one is due, 0 for none
+ * left waiting.
+ */
+static double ezusb_resubmit(struct ezusb_engine *engine, bool sleep)
+{
+    struct fxdev *fdev = engine->fdev;
+    struct ezusb_xfer *xfer;
+    unsigned int count;
+    double now, first = 0;
+    int error;
+
+    while (engine->waiting) {
+        now = fx_clock();
+        first = 0;
+
+        for (count = 0; count < engine->depth; ++count) {
+            xfer = &engine->xfers[count];
+            if (!xfer->waiting)
+                continue;
+
+            if (xfer->due > now) {
+                first = first ? min(first, xfer->due) : xfer->due;
+                continue;
+            }
+
+            xfer->waiting = false;
+            engine->waiting--;
+            if ((error = fdev->transport->submit(fdev, xfer->transfer)))
+                ezusb_finish(xfer, error);
+        }
+
+        if (!first || !sleep || engine->inflight > engine->waiting)
+            return first;
+
+        usleep((first - now) * 1e6);
+    }
+
+    return 0;
+}
+
+static int ezusb_event(struct ezusb_engine *engine)
+{
+    double deadline = 0;
+    int retval;
+
+    if (engine->waiting)
+        deadline = ezusb_resubmit(engine, true);
+
+    /* the retry that could not go out again may have been the last one */
+    if (!engine->inflight)
+        return 0;
+
+    engine->completed = 0;
+    /* an unrelated completion must not hold back a retry that is due */
+    retval = engine->fdev->transport->event(engine->fdev, &engine->completed, deadline);
+    if (retval && retval != LIBUSB_ERROR_INTERRUPTED)
+        return retval;
+
+    return 0;
+}
+
+static int ezusb_abort(struct fxdev *fdev, int error)
+{
+    /* drain what is still in flight so the next job starts clean */
+    ezusb_flush(fdev);
+    return error;
+}
+
+/* wait for a free transfer whose buffer holds @len bytes */
+static int ezusb_acquire(struct fxdev *fdev, size_t len, struct ezusb_xfer **xferp)
+{
+    struct libusb_transfer *transfer;
+    struct ezusb_engine *engine;
+    struct ezusb_xfer *xfer;
+    unsigned int count;
+    uint8_t *buffer;
+    int retval;
+
+    if ((retval = ezusb_setup(fdev)))
+        return retval;
+
+    engine = fdev->engine;
+    while (engine->inflight >= engine->depth) {
+        if ((retval = ezusb_event(engine)))
+            return ezusb_abort(fdev, retval);
+    }
+
+    if (engine->error)
+        return ezusb_abort(fdev, engine->error);
+
+    for (count = 0; engine->xfers[count].busy; ++count);
+    xfer = &engine->xfers[count];
+    transfer = xfer->transfer;
+
+    if (xfer->capacity < len) {
+        xfer->capacity = max(len, (size_t)fdev->chunk);
+        buffer = realloc(transfer->buffer, LIBUSB_CONTROL_SETUP_SIZE + xfer->capacity);
+        if (!buffer) {
+            xfer->capacity = 0;
+            return ezusb_abort(fdev, -ENOMEM);
+        }
+        transfer->buffer = buffer;
+    }
+
+    *xferp = xfer;
+    return 0;
+}
+
+static int ezusb_issue(struct fxdev *fdev, struct ezusb_xfer *xfer, const char *label,
+                       void *result, size_t len, unsigned int retry)
+{
+    int retval;
+
+    xfer->label = label;
+    xfer->result = result;
+    xfer->length = len;
+    xfer->retry = max(retry, 1U);
+    xfer->attempts = 1;
+    xfer->stalled = false;
+    xfer->waiting = false;
+
+    /* one clock read per transfer, and only when asked for */
+    if (unlikely(fdev->profile || fdev->trace || fdev->policy.adapt))
+        xfer->submitted = fx_clock();
+
+    /* another thread may reap the completion before submit returns */
+    xfer->busy = true;
+    fdev->engine->inflight++;
+
+    if ((retval = fdev->transport->submit(fdev, xfer->transfer))) {
+        xfer->busy = false;
+        fdev->engine->inflight--;
+        ezusb_report(xfer, retval);
+        return ezusb_abort(fdev, retval);
+    }
+
+    return 0;
+}
+
+int ezusb_request(struct fxdev *fdev, const char *label, uint8_t direction, uint8_t opcode,
+                  uint16_t value, uint16_t index, void *data, size_t len)
+{
+    struct libusb_transfer *transfer;
+    struct ezusb_xfer *xfer;
+    unsigned int timeout;
+    int retval;
+
+    if ((retval = ezusb_acquire(fdev, len, &xfer)))
+        return retval;
+
+    xfer->rtt = &fdev->rtt[fxdev_stats_slot(opcode)];
+    timeout = fxretry_timeout(fdev, xfer->rtt, len);
+    if (timeout != fdev->timeout) {
+        fdev->stats.policy.adapted++;
+        fdev->stats.policy.timeout = max(fdev->stats.policy.timeout, timeout);
+    }
+
+    transfer = xfer->transfer;
+    libusb_fill_control_setup(
+        transfer->buffer,
+        direction | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+        opcode, value, index, len
+    );
+
+    if (direction == LIBUSB_ENDPOINT_OUT)
+        memcpy(libusb_control_transfer_get_data(transfer), data, len);
+
+    libusb_fill_control_transfer(
+        transfer, fdev->handle, transfer->buffer,
+        ezusb_complete, xfer, timeout
+    );
+
+    return ezusb_issue(
+        fdev, xfer, label, direction == LIBUSB_ENDPOINT_IN ? data : NULL,
+        len, fdev->retry
+    );
+}
+
+int ezusb_submit(struct fxdev *fdev, const char *label, uint8_t direction,
+                 uint8_t opcode, uint16_t addr, void *data, size_t len)
+{
+    return ezusb_request(fdev, label, direction, opcode, addr, 0, data, len);
+}
+
+/*
+ * Bulk transfers share the queue with control requests. An OUT transfer
+ * carries @head and then @data, an IN transfer reads @len bytes into
+ * @data. Neither is retried, a resent piece would shift the stream the
+ * loader parses.
+ */
+int ezusb_submit_bulk(struct fxdev *fdev, const char *label, uint8_t endpoint,
+                      const void *head, size_t hlen, void *data, size_t len)
+{
+    struct libusb_transfer *transfer;
+    struct ezusb_xfer *xfer;
+    bool in = endpoint & LIBUSB_ENDPOINT_IN;
+    int retval;
+
+    if ((retval = ezusb_acquire(fdev, hlen + len, &xfer)))
+        return retval;
+
+    transfer = xfer->transfer;
+    if (!in) {
+        memcpy(transfer->buffer, head, hlen);
+        memcpy(transfer->buffer + hlen, data, len);
+    }
+
+    /* the loader drains frames in order, each one queued ahead costs a turn */
+    libusb_fill_bulk_transfer(
+        transfer, fdev->handle, endpoint, transfer->buffer,
+        hlen + len, ezusb_complete, xfer, fdev->timeout * max(fdev->queue_depth, 1U)
+    );
+
+    return ezusb_issue(fdev, xfer, label, in ? data : NULL, len, 1);
+}
+
+/*
+ * Reap the transfers that already completed and put due retries back on
+ * the wire, without waiting for the rest. Returns the first error any
+ * of them latched, it stays latched for ezusb_flush().
+ */
+int ezusb_poll(struct fxdev *fdev)
+{
+    struct ezusb_engine *engine = fdev->engine;
+    int retval;
+
+    if (!engine)
+        return 0;
+
+    if (engine->waiting)
+        ezusb_resubmit(engine, false);
+
+    /* a retry still backing off has nothing the event loop could reap */
+    if (engine->inflight > engine->waiting) {
+        engine->completed = 0;
+        retval = fdev->transport->event(fdev, &engine->completed, fx_clock());
+        if (retval && retval != LIBUSB_ERROR_INTERRUPTED)
+            return retval;
+    }
+
+    return engine->error;
+}
+
+int ezusb_flush(struct fxdev *fdev)
+{
+    struct ezusb_engine *engine = fdev->engine;
+    unsigned int bit;
+    int retval, error;
+
+    if (!engine)
+        return 0;
+
+    while (engine->inflight) {
+        if ((retval = ezusb_event(engine)))
+            return retval;
+    }
+
+    retval = atomic_exchange(&engine->error, 0);
+
+    /* a stalled bulk endpoint is cleared, the next stream starts on a clean pipe */
+    while (engine->halted) {
+        bit = __builtin_ctz(engine->halted);
+        engine->halted &= ~(1U << bit);
+        fdev->stats.policy.halts++;
+        if ((error = fdev->transport->clear_halt(fdev, ezusb_halt_endpoint(bit))) && !retval)
+            retval = error;
+    }
+
+    /* bulk frames only count once the loader reports them applied */
+    if (fdev->frames) {
+        if (retval)
+            fdev->frames = 0;
+        else
+            retval = ezusb_loader_sync(fdev);
+    }
+
+    return retval;
+}
@@ -11,15 +11,35 @@
 #define FX_USB_VENDOR               0x04b4
 #define FX_USB_PRODUCT              0x8613
 #define FX_USB_TIMEOUT              1000
+#define FX_USB_TRANSFER_MAX         4096
+#define FX_USB_TRANSFER_MIN         64
+#define FX_USB_QUEUE_DEPTH          8
+#define FX_USB_RETRY                5
+#define FX_USB_RENUM_TIMEOUT        5000
+#define FX_USB_RENUM_POLL           20
+#define FX_USB_PORT_DEPTH           7
+#define FX_STREAM_SLOTS             16
+#define FX_JOURNAL_SEGMENT          0x1000
+#define FX_PROBE_MAX                0x4000
+#define FX_PROBE_ROUNDS             2
+#define FX_PROBE_SLACK              5
 
 #define FX_CMD_RW_INTERNAL          0xa0
 #define FX_CMD_RW_EEPROM            0xa2
 #define FX_CMD_RW_MEMORY            0xa3
 #define FX_CMD_EEPROM_SIZE          0xa5
+#define FX_CMD_LOADER_INFO          0xb0
+#define FX_CMD_LOADER_STATUS        0xb1
+#define FX_CMD_CRC_EEPROM           0xb2
+
+#define FX_EEPROM_INFO_SINGLE       0x00
+#define FX_EEPROM_INFO_DOUBLE       0x01
 
 #define FX_RESET_REG_FX             0x7f92
 #define FX_RESET_REG_FX2            0xe600
 
+#define FX_EEPROM_BOOT_C2           0xc2
+
 #define FX_EEPROM_MODE              0x00
 #define FX_EEPROM_VENDOR            0x01
 #define FX_EEPROM_PRODUCT           0x03
@@ -27,11 +47,47 @@
 #define FX_EEPROM_CONFIG            0x07
 #define FX_EEPROM_HEADER            0x08
 #define FX_EEPROM_FIRMWARE          0x0c
+#define FX_EEPROM_PAGE_MIN          8
+#define FX_EEPROM_PAGE_US           5000
 
 #define FX_FIRMWARE_LENH            0x00
 #define FX_FIRMWARE_LENL            0x01
 #define FX_FIRMWARE_ADDRH           0x02
 #define FX_FIRMWARE_ADDRL           0x03
 #define FX_FIRMWARE_LAST            0x80
+#define FX_FIRMWARE_RECORD          1023
+
+/* companion bulk loader, see loader/bulkload.c */
+#define FX_LOADER_MAGIC             0x4c46
+#define FX_LOADER_VERSION           1
+#define FX_LOADER_INFO              4
+#define FX_LOADER_STATUS            4
+#define FX_LOADER_CRC               4
+#define FX_LOADER_CRC_LEAF          64
+#define FX_LOADER_CRC_BATCH         16
+#define FX_LOADER_ALTSETTING        1
+#define FX_LOADER_EP_OUT            0x02
+#define FX_LOADER_EP_IN             0x86
+#define FX_LOADER_FRAME_MAX         4096
+
+#define FX_LOADER_FEATURE_CRC       0x01
+
+#define FX_LOADER_OP_WRITE_MEMORY   0x01
+#define FX_LOADER_OP_WRITE_EEPROM   0x02
+#define FX_LOADER_OP_READ_MEMORY    0x03
+#define FX_LOADER_OP_READ_EEPROM    0x04
+
+#define FX_LOADER_OK                0x00
+#define FX_LOADER_ECRC              0x01
+#define FX_LOADER_EFRAME            0x02
+#define FX_LOADER_ERANGE            0x03
+#define FX_LOADER_EEEPROM           0x04
+
+#define FX_FRAME_OP                 0x00
+#define FX_FRAME_SEQ                0x01
+#define FX_FRAME_ADDR               0x02
+#define FX_FRAME_LENGTH             0x04
+#define FX_FRAME_CRC                0x06
+#define FX_FRAME_HEADER             0x08
 
 #endif  /* _FXHW_H_ */
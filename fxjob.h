@@ -0,0 +1,149 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright(c) 2021-2022 John Sanpe <sanpeqf@gmail.com>
+ */
+
+#ifndef _FXJOB_H_
+#define _FXJOB_H_
+
+#include "fxprog.h"
+
+/**
+ * struct fx_file - image file, parsed once and shared by every operation
+ * @next: next cached file
+ * @name: path the image was loaded from
+ * @image: parsed image
+ * @offset: address a raw binary image is placed at
+ * @map: file mapping a raw binary @image refers to, NULL once copied out
+ * @mapsize: length of @map
+ * @mtime: modification time when parsed
+ * @users: queued or running jobs referring to it
+ * @loaded: @image holds the file content
+ * @stale: file changed on disk, superseded by a newer entry
+ * @stream: "-", read from stdin while the operation runs
+ */
+struct fx_file {
+    struct fx_file *next;
+    char *name;
+    struct fximage image;
+    uint16_t offset;
+    void *map;
+    size_t mapsize;
+    struct timespec mtime;
+    unsigned int users;
+    bool loaded;
+    bool stale;
+    bool stream;
+};
+
+/* command line flags run in this order, whatever order they were given in */
+enum fx_op_type {
+    FX_OP_MEMORY,
+    FX_OP_INFO,
+    FX_OP_ERASE,
+    FX_OP_FLASH,
+    FX_OP_MODE,
+    FX_OP_VENDOR,
+    FX_OP_PRODUCT,
+    FX_OP_DEVICE,
+    FX_OP_CONFIG,
+    FX_OP_FIRMWARE,
+    FX_OP_VERIFY_FLASH,
+    FX_OP_VERIFY_MEMORY,
+    FX_OP_RESET,
+};
+
+enum fx_op_arg {
+    FX_ARG_NONE,
+    FX_ARG_FILE,
+    FX_ARG_VALUE,
+};
+
+struct fx_op {
+    enum fx_op_type type;
+    struct fx_file *file;
+    unsigned long value;
+};
+
+/**
+ * struct fx_job - ordered list of operations run in one session
+ * @ops: operations in execution order
+ * @count: valid entries in @ops
+ * @size: allocated entries in @ops
+ * @files: images referenced by @ops, may be shared across jobs
+ */
+struct fx_job {
+    struct fx_op *ops;
+    unsigned int count;
+    unsigned int size;
+    struct fx_file *files;
+    uint16_t offset;
+};
+
+struct fx_stage {
+    const char *name;
+    double seconds;
+};
+
+struct fx_timing {
+    struct fx_stage stages[64];
+    unsigned int count;
+    double start;
+    double last;
+};
+
+struct fx_opdesc {
+    const char *name;
+    enum fx_op_arg arg;
+    unsigned int field;
+    const char *errmsg;
+};
+
+/**
+ * struct fxd_config - persistent daemon settings
+ * @socket: unix socket jobs are accepted on
+ * @proto: device settings copied into every job
+ * @vendor: usb vendor id of the boards served
+ * @product: usb product id of the boards served
+ * @autojob: operations run on every arriving board, NULL disables
+ * @cache: parsed images shared by every job
+ * @workers: jobs run in parallel
+ */
+struct fxd_config {
+    const char *socket;
+    const struct fxdev *proto;
+    uint16_t vendor;
+    uint16_t product;
+    const struct fx_job *autojob;
+    struct fx_job *cache;
+    unsigned int workers;
+};
+
+extern const struct fx_opdesc fx_opdescs[FX_OP_RESET + 1];
+
+extern int fx_file_load(struct fx_file *file);
+extern struct fx_file *fx_job_file(struct fx_job *job, const char *name);
+extern int fx_job_add(struct fx_job *job, enum fx_op_type type, const char *arg);
+extern int fx_job_load(struct fx_job *job);
+extern int fx_job_own(struct fx_job *job);
+extern bool fx_job_streams(const struct fx_job *job);
+extern int fx_job_parse(struct fx_job *job, FILE *stream, const char *name, FILE *log);
+extern void fx_job_sort(struct fx_job *job);
+extern void fx_job_release(struct fx_job *job, bool files);
+extern void fx_job_share(struct fx_job *job, struct fx_job *cache);
+extern void fx_job_hold(struct fx_job *job, bool hold);
+extern void fx_job_prune(struct fx_job *cache);
+
+extern void fx_timing_init(struct fx_timing *timing);
+extern void fx_timing_stage(struct fx_timing *timing, const char *name);
+extern void fx_timing_report(struct fx_timing *timing);
+
+extern void fx_usb_path(libusb_device *usbdev, char *buff, size_t size);
+extern int fx_compile(struct fxdev *fdev, const struct fx_job *job, const char *name);
+extern int fx_run(struct fxdev *fdev, const struct fx_job *job, const char **errmsg,
+                  struct fx_timing *timing);
+
+extern int fx_daemon(const struct fxd_config *config);
+extern int fx_daemon_connect(const char *name, const struct fx_job *job);
+
+#endif  /* _FXJOB_H_ */
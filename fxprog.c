@@ -4,250 +4,1807 @@
  */
 
 #include "fxprog.h"
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <unistd.h>
 
-libusb_device_handle *fx_usb_device;
-enum fxdev_type device_type;
-typedef bool (*is_external_t)(uint16_t addr, size_t length);
+static int ezusb_read(struct fxdev *fdev, const char *label, uint8_t opcode,
+                      uint16_t addr, uint8_t *data, size_t len)
+{
+    int retval;
+
+    retval = ezusb_submit(
+        fdev, label, LIBUSB_ENDPOINT_IN,
+        opcode, addr, data, len
+    );
+
+    if (retval)
+        return retval;
+
+    return ezusb_flush(fdev);
+}
+
+static int ezusb_write(struct fxdev *fdev, const char *label, uint8_t opcode,
+                       uint16_t addr, const void *data, size_t len)
+{
+    int retval;
+
+    retval = ezusb_submit(
+        fdev, label, LIBUSB_ENDPOINT_OUT,
+        opcode, addr, (void *)data, len
+    );
+
+    if (retval)
+        return retval;
+
+    return ezusb_flush(fdev);
+}
+
+static uint16_t ezusb_reset_reg(struct fxdev *fdev)
+{
+    uint16_t address;
+
+    switch (fdev->type) {
+        case DEV_TYPE_FX:
+            address = FX_RESET_REG_FX;
+            break;
+
+        case DEV_TYPE_FX2 ... DEV_TYPE_FX2LP: default:
+            address = FX_RESET_REG_FX2;
+            break;
+    }
+
+    return address;
+}
+
+static int ezusb_reset(struct fxdev *fdev, bool enable)
+{
+    uint16_t address;
+    int retval;
+
+    address = ezusb_reset_reg(fdev);
+
+    retval = ezusb_write(
+        fdev, "ezusb_reset", FX_CMD_RW_INTERNAL,
+        address, (void *)&enable, 1
+    );
+
+    /* whatever firmware was running is gone once the CPU is held */
+    if (!retval && enable) {
+        fdev->preloaded = false;
+        fdev->bulk = false;
+        fdev->crc = false;
+    }
+
+    return retval;
+}
+
+static int fx_is_external(uint16_t addr, size_t length)
+{
+    uint32_t end = addr + length;
+
+    /* check download address */
+    if (end > 0x10000) {
+        fprintf(stderr, "Download address surround\n");
+        return -EFAULT;
+    }
+
+    /* 1st 16KB for data/code, 0x0000-0x1b3f */
+    if (addr < 0x1b40)
+        return end > 0x1b40;
+
+    /* otherwise, it's certainly external */
+    else
+        return 1;
+}
+
+static int fx2_is_external(uint16_t addr, size_t length)
+{
+    uint32_t end = addr + length;
+
+    /* check download address */
+    if (end > 0x10000) {
+        fprintf(stderr, "Download address surround\n");
+        return -EFAULT;
+    }
+
+    /* 1st 8KB for data/code, 0x0000-0x1fff */
+    if (addr < 0x2000)
+        return end > 0x2000;
+
+    /* and 512 for data, 0xe000-0xe1ff */
+    else if (addr >= 0xe000 && addr < 0xe200)
+        return end > 0xe200;
+
+    /* otherwise, it's certainly external */
+    else
+        return 1;
+}
+
+static int fx2lp_is_external(uint16_t addr, size_t length)
+{
+    uint32_t end = addr + length;
+
+    if (end > 0x10000) {
+        fprintf(stderr, "Download address surround\n");
+        return -EFAULT;
+    }
+
+    /* 1st 16KB for data/code, 0x0000-0x3fff */
+    if (addr < 0x4000)
+        return end > 0x4000;
+
+    /* and 512 for data, 0xe000-0xe1ff */
+    else if (addr >= 0xe000 && addr < 0xe200)
+        return end > 0xe200;
+
+    /* otherwise, it's certainly external */
+    else
+        return 1;
+}
+
+static is_external_t ezusb_is_external(struct fxdev *fdev)
+{
+    is_external_t is_external;
+
+    switch (fdev->type) {
+        case DEV_TYPE_FX:
+            is_external = fx_is_external;
+            break;
+
+        case DEV_TYPE_FX2:
+            is_external = fx2_is_external;
+            break;
+
+        case DEV_TYPE_FX2LP: default:
+            is_external = fx2lp_is_external;
+            break;
+    }
+
+    return is_external;
+}
+
+static int ezusb_ram_write(uint16_t address, const void *data, size_t length, void *pdata)
+{
+    struct fxdev *fdev = pdata;
+    int external;
+
+    external = ezusb_is_external(fdev)(address, length);
+    if (external < 0)
+        return external;
+
+    if (external && fdev->bulk)
+        return ezusb_loader_write(fdev, FX_LOADER_OP_WRITE_MEMORY, address, data, length);
+
+    return ezusb_submit(
+        fdev, "ezusb_ram_write", LIBUSB_ENDPOINT_OUT,
+        external ? FX_CMD_RW_MEMORY : FX_CMD_RW_INTERNAL,
+        address, (void *)data, length
+    );
+}
+
+/* geometry the vendor firmware implies for each reported addressing mode */
+static const struct fxdev_eeprom fxdev_eeprom_table[] = {
+    {
+        .info = FX_EEPROM_INFO_SINGLE,
+        .name = "24xx00/01/02 single-byte address",
+        .width = 1, .page = 8, .capacity = 0x100,
+    }, {
+        .info = FX_EEPROM_INFO_DOUBLE,
+        .name = "24xx64/128/256/512 double-byte address",
+        .width = 2, .page = 64, .capacity = 0x10000,
+    },
+};
+
+int fxdev_eeprom_geometry(struct fxdev *fdev)
+{
+    unsigned int count;
+    uint8_t info;
+    int retval;
+
+    if ((retval = fxdev_preload(fdev)))
+        return retval;
+
+    if (fdev->eeprom)
+        return 0;
+
+    retval = ezusb_read(
+        fdev, "fxdev_eeprom_geometry",
+        FX_CMD_EEPROM_SIZE,
+        0, &info, 1
+    );
+    if (retval)
+        return retval;
+
+    for (count = 0; count < ARRAY_SIZE(fxdev_eeprom_table); ++count) {
+        if (fxdev_eeprom_table[count].info == info) {
+            fdev->eeprom = &fxdev_eeprom_table[count];
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "Unknown eeprom info: 0x%02x\n", info);
+    return -ENODEV;
+}
+
+/*
+ * Split along page boundaries: a leading partial page, then as many
+ * full pages as fit in one transfer, then a trailing partial page.
+ */
+static int ezusb_eeprom_write(uint16_t address, const void *data, size_t length, void *pdata)
+{
+    struct fxdev *fdev = pdata;
+    uint32_t page, batch, xfer;
+    int retval;
+
+    if ((retval = fxdev_eeprom_geometry(fdev)))
+        return retval;
+
+    if (address + length > fdev->eeprom->capacity)
+        return -EFAULT;
+
+    /* the loader splits pages itself */
+    if (fdev->bulk)
+        return ezusb_loader_write(fdev, FX_LOADER_OP_WRITE_EEPROM, address, data, length);
+
+    page = fdev->eeprom->page;
+    batch = max(fdev->chunk / page, 1U) * page;
+
+    for (; length; address += xfer, data += xfer, length -= xfer) {
+        if (address % page || length < page)
+            xfer = min(length, (size_t)(page - address % page));
+        else
+            xfer = min(length / page * page, (size_t)batch);
+
+        retval = ezusb_submit(
+            fdev, "ezusb_eeprom_write", LIBUSB_ENDPOINT_OUT,
+            FX_CMD_RW_EEPROM, address, (void *)data, xfer
+        );
+        if (retval)
+            return retval;
+    }
+
+    return 0;
+}
+
+/* longest prefix of the range that stays in one memory region */
+static size_t ezusb_region_span(is_external_t is_external, uint16_t address, size_t length)
+{
+    size_t low = 1, high = length, mid;
+    int external;
+
+    if (!is_external)
+        return length;
+
+    external = is_external(address, 1);
+    if (is_external(address, length) == external)
+        return length;
+
+    while (low < high) {
+        mid = (low + high + 1) / 2;
+        if (is_external(address, mid) == external)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+
+    return low;
+}
+
+struct ezusb_region {
+    is_external_t is_external;
+    int external;
+    fx_write_t fn;
+    void *pdata;
+};
+
+static int ezusb_region_split(uint16_t address, const void *data, size_t length, void *pdata)
+{
+    struct ezusb_region *region = pdata;
+    size_t xfer;
+    int retval;
+
+    for (; length; address += xfer, data += xfer, length -= xfer) {
+        xfer = ezusb_region_span(region->is_external, address, length);
+
+        if ((retval = region->is_external(address, xfer)) < 0)
+            return retval;
+        if (retval != region->external)
+            continue;
+
+        if ((retval = region->fn(address, data, xfer, region->pdata)))
+            return retval;
+    }
+
+    return 0;
+}
+
+/* walk the image pieces in one region: 1 external, 0 internal, -1 both */
+static int ezusb_region_range(const struct fximage *image, is_external_t is_external,
+                              int external, fx_write_t fn, void *pdata)
+{
+    struct ezusb_region region = {
+        .is_external = is_external,
+        .external = external,
+        .fn = fn,
+        .pdata = pdata,
+    };
+
+    if (!is_external || external < 0)
+        return fximage_range(image, 0, 0x10000, fn, pdata);
+
+    return fximage_range(image, 0, 0x10000, ezusb_region_split, &region);
+}
+
+static int ezusb_region_count(uint16_t address, const void *data, size_t length, void *pdata)
+{
+    *(size_t *)pdata += length;
+    return 0;
+}
+
+static int ezusb_image_write(struct fxdev *fdev, const struct fximage *image,
+                             fx_write_t write, is_external_t is_external, int external)
+{
+    struct fx_coalesce coalesce;
+    int retval;
+
+    if ((retval = fx_coalesce_init(&coalesce, write, is_external, fdev, fdev->chunk)))
+        return retval;
+
+    retval = ezusb_region_range(image, is_external, external, fx_coalesce_push, &coalesce);
+    if (!retval)
+        retval = fx_coalesce_flush(&coalesce);
+    if (!retval)
+        retval = ezusb_flush(fdev);
+    if (!retval)
+        printf("  Records: %lu, transfers: %lu\n", image->records, coalesce.transfers);
+
+    fx_coalesce_release(&coalesce);
+    return retval;
+}
+
+/* one eeprom range checksummed by the loader, @reply fills in on completion */
+struct ezusb_crc {
+    uint16_t addr;
+    uint16_t length;
+    const uint8_t *data;
+    uint32_t expect;
+    uint8_t reply[FX_LOADER_CRC];
+};
+
+struct ezusb_verify {
+    struct fxdev *fdev;
+    is_external_t is_external;
+    uint8_t *readback;
+    size_t bytes;
+    size_t summed;
+    uint32_t mismatch;
+    bool crc;
+    bool quiet;
+    unsigned int pending;
+    unsigned int narrowed;
+    struct ezusb_crc crcs[FX_LOADER_CRC_BATCH];
+};
+
+static int ezusb_verify_compare(uint16_t address, const void *data, size_t length, void *pdata)
+{
+    struct ezusb_verify *verify = pdata;
+    const uint8_t *expect = data, *actual;
+    size_t xfer, count;
+
+    for (; length; address += xfer, expect += xfer, length -= xfer) {
+        xfer = min(length, (size_t)FX_USB_TRANSFER_MAX);
+        actual = verify->readback + address;
+
+        if (crc32c(0, expect, xfer) == crc32c(0, actual, xfer))
+            continue;
+
+        for (count = 0; count < xfer && expect[count] == actual[count]; ++count);
+        verify->mismatch = address + count;
+
+        if (!verify->quiet)
+            fprintf(
+                stderr, "Verify mismatch at 0x%04x: expected 0x%02x, read 0x%02x\n",
+                verify->mismatch, expect[count], actual[count]
+            );
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static int ezusb_verify_fetch(struct ezusb_verify *verify, uint8_t opcode,
+                              uint16_t address, size_t xfer)
+{
+    /* the loader sits in internal memory, only the rest goes over bulk */
+    if (verify->fdev->bulk && opcode != FX_CMD_RW_INTERNAL)
+        return ezusb_loader_read(
+            verify->fdev, opcode == FX_CMD_RW_EEPROM ? FX_LOADER_OP_READ_EEPROM
+                                                     : FX_LOADER_OP_READ_MEMORY,
+            address, verify->readback + address, xfer
+        );
+
+    return ezusb_submit(
+        verify->fdev, "ezusb_verify", LIBUSB_ENDPOINT_IN,
+        opcode, address, verify->readback + address, xfer
+    );
+}
+
+/*
+ * The whole range is known bad. Checksum the lower half, whichever half
+ * disagrees is the one kept, one round trip per level. What is left at
+ * the end is read back so the mismatch can be reported by the byte.
+ */
+static int ezusb_crc_narrow(struct ezusb_verify *verify, const struct ezusb_crc *crc)
+{
+    uint8_t reply[FX_LOADER_CRC];
+    uint16_t addr = crc->addr;
+    const uint8_t *data = crc->data;
+    size_t length = crc->length, half;
+    int retval;
+
+    while (length > FX_LOADER_CRC_LEAF) {
+        half = length / 2;
+
+        retval = ezusb_request(
+            verify->fdev, "ezusb_crc", LIBUSB_ENDPOINT_IN,
+            FX_CMD_CRC_EEPROM, addr, half, reply, sizeof(reply)
+        );
+        if (!retval)
+            retval = ezusb_flush(verify->fdev);
+        if (retval)
+            return retval;
+
+        verify->narrowed++;
+        if (get_unaligned_le32(reply) == crc32c(0, data, half)) {
+            addr += half;
+            data += half;
+            length -= half;
+        } else {
+            length = half;
+        }
+    }
+
+    retval = ezusb_verify_fetch(verify, FX_CMD_RW_EEPROM, addr, length);
+    if (!retval)
+        retval = ezusb_flush(verify->fdev);
+    if (retval)
+        return retval;
+
+    verify->bytes += length;
+    if (memcmp(verify->readback + addr, data, length))
+        return ezusb_verify_compare(addr, data, length, verify);
+
+    /* the checksum disagreed but the bytes read back fine, trust neither */
+    if (!verify->quiet)
+        fprintf(
+            stderr, "Verify checksum mismatch at 0x%04x-0x%04x\n",
+            crc->addr, crc->addr + crc->length - 1
+        );
+    return -EIO;
+}
+
+static int ezusb_crc_check(struct ezusb_verify *verify)
+{
+    struct ezusb_crc *crc;
+    unsigned int index;
+    int retval;
+
+    if ((retval = ezusb_flush(verify->fdev)))
+        return retval;
+
+    for (index = 0; index < verify->pending; ++index) {
+        crc = &verify->crcs[index];
+
+        /* checked on the chip, leave nothing for the compare to trip over */
+        if (get_unaligned_le32(crc->reply) == crc->expect) {
+            memcpy(verify->readback + crc->addr, crc->data, crc->length);
+            continue;
+        }
+
+        if ((retval = ezusb_crc_narrow(verify, crc)))
+            return retval;
+    }
+
+    verify->pending = 0;
+    return 0;
+}
+
+static int ezusb_crc_push(struct ezusb_verify *verify, uint16_t address,
+                          const void *data, size_t xfer)
+{
+    struct ezusb_crc *crc;
+    int retval;
+
+    if (verify->pending == ARRAY_SIZE(verify->crcs) && (retval = ezusb_crc_check(verify)))
+        return retval;
+
+    crc = &verify->crcs[verify->pending++];
+    crc->addr = address;
+    crc->length = xfer;
+    crc->data = data;
+    crc->expect = crc32c(0, data, xfer);
+    verify->summed += xfer;
+
+    return ezusb_request(
+        verify->fdev, "ezusb_crc", LIBUSB_ENDPOINT_IN,
+        FX_CMD_CRC_EEPROM, address, xfer, crc->reply, sizeof(crc->reply)
+    );
+}
+
+static int ezusb_verify_read(uint16_t address, const void *data, size_t length, void *pdata)
+{
+    struct ezusb_verify *verify = pdata;
+    uint8_t opcode = FX_CMD_RW_EEPROM;
+    size_t xfer;
+    int retval;
+
+    for (; length; address += xfer, data += xfer, length -= xfer) {
+        xfer = min(length, (size_t)verify->fdev->chunk);
+        xfer = ezusb_region_span(verify->is_external, address, xfer);
+
+        if (verify->is_external) {
+            if ((retval = verify->is_external(address, xfer)) < 0)
+                return retval;
+            opcode = retval ? FX_CMD_RW_MEMORY : FX_CMD_RW_INTERNAL;
+        }
+
+        /*
+         * Reading eeprom is i2c bound either way, a checksum saves moving
+         * it over usb. External memory reads back over bulk faster than
+         * the 8051 could checksum it.
+         */
+        if (verify->crc && opcode == FX_CMD_RW_EEPROM) {
+            if ((retval = ezusb_crc_push(verify, address, data, xfer)))
+                return retval;
+            continue;
+        }
+
+        if ((retval = ezusb_verify_fetch(verify, opcode, address, xfer)))
+            return retval;
+
+        verify->bytes += xfer;
+    }
+
+    return 0;
+}
+
+static int ezusb_image_verify(struct fxdev *fdev, const struct fximage *image,
+                              is_external_t is_external, int external)
+{
+    struct ezusb_verify verify = {
+        .fdev = fdev,
+        .is_external = is_external,
+        .crc = fdev->crc,
+    };
+    double start, seconds;
+    int retval;
+
+    verify.readback = malloc(0x10000);
+    if (!verify.readback)
+        return -ENOMEM;
+
+    start = fx_clock();
+
+    retval = ezusb_region_range(image, is_external, external, ezusb_verify_read, &verify);
+    if (!retval)
+        retval = ezusb_crc_check(&verify);
+    if (!retval)
+        retval = ezusb_region_range(image, is_external, external, ezusb_verify_compare, &verify);
+
+    free(verify.readback);
+    if (retval)
+        return retval;
+
+    seconds = fx_clock() - start;
+    printf(
+        "  Verified: 0x%04lx bytes in %.3fs, %.1f KB/s\n",
+        verify.bytes + verify.summed, seconds, (verify.bytes + verify.summed) / seconds / 1024
+    );
+    if (verify.summed)
+        printf(
+            "  Checksummed on chip: 0x%04lx bytes, read back 0x%04lx, %u narrowing requests\n",
+            verify.summed, verify.bytes, verify.narrowed
+        );
+
+    return 0;
+}
+
+struct ezusb_delta {
+    struct fx_coalesce *coalesce;
+    const uint8_t *current;
+    uint32_t page;
+    uint8_t touched[0x10000 / FX_EEPROM_PAGE_MIN];
+    uint8_t dirty[0x10000 / FX_EEPROM_PAGE_MIN];
+};
+
+static int ezusb_delta_diff(uint16_t address, const void *data, size_t length, void *pdata)
+{
+    struct ezusb_delta *delta = pdata;
+    uint32_t end = address + length, page, next;
+
+    for (page = address; page < end; page = next) {
+        next = min(end, (page / delta->page + 1) * delta->page);
+        delta->touched[page / delta->page] = 1;
+        if (memcmp(data + (page - address), delta->current + page, next - page))
+            delta->dirty[page / delta->page] = 1;
+    }
+
+    return 0;
+}
+
+static int ezusb_delta_push(uint16_t address, const void *data, size_t length, void *pdata)
+{
+    struct ezusb_delta *delta = pdata;
+    uint32_t end = address + length, page, next;
+    int retval;
+
+    for (page = address; page < end; page = next) {
+        next = min(end, (page / delta->page + 1) * delta->page);
+        if (!delta->dirty[page / delta->page])
+            continue;
+        retval = fx_coalesce_push(page, data + (page - address), next - page, delta->coalesce);
+        if (retval)
+            return retval;
+    }
+
+    return 0;
+}
+
+static int ezusb_eeprom_delta(struct fxdev *fdev, const struct fximage *image)
+{
+    struct fx_coalesce coalesce = {};
+    struct ezusb_verify verify = {
+        .fdev = fdev,
+    };
+    struct ezusb_delta *delta;
+    unsigned int pages = 0, dirty = 0, index;
+    double start, seconds, saved;
+    int retval;
+
+    delta = calloc(1, sizeof(*delta));
+    verify.readback = malloc(0x10000);
+    if (!delta || !verify.readback) {
+        retval = -ENOMEM;
+        goto finish;
+    }
+
+    /* pull the current contents in one pipelined pass */
+    retval = fximage_range(image, 0, 0x10000, ezusb_verify_read, &verify);
+    if (!retval)
+        retval = ezusb_flush(fdev);
+    if (retval)
+        goto finish;
+
+    delta->current = verify.readback;
+    delta->page = fdev->eeprom->page;
+    delta->coalesce = &coalesce;
+    fximage_range(image, 0, 0x10000, ezusb_delta_diff, delta);
+
+    for (index = 0; index < ARRAY_SIZE(delta->touched); ++index) {
+        pages += delta->touched[index];
+        dirty += delta->dirty[index];
+    }
+
+    start = fx_clock();
+    retval = fx_coalesce_init(&coalesce, ezusb_eeprom_write, NULL, fdev, fdev->chunk);
+    if (!retval)
+        retval = fximage_range(image, 0, 0x10000, ezusb_delta_push, delta);
+    if (!retval)
+        retval = fx_coalesce_flush(&coalesce);
+    if (!retval)
+        retval = ezusb_flush(fdev);
+    if (retval)
+        goto finish;
+
+    /* estimate from measured page writes, datasheet write cycle otherwise */
+    seconds = fx_clock() - start;
+    if (dirty)
+        saved = seconds / dirty * (pages - dirty);
+    else
+        saved = (pages - dirty) * FX_EEPROM_PAGE_US / 1e6;
+
+    printf("  Records: %lu, transfers: %lu\n", image->records, coalesce.transfers);
+    printf(
+        "  Pages: %u dirty, %u skipped, ~%.3fs saved\n",
+        dirty, pages - dirty, saved
+    );
+
+finish:
+    fx_coalesce_release(&coalesce);
+    free(verify.readback);
+    free(delta);
+    return retval;
+}
+
+/* check [start, end) of an eeprom image against the part */
+static int ezusb_range_verify(struct ezusb_verify *verify, const struct fximage *image,
+                              uint32_t start, uint32_t end)
+{
+    int retval;
+
+    retval = fximage_range(image, start, end, ezusb_verify_read, verify);
+    if (!retval)
+        retval = ezusb_crc_check(verify);
+    if (!retval)
+        retval = fximage_range(image, start, end, ezusb_verify_compare, verify);
+
+    return retval;
+}
+
+/*
+ * Write and verify one segment at a time and journal each one that made
+ * it. Segments an earlier run journaled are checked against the part
+ * before they are skipped, the board on the fixture may have changed.
+ */
+static int ezusb_eeprom_resume(struct fxdev *fdev, const struct fximage *image)
+{
+    struct fx_coalesce coalesce = {};
+    struct fxjournal journal;
+    struct ezusb_verify verify = {
+        .fdev = fdev,
+        .crc = fdev->crc,
+    };
+    unsigned int segment, written = 0, resumed = 0;
+    uint32_t start, end;
+    int retval;
+
+    if ((retval = fxjournal_open(&journal, fdev, image)))
+        return retval;
+
+    verify.readback = malloc(0x10000);
+    if (!verify.readback) {
+        retval = -ENOMEM;
+        goto finish;
+    }
+
+    if (journal.count)
+        printf("  Journal: %u segments committed by an earlier run\n", journal.count);
+
+    if ((retval = fx_coalesce_init(&coalesce, ezusb_eeprom_write, NULL, fdev, fdev->chunk)))
+        goto finish;
+
+    for (start = 0; start < fximage_end(image); start = end) {
+        segment = start / FX_JOURNAL_SEGMENT;
+        end = start + FX_JOURNAL_SEGMENT;
+        if (!fximage_overlaps(image, start, FX_JOURNAL_SEGMENT))
+            continue;
+
+        if (journal.committed[segment]) {
+            verify.quiet = true;
+            retval = ezusb_range_verify(&verify, image, start, end);
+            verify.quiet = false;
+            if (!retval) {
+                resumed++;
+                continue;
+            }
+            if (retval != -EIO)
+                goto finish;
+            printf("  Segment 0x%04x no longer matches, rewriting\n", start);
+        }
+
+        retval = fximage_range(image, start, end, fx_coalesce_push, &coalesce);
+        if (!retval)
+            retval = fx_coalesce_flush(&coalesce);
+        if (!retval)
+            retval = ezusb_flush(fdev);
+        if (!retval)
+            retval = ezusb_range_verify(&verify, image, start, end);
+        if (!retval)
+            retval = fxjournal_commit(&journal, segment);
+        if (retval)
+            goto finish;
+
+        written++;
+    }
+
+    printf("  Records: %lu, transfers: %lu\n", image->records, coalesce.transfers);
+    printf("  Segments: %u written, %u resumed\n", written, resumed);
+
+finish:
+    fxjournal_close(&journal, !retval);
+    fx_coalesce_release(&coalesce);
+    free(verify.readback);
+    return retval;
+}
+
+static int ezusb_eeprom_image(struct fxdev *fdev, const struct fximage *image)
+{
+    int retval;
+
+    if ((retval = fxdev_eeprom_geometry(fdev)))
+        return retval;
+
+    /* reject oversized images before touching the part */
+    if (fximage_end(image) > fdev->eeprom->capacity) {
+        fprintf(
+            stderr, "Image ends at 0x%05x, beyond eeprom capacity 0x%05x\n",
+            fximage_end(image), fdev->eeprom->capacity
+        );
+        return -EFBIG;
+    }
+
+    /* resuming verifies every segment before it counts as written */
+    if (fdev->resume)
+        return ezusb_eeprom_resume(fdev, image);
+
+    if (fdev->delta)
+        retval = ezusb_eeprom_delta(fdev, image);
+    else
+        retval = ezusb_image_write(fdev, image, ezusb_eeprom_write, NULL, -1);
+
+    if (!retval && fdev->verify)
+        retval = ezusb_image_verify(fdev, image, NULL, -1);
+
+    return retval;
+}
+
+void fxdev_init(struct fxdev *fdev, libusb_context *ctx, enum fxdev_type type)
+{
+    memset(fdev, 0, sizeof(*fdev));
+    fdev->ctx = ctx;
+    fdev->transport = &fxdev_libusb;
+    fdev->preload = &fxdev_preload_image;
+    fdev->type = type;
+    fdev->queue_depth = FX_USB_QUEUE_DEPTH;
+    fdev->chunk = FX_USB_TRANSFER_MAX;
+    fdev->timeout = FX_USB_TIMEOUT;
+    fdev->retry = FX_USB_RETRY;
+    fdev->policy = fxretry_default;
+}
+
+static int fxdev_claim(struct fxdev *fdev)
+{
+    int retval;
+
+    if (libusb_kernel_driver_active(fdev->handle, 0)) {
+        if ((retval = libusb_detach_kernel_driver(fdev->handle, 0))) {
+            fprintf(stderr, "Cannot to detach kernel driver: %s\n", libusb_error_name(retval));
+            return retval;
+        }
+    }
+
+    if ((retval = libusb_claim_interface(fdev->handle, 0))) {
+        fprintf(stderr, "Cannot claim interface: %s\n", libusb_error_name(retval));
+        return retval;
+    };
+
+    return 0;
+}
+
+static int fxdev_libusb_submit(struct fxdev *fdev, struct libusb_transfer *transfer)
+{
+    return libusb_submit_transfer(transfer);
+}
+
+static int fxdev_libusb_event(struct fxdev *fdev, int *completed, double deadline)
+{
+    struct timeval timeout;
+    double wait;
+
+    if (!deadline)
+        return libusb_handle_events_completed(fdev->ctx, completed);
+
+    wait = max(deadline - fx_clock(), 0.0);
+    timeout.tv_sec = wait;
+    timeout.tv_usec = (wait - timeout.tv_sec) * 1e6;
+    return libusb_handle_events_timeout_completed(fdev->ctx, &timeout, completed);
+}
+
+static int fxdev_libusb_altsetting(struct fxdev *fdev, int alt)
+{
+    return libusb_set_interface_alt_setting(fdev->handle, 0, alt);
+}
+
+static int fxdev_libusb_clear_halt(struct fxdev *fdev, uint8_t endpoint)
+{
+    return libusb_clear_halt(fdev->handle, endpoint);
+}
+
+static void fxdev_libusb_close(struct fxdev *fdev)
+{
+    if (!fdev->handle)
+        return;
+
+    libusb_release_interface(fdev->handle, 0);
+    libusb_close(fdev->handle);
+    fdev->handle = NULL;
+}
+
+struct fxdev_tracker {
+    struct fxdev *fdev;
+    libusb_device *usbdev;
+    double left;
+};
+
+static void fxdev_track(struct fxdev *fdev, libusb_device *usbdev)
+{
+    int count;
+
+    fdev->bus = libusb_get_bus_number(usbdev);
+    fdev->address = libusb_get_device_address(usbdev);
+    count = libusb_get_port_numbers(usbdev, fdev->ports, sizeof(fdev->ports));
+    fdev->depth = max(count, 0);
+}
+
+/* same physical port, but a new enumeration of it */
+static bool fxdev_tracked(struct fxdev *fdev, libusb_device *usbdev)
+{
+    uint8_t ports[FX_USB_PORT_DEPTH];
+    int count;
+
+    if (libusb_get_bus_number(usbdev) != fdev->bus)
+        return false;
+
+    count = libusb_get_port_numbers(usbdev, ports, sizeof(ports));
+    if (count != fdev->depth || memcmp(ports, fdev->ports, count))
+        return false;
+
+    return true;
+}
+
+static int LIBUSB_CALL fxdev_hotplug(libusb_context *ctx, libusb_device *usbdev,
+                                     libusb_hotplug_event event, void *pdata)
+{
+    struct fxdev_tracker *tracker = pdata;
+
+    if (!fxdev_tracked(tracker->fdev, usbdev))
+        return 0;
+
+    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
+        tracker->left = fx_clock();
+        return 0;
+    }
+
+    /* enumeration replays the old instance until it is really gone */
+    if (libusb_get_device_address(usbdev) == tracker->fdev->address)
+        return 0;
+
+    tracker->usbdev = libusb_ref_device(usbdev);
+    return 1;
+}
+
+static int fxdev_wait_hotplug(struct fxdev_tracker *tracker, double deadline)
+{
+    struct fxdev *fdev = tracker->fdev;
+    libusb_hotplug_callback_handle handle;
+    struct timeval timeout = {
+        .tv_usec = FX_USB_RENUM_POLL * 1000,
+    };
+    int retval;
+
+    retval = libusb_hotplug_register_callback(
+        fdev->ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+        LIBUSB_HOTPLUG_ENUMERATE, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+        LIBUSB_HOTPLUG_MATCH_ANY, fxdev_hotplug, tracker, &handle
+    );
+    if (retval)
+        return retval;
+
+    while (!tracker->usbdev && fx_clock() < deadline)
+        libusb_handle_events_timeout_completed(fdev->ctx, &timeout, NULL);
+
+    libusb_hotplug_deregister_callback(fdev->ctx, handle);
+    return 0;
+}
+
+static void fxdev_wait_poll(struct fxdev_tracker *tracker, double deadline)
+{
+    struct fxdev *fdev = tracker->fdev;
+    libusb_device **list;
+    ssize_t number, index;
+    bool present;
+
+    do {
+        if ((number = libusb_get_device_list(fdev->ctx, &list)) < 0)
+            number = 0;
+
+        for (present = false, index = 0; index < number; ++index) {
+            if (!fxdev_tracked(fdev, list[index]))
+                continue;
+            present = true;
+            if (libusb_get_device_address(list[index]) != fdev->address) {
+                tracker->usbdev = libusb_ref_device(list[index]);
+                break;
+            }
+        }
+
+        libusb_free_device_list(list, 1);
+        if (!present && !tracker->left)
+            tracker->left = fx_clock();
+        if (tracker->usbdev)
+            return;
+
+        usleep(FX_USB_RENUM_POLL * 1000);
+    } while (fx_clock() < deadline);
+}
+
+/*
+ * Follow the physical port rather than the ids, the firmware we just
+ * started is free to come back with a different VID/PID.
+ */
+static int fxdev_libusb_reopen(struct fxdev *fdev)
+{
+    struct fxdev_tracker tracker = {
+        .fdev = fdev,
+    };
+    double start, deadline, found;
+    int retval = -1;
+
+    start = fx_clock();
+    deadline = start + FX_USB_RENUM_TIMEOUT / 1000.0;
+    fxdev_libusb_close(fdev);
+
+    if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+        retval = fxdev_wait_hotplug(&tracker, deadline);
+    if (retval)
+        fxdev_wait_poll(&tracker, deadline);
+
+    if (!tracker.usbdev) {
+        fprintf(stderr, "Device did not come back after renumeration\n");
+        return -ENODEV;
+    }
+
+    found = fx_clock();
+    retval = fxdev_open(fdev, tracker.usbdev);
+    libusb_unref_device(tracker.usbdev);
+    if (retval)
+        return retval;
+
+    printf("  Renumerated: %04x:%04x", fdev->vendor, fdev->product);
+    if (tracker.left)
+        printf(", gone %.3fs", tracker.left - start);
+    printf(", back %.3fs, reopened %.3fs\n", found - start, fx_clock() - start);
+    return 0;
+}
+
+const struct fxdev_transport fxdev_libusb = {
+    .name = "libusb",
+    .submit = fxdev_libusb_submit,
+    .event = fxdev_libusb_event,
+    .reopen = fxdev_libusb_reopen,
+    .altsetting = fxdev_libusb_altsetting,
+    .clear_halt = fxdev_libusb_clear_halt,
+    .close = fxdev_libusb_close,
+};
+
+int fxdev_open(struct fxdev *fdev, libusb_device *usbdev)
+{
+    struct libusb_device_descriptor desc;
+    int retval;
+
+    if (!libusb_get_device_descriptor(usbdev, &desc)) {
+        fdev->vendor = desc.idVendor;
+        fdev->product = desc.idProduct;
+    }
+
+    fxdev_track(fdev, usbdev);
+
+    if ((retval = libusb_open(usbdev, &fdev->handle))) {
+        fprintf(stderr, "Cannot open device: %s\n", libusb_error_name(retval));
+        fdev->handle = NULL;
+        return retval;
+    }
+
+    if ((retval = fxdev_claim(fdev))) {
+        libusb_close(fdev->handle);
+        fdev->handle = NULL;
+        return retval;
+    }
+
+    return 0;
+}
+
+int fxdev_open_vid_pid(struct fxdev *fdev, uint16_t vendor, uint16_t product)
+{
+    int retval;
+
+    fdev->vendor = vendor;
+    fdev->product = product;
+    fdev->handle = libusb_open_device_with_vid_pid(fdev->ctx, vendor, product);
+    if (!fdev->handle) {
+        fprintf(stderr, "Cannot found bootloader mode chip\n");
+        return -ENODEV;
+    }
+
+    fxdev_track(fdev, libusb_get_device(fdev->handle));
+
+    if ((retval = fxdev_claim(fdev))) {
+        libusb_close(fdev->handle);
+        fdev->handle = NULL;
+        return retval;
+    }
+
+    return 0;
+}
+
+void fxdev_close(struct fxdev *fdev)
+{
+    ezusb_release(fdev);
+    fdev->transport->close(fdev);
+}
+
+static int ezusb_preload_wait(struct fxdev *fdev)
+{
+    uint8_t info;
+    int retval;
+
+    /* the vendor firmware answers once it owns ep0, possibly renumerated */
+    retval = ezusb_read(fdev, "ezusb_preload", FX_CMD_EEPROM_SIZE, 0, &info, 1);
+    if (retval != LIBUSB_ERROR_NO_DEVICE)
+        return retval;
 
-static int ezusb_read(const char *label, uint8_t opcode,
-                      uint16_t addr, uint8_t *data, size_t len)
+    if ((retval = fdev->transport->reopen(fdev)))
+        return retval;
+
+    return ezusb_read(fdev, "ezusb_preload", FX_CMD_EEPROM_SIZE, 0, &info, 1);
+}
+
+int fxdev_preload(struct fxdev *fdev)
 {
-    int retlen;
+    is_external_t is_external = ezusb_is_external(fdev);
+    size_t external = 0;
+    int retval;
 
-    retlen = libusb_control_transfer(
-        fx_usb_device,
-        LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR |
-        LIBUSB_RECIPIENT_DEVICE,
-        opcode, addr, 0, data, len, FX_USB_TIMEOUT
-    );
+    if (fdev->preloaded || !fdev->preload)
+        return 0;
 
-    if (retlen < 0) {
-        fprintf(
-            stderr, "ezusb_read '%s' failed: %s\n",
-            label, libusb_error_name(retlen)
-        );
-        return retlen;
+    printf("Chip preload vendor firmware...\n");
+
+    retval = ezusb_region_range(fdev->preload, is_external, 1, ezusb_region_count, &external);
+    if (retval)
+        return retval;
+
+    if (external) {
+        fprintf(stderr, "Preload firmware must fit in internal memory\n");
+        return -EFAULT;
     }
 
+    if ((retval = ezusb_reset(fdev, true)))
+        return retval;
+
+    retval = ezusb_image_write(fdev, fdev->preload, ezusb_ram_write, is_external, 0);
+    if (retval)
+        return retval;
+
+    if ((retval = ezusb_reset(fdev, false)))
+        return retval;
+
+    if ((retval = ezusb_preload_wait(fdev)))
+        return retval;
+
+    if (fdev->loader && (retval = ezusb_loader_probe(fdev)))
+        return retval;
+
+    fdev->preloaded = true;
+    printf("  Done!\n");
     return 0;
 }
 
-static int ezusb_write(const char *label, uint8_t opcode,
-                       uint16_t addr, const void *data, size_t len)
+/* the whole range at @size bytes per transfer, every one in flight before waiting */
+static int ezusb_probe_move(struct fxdev *fdev, uint8_t direction, uint8_t *data,
+                            size_t length, size_t size)
 {
-    int retlen;
-
-    retlen = libusb_control_transfer(
-        fx_usb_device,
-        LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR |
-        LIBUSB_RECIPIENT_DEVICE,
-        opcode, addr, 0, (void *)data, len, FX_USB_TIMEOUT
-    );
+    size_t addr, xfer;
+    int retval;
 
-    if (retlen < 0) {
-        fprintf(
-            stderr, "ezusb_write '%s' failed: %s\n",
-            label, libusb_error_name(retlen)
+    for (addr = 0; addr < length; addr += xfer) {
+        xfer = min(length - addr, size);
+        retval = ezusb_submit(
+            fdev, "ezusb_probe", direction,
+            FX_CMD_RW_INTERNAL, addr, data + addr, xfer
         );
-        return retlen;
+        if (retval)
+            return retval;
     }
 
-    return 0;
+    return ezusb_flush(fdev);
 }
 
-static uint16_t ezusb_reset_reg(void)
+static int ezusb_probe_size(struct fxdev *fdev, uint8_t *pattern, uint8_t *readback,
+                            size_t length, size_t size, double *out, double *in)
 {
-    uint16_t address;
+    unsigned int round;
+    size_t index;
+    double start;
+    int retval;
 
-    switch (device_type) {
-        case DEV_TYPE_FX:
-            address = FX_RESET_REG_FX;
-            break;
+    for (round = 0; round < FX_PROBE_ROUNDS; ++round) {
+        /* differs per round, a stale readback of the last one fails too */
+        for (index = 0; index < length; ++index)
+            pattern[index] = (index + round) * 0x9d ^ index >> 8 ^ size >> 6;
 
-        case DEV_TYPE_FX2 ... DEV_TYPE_FX2LP:
-            address = FX_RESET_REG_FX2;
-            break;
+        start = fx_clock();
+        if ((retval = ezusb_probe_move(fdev, LIBUSB_ENDPOINT_OUT, pattern, length, size)))
+            return retval;
+
+        *out += fx_clock() - start;
+        start = fx_clock();
+        if ((retval = ezusb_probe_move(fdev, LIBUSB_ENDPOINT_IN, readback, length, size)))
+            return retval;
+
+        *in += fx_clock() - start;
+        if (memcmp(pattern, readback, length))
+            return -EIO;
     }
 
-    return address;
+    return 0;
 }
 
-static int ezusb_reset(bool enable)
+/*
+ * Find the control transfer size the host side carries fastest without
+ * failing. Internal memory is the scratch area, with the CPU held and its
+ * content put back afterwards. A size cached for the port skips all that.
+ */
+int fxdev_probe(struct fxdev *fdev)
 {
-    uint16_t address;
-    int retval;
+    uint8_t *saved, *pattern, *readback;
+    unsigned int size, best = 0, retry;
+    double out, in, rate, fastest = 0;
+    size_t length;
+    uint8_t cpucs;
+    bool intact;
+    int retval, error;
+
+    printf("Chip probe control transfer size...\n");
+
+    if (!fdev->reprobe && !fxprobe_load(fdev, &size)) {
+        fdev->chunk = size;
+        printf("  Cached: %u bytes per transfer\n", size);
+        printf("  Done!\n");
+        return 0;
+    }
 
-    address = ezusb_reset_reg();
+    length = ezusb_region_span(ezusb_is_external(fdev), 0, FX_PROBE_MAX);
+    saved = malloc(length * 3);
+    if (!saved)
+        return -ENOMEM;
 
-    retval = ezusb_write(
-        "ezusb_reset", FX_CMD_RW_INTERNAL,
-        address, (void *)&enable, 1
+    pattern = saved + length;
+    readback = pattern + length;
+
+    retval = ezusb_read(
+        fdev, "ezusb_probe", FX_CMD_RW_INTERNAL,
+        ezusb_reset_reg(fdev), &cpucs, 1
+    );
+    if (retval || (retval = ezusb_reset(fdev, true)))
+        goto finish;
+
+    /* a size that only works with retries is not one to keep */
+    retry = fdev->retry;
+    fdev->retry = 1;
+
+    /* nothing written yet, internal memory is still what the CPU left */
+    intact = true;
+    retval = ezusb_probe_move(fdev, LIBUSB_ENDPOINT_IN, saved, length, FX_USB_TRANSFER_MIN);
+    if (retval)
+        goto release;
+
+    intact = false;
+    for (size = FX_USB_TRANSFER_MIN; size <= length; size *= 2) {
+        out = in = 0;
+        retval = ezusb_probe_size(fdev, pattern, readback, length, size, &out, &in);
+
+        /* gone or locked out, nothing left to put memory back through */
+        if (retval == LIBUSB_ERROR_NO_DEVICE || retval == LIBUSB_ERROR_ACCESS)
+            goto release;
+
+        if (retval) {
+            printf(
+                "  %5u bytes: %s\n", size,
+                retval == -EIO ? "read back corrupted" : libusb_error_name(retval)
+            );
+            break;
+        }
+
+        rate = length * FX_PROBE_ROUNDS / 1024.0;
+        printf("  %5u bytes: %.1f KB/s out, %.1f KB/s in\n", size, rate / out, rate / in);
+
+        /* fewer transfers for the same speed, larger wins unless clearly slower */
+        rate = rate * 2 / (out + in);
+        if (rate >= fastest * (100 - FX_PROBE_SLACK) / 100)
+            best = size;
+        fastest = max(fastest, rate);
+    }
+
+    retval = 0;
+    if (!best) {
+        fprintf(stderr, "No control transfer size works on this port\n");
+        retval = -EIO;
+    }
+
+    error = ezusb_probe_move(
+        fdev, LIBUSB_ENDPOINT_OUT, saved, length,
+        best ? best : FX_USB_TRANSFER_MIN
     );
+    intact = !error;
+    if (error && !retval)
+        retval = error;
+
+release:
+    fdev->retry = retry;
+
+    /* CPUCS as found, whatever ran before starts over from its reset vector */
+    if (!(cpucs & 0x01)) {
+        if (intact && (error = ezusb_reset(fdev, false)) && !retval)
+            retval = error;
+        else if (!intact)
+            fprintf(stderr, "Internal memory not restored, CPU left in reset\n");
+    }
+
+    if (!retval) {
+        fdev->chunk = best;
+        fxprobe_store(fdev, best);
+        printf("  Using %u bytes per transfer\n", best);
+        printf("  Done!\n");
+    }
 
+finish:
+    free(saved);
     return retval;
 }
 
-static int ezusb_ram_write(uint16_t address, const void *data, size_t length, void *pdata)
+/*
+ * The EZ-USB loader only reaches internal memory, so external data goes
+ * first through the vendor firmware, then internal memory is loaded with
+ * the CPU held in reset, replacing that firmware.
+ */
+int fxdev_ram_write(struct fxdev *fdev, const struct fximage *image)
 {
-    is_external_t is_external = pdata;
-    unsigned int retry = 6;
-    bool external;
+    is_external_t is_external = ezusb_is_external(fdev);
+    size_t external = 0;
     int retval;
 
-    external = is_external(address, length);
+    retval = ezusb_region_range(image, is_external, 1, ezusb_region_count, &external);
+    if (retval)
+        return retval;
 
-    while (--retry) {
-        if (!(retval = ezusb_write(
-            "ezusb_ram_write",
-            external ? FX_CMD_RW_MEMORY : FX_CMD_RW_INTERNAL,
-            address, data, length
-        )))
-            break;
+    if (external) {
+        if ((retval = fxdev_preload(fdev)))
+            return retval;
+
+        retval = ezusb_image_write(fdev, image, ezusb_ram_write, is_external, 1);
+        if (!retval && fdev->verify)
+            retval = ezusb_image_verify(fdev, image, is_external, 1);
+        if (retval)
+            return retval;
     }
 
-    return retval;
+    /* don't let CPU run while we overwrite its code/data */
+    if ((retval = ezusb_reset(fdev, true)))
+        return retval;
+
+    retval = ezusb_image_write(fdev, image, ezusb_ram_write, is_external, 0);
+    if (retval)
+        return retval;
+
+    /* verify while the CPU is still held and cannot touch its memory */
+    if (fdev->verify) {
+        retval = ezusb_image_verify(fdev, image, is_external, 0);
+        if (retval)
+            return retval;
+    }
+
+    if ((retval = ezusb_reset(fdev, false)))
+        return retval;
+
+    if (fdev->renumerate)
+        return fdev->transport->reopen(fdev);
+
+    return 0;
 }
 
-static int ezusb_eeprom_write(uint16_t address, const void *data, size_t length, void *pdata)
-{
-    unsigned int retry = 6;
+struct ezusb_slot {
+    uint16_t address;
+    size_t length;
+    uint8_t *data;
+};
+
+/**
+ * struct ezusb_ring - single producer, single consumer queue of coalesced runs
+ * @slots: runs waiting for the usb side
+ * @store: payload space behind @slots, one probed chunk per slot
+ * @head: next slot the parser fills, written by the parser only
+ * @tail: next slot the usb side drains, written by the usb side only
+ * @closed: the parser pushed its last run
+ * @abort: the usb side failed, the parser stops at its next push
+ * @peak: highest occupancy seen by the usb side
+ * @samples: occupancy summed over every drained slot
+ * @full: seconds the parser waited for a free slot
+ * @empty: seconds the usb side waited for a run
+ */
+struct ezusb_ring {
+    struct ezusb_slot slots[FX_STREAM_SLOTS];
+    uint8_t *store;
+    atomic_uint head;
+    atomic_uint tail;
+    atomic_bool closed;
+    atomic_bool abort;
+    unsigned int peak;
+    unsigned long samples;
+    double full;
+    double empty;
+};
+
+struct ezusb_stream {
+    struct fxdev *fdev;
+    int fd;
+    int wake[2];
+    is_external_t is_external;
+    struct fx_coalesce coalesce;
+    struct fximage image;
+    struct ezusb_ring ring;
+    size_t bytes;
     int retval;
+};
 
-    while (--retry) {
-        if (!(retval = ezusb_write(
-            "ezusb_eeprom_write",
-            FX_CMD_RW_EEPROM,
-            address, data, length
-        )))
-            break;
+/* stalls are short, yield first and only then give up the cpu */
+static void ezusb_ring_wait(unsigned int *spins)
+{
+    struct timespec wait = { 0, 10000 };
+
+    if ((*spins)++ < 64)
+        sched_yield();
+    else
+        nanosleep(&wait, NULL);
+}
+
+static int ezusb_ring_push(uint16_t address, const void *data, size_t length, void *pdata)
+{
+    struct ezusb_stream *stream = pdata;
+    struct ezusb_ring *ring = &stream->ring;
+    unsigned int head, spins = 0;
+    struct ezusb_slot *slot;
+    double start;
+
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == FX_STREAM_SLOTS) {
+        start = fx_clock();
+        while (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == FX_STREAM_SLOTS) {
+            if (atomic_load_explicit(&ring->abort, memory_order_relaxed))
+                return -ECANCELED;
+            ezusb_ring_wait(&spins);
+        }
+        ring->full += fx_clock() - start;
     }
 
-    return retval;
+    if (atomic_load_explicit(&ring->abort, memory_order_relaxed))
+        return -ECANCELED;
+
+    slot = &ring->slots[head % FX_STREAM_SLOTS];
+    slot->address = address;
+    slot->length = length;
+    memcpy(slot->data, data, length);
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return 0;
 }
 
-static bool fx_is_external(uint16_t addr, size_t length)
+static int ezusb_stream_push(uint16_t address, const void *data, size_t length, void *pdata)
 {
-    uint16_t end = addr + length;
+    struct ezusb_stream *stream = pdata;
+    int retval;
 
-    /* check download address */
-    if (end < addr) {
-        fprintf(stderr, "Download address surround\n");
-        exit(-EFAULT);
+    /* external memory needs the vendor firmware, not with the CPU held */
+    if ((retval = stream->is_external(address, length))) {
+        if (retval > 0) {
+            fprintf(stderr, "Streamed image reaches external memory at 0x%04x\n", address);
+            retval = -EINVAL;
+        }
+        return retval;
     }
 
-    /* 1st 16KB for data/code, 0x0000-0x1b3f */
-    if (addr < 0x1b40)
-        return end > 0x1b40;
+    /* read back needs the data, at most the 64KB address space */
+    if (stream->fdev->verify &&
+        (retval = fximage_append(address, data, length, &stream->image)))
+        return retval;
 
-    /* otherwise, it's certainly external */
-    else
-        return true;
+    return fx_coalesce_push(address, data, length, &stream->coalesce);
 }
 
-static bool fx2_is_external(uint16_t addr, size_t length)
+/* producer: read, parse and coalesce, the usb side only submits */
+static void *ezusb_stream_parser(void *pdata)
 {
-    uint16_t end = addr + length;
+    struct ezusb_stream *stream = pdata;
+    char chunk[FX_USB_TRANSFER_MAX];
+    struct ihex_stream parser;
+    struct pollfd fds[2] = {
+        { .fd = stream->fd, .events = POLLIN },
+        { .fd = stream->wake[0], .events = POLLIN },
+    };
+    ssize_t len;
+    int retval = 0;
+
+    ihex_stream_init(&parser);
+
+    while (!parser.done) {
+        if (poll(fds, ARRAY_SIZE(fds), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            retval = -errno;
+            fprintf(stderr, "Cannot poll stream: %s\n", strerror(errno));
+            break;
+        }
 
-    /* check download address */
-    if (end < addr) {
-        fprintf(stderr, "Download address surround\n");
-        exit(-EFAULT);
+        /* the usb side gave up, stop waiting on input nobody needs */
+        if (fds[1].revents) {
+            retval = -ECANCELED;
+            break;
+        }
+
+        if ((len = read(stream->fd, chunk, sizeof(chunk))) < 0) {
+            if (errno == EINTR)
+                continue;
+            retval = -errno;
+            fprintf(stderr, "Cannot read stream: %s\n", strerror(errno));
+            break;
+        }
+
+        if (!len)
+            break;
+
+        stream->bytes += len;
+        retval = ihex_stream_feed(&parser, chunk, len, ezusb_stream_push, stream);
+        if (retval)
+            break;
     }
 
-    /* 1st 8KB for data/code, 0x0000-0x1fff */
-    if (addr < 0x2000)
-        return end > 0x2000;
+    if (!retval)
+        retval = ihex_stream_finish(&parser, ezusb_stream_push, stream);
+    if (!retval)
+        retval = fx_coalesce_flush(&stream->coalesce);
 
-    /* and 512 for data, 0xe000-0xe1ff */
-    else if (addr >= 0xe000 && addr < 0xe200)
-        return end > 0xe200;
+    stream->retval = retval;
+    atomic_store_explicit(&stream->ring.closed, true, memory_order_release);
+    return NULL;
+}
 
-    /* otherwise, it's certainly external */
-    else
-        return true;
+/* consumer: submit runs as they come, transfers stay in flight meanwhile */
+static int ezusb_stream_drain(struct ezusb_stream *stream)
+{
+    struct ezusb_ring *ring = &stream->ring;
+    unsigned int head, tail, spins;
+    struct ezusb_slot *slot;
+    double start;
+    int retval;
+
+    for (tail = 0;; ++tail) {
+        head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+        if (head == tail) {
+            start = fx_clock();
+            for (spins = 0; head == tail; ezusb_ring_wait(&spins)) {
+                /* closed is published after the last push, look once more */
+                if (atomic_load_explicit(&ring->closed, memory_order_acquire) &&
+                    atomic_load_explicit(&ring->head, memory_order_acquire) == tail) {
+                    ring->empty += fx_clock() - start;
+                    return 0;
+                }
+
+                /* reap while starved, a usb failure surfaces instead of waiting on input */
+                if ((retval = ezusb_poll(stream->fdev))) {
+                    ring->empty += fx_clock() - start;
+                    atomic_store_explicit(&ring->abort, true, memory_order_relaxed);
+                    return retval;
+                }
+                head = atomic_load_explicit(&ring->head, memory_order_acquire);
+            }
+            ring->empty += fx_clock() - start;
+        }
+
+        ring->peak = max(ring->peak, head - tail);
+        ring->samples += head - tail;
+
+        slot = &ring->slots[tail % FX_STREAM_SLOTS];
+        retval = ezusb_ram_write(slot->address, slot->data, slot->length, stream->fdev);
+
+        /* the payload is copied into the transfer, the slot is free again */
+        atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+        if (retval) {
+            atomic_store_explicit(&ring->abort, true, memory_order_relaxed);
+            return retval;
+        }
+    }
 }
 
-static bool fx2lp_is_external(uint16_t addr, size_t length)
+/*
+ * Load a HEX image as it arrives on a pipe or socket. A parser thread
+ * decodes and coalesces while this thread keeps the usb queue full, so
+ * records go out while the rest is still being received. The image must
+ * fit in internal memory: the CPU stays in reset the whole time.
+ */
+int fxdev_ram_stream(struct fxdev *fdev, int fd)
 {
-    uint16_t end = addr + length;
+    struct ezusb_stream *stream;
+    struct ezusb_ring *ring;
+    pthread_t parser;
+    unsigned long drained;
+    unsigned int index;
+    double start;
+    int retval;
 
-    if (end < addr) {
-        fprintf(stderr, "Download address surround\n");
-        exit(-EFAULT);
+    stream = calloc(1, sizeof(*stream));
+    if (!stream)
+        return -ENOMEM;
+
+    ring = &stream->ring;
+    stream->fdev = fdev;
+    stream->fd = fd;
+    stream->is_external = ezusb_is_external(fdev);
+
+    /* slots carry full transfers of the probed size, keep them off the stack */
+    ring->store = malloc(FX_STREAM_SLOTS * fdev->chunk);
+    if (!ring->store || fx_coalesce_init(&stream->coalesce, ezusb_ring_push,
+                                         stream->is_external, stream, fdev->chunk)) {
+        retval = -ENOMEM;
+        goto release;
     }
 
-    /* 1st 16KB for data/code, 0x0000-0x3fff */
-    if (addr < 0x4000)
-        return end > 0x4000;
+    for (index = 0; index < FX_STREAM_SLOTS; ++index)
+        ring->slots[index].data = ring->store + index * fdev->chunk;
 
-    /* and 512 for data, 0xe000-0xe1ff */
-    else if (addr >= 0xe000 && addr < 0xe200)
-        return end > 0xe200;
+    /* an idle stdin would keep the parser in read() after a usb failure */
+    if (pipe(stream->wake)) {
+        retval = -errno;
+        goto release;
+    }
 
-    /* otherwise, it's certainly external */
-    else
-        return true;
+    fximage_init(&stream->image);
+
+    if ((retval = ezusb_reset(fdev, true)))
+        goto finish;
+
+    start = fx_clock();
+    if ((retval = -pthread_create(&parser, NULL, ezusb_stream_parser, stream))) {
+        fprintf(stderr, "Cannot create parser: %s\n", strerror(-retval));
+        goto finish;
+    }
+
+    retval = ezusb_stream_drain(stream);
+    if (retval && write(stream->wake[1], "", 1) < 0)
+        fprintf(stderr, "Cannot stop parser: %s\n", strerror(errno));
+    pthread_join(parser, NULL);
+
+    if (!retval)
+        retval = stream->retval;
+    if (!retval)
+        retval = ezusb_flush(fdev);
+    if (retval)
+        goto finish;
+
+    drained = atomic_load(&ring->tail);
+    printf("  Records: %lu, transfers: %lu\n", stream->coalesce.records, stream->coalesce.transfers);
+    printf("  Streamed: %zu bytes in %.3fs\n", stream->bytes, fx_clock() - start);
+    printf(
+        "  Pipeline: %u slots, peak %u, avg %.1f, parser stalled %.3fs, usb stalled %.3fs\n",
+        FX_STREAM_SLOTS, ring->peak, drained ? (double)ring->samples / drained : 0,
+        ring->full, ring->empty
+    );
+
+    if (fdev->verify) {
+        retval = ezusb_image_verify(fdev, &stream->image, stream->is_external, 0);
+        if (retval)
+            goto finish;
+    }
+
+    if ((retval = ezusb_reset(fdev, false)))
+        goto finish;
+
+    if (fdev->renumerate)
+        retval = fdev->transport->reopen(fdev);
+
+finish:
+    /* whatever was already queued must not outlive this call */
+    if (retval)
+        ezusb_flush(fdev);
+    fximage_release(&stream->image);
+    close(stream->wake[0]);
+    close(stream->wake[1]);
+release:
+    fx_coalesce_release(&stream->coalesce);
+    free(ring->store);
+    free(stream);
+    return retval;
 }
 
-int fxdev_ram_write(const void *data, size_t length, bool hex)
+/* write back internal memory saved into @readback */
+static int ezusb_ram_restore(uint16_t address, const void *data, size_t length, void *pdata)
 {
-    is_external_t is_external;
+    struct ezusb_verify *verify = pdata;
+    size_t xfer;
     int retval;
 
-    switch (device_type) {
-        case DEV_TYPE_FX:
-            is_external = fx_is_external;
-            break;
+    for (; length; address += xfer, length -= xfer) {
+        xfer = min(length, (size_t)verify->fdev->chunk);
+        retval = ezusb_ram_write(address, verify->readback + address, xfer, verify->fdev);
+        if (retval)
+            return retval;
+    }
 
-        case DEV_TYPE_FX2:
-            is_external = fx2_is_external;
-            break;
+    return 0;
+}
 
-        case DEV_TYPE_FX2LP:
-            is_external = fx2lp_is_external;
-            break;
-    }
+/*
+ * External memory is read through the vendor firmware, which takes the
+ * place of the image's internal code. What the image occupies there is
+ * saved with the CPU held and written back before internal memory is
+ * checked, so the board ends up running the image as after a plain load.
+ */
+int fxdev_ram_verify(struct fxdev *fdev, const struct fximage *image)
+{
+    is_external_t is_external = ezusb_is_external(fdev);
+    struct ezusb_verify saved = {
+        .fdev = fdev,
+        .is_external = is_external,
+    };
+    size_t external = 0;
+    int retval;
 
-    /* don't let CPU run while we overwrite its code/data */
-    if ((retval = ezusb_reset(true)))
+    printf("Chip verify memory...\n");
+
+    retval = ezusb_region_range(image, is_external, 1, ezusb_region_count, &external);
+    if (retval)
         return retval;
 
-    if (hex)
-        retval = ihex_parse(data, ezusb_ram_write, is_external);
-    else
-        retval = ezusb_ram_write(0, data, length, is_external);
+    if (external) {
+        saved.readback = malloc(0x10000);
+        if (!saved.readback)
+            return -ENOMEM;
+
+        if (!(retval = ezusb_reset(fdev, true)))
+            retval = ezusb_region_range(image, is_external, 0, ezusb_verify_read, &saved);
+        if (!retval)
+            retval = ezusb_flush(fdev);
+        if (!retval)
+            retval = fxdev_preload(fdev);
+        if (!retval)
+            retval = ezusb_image_verify(fdev, image, is_external, 1);
+        if (!retval)
+            retval = ezusb_reset(fdev, true);
+        if (!retval)
+            retval = ezusb_region_range(image, is_external, 0, ezusb_ram_restore, &saved);
+        if (!retval)
+            retval = ezusb_flush(fdev);
+
+        free(saved.readback);
+        if (retval)
+            return retval;
+    } else if ((retval = ezusb_reset(fdev, true)))
+        return retval;
+
+    /* the CPU is still held and cannot touch its memory */
+    retval = ezusb_image_verify(fdev, image, is_external, 0);
     if (retval)
         return retval;
 
-    if ((retval = ezusb_reset(false)))
+    if ((retval = ezusb_reset(fdev, false)))
         return retval;
 
+    printf("  Done!\n");
     return 0;
 }
 
-int fxdev_eeprom_info(void)
+int fxdev_eeprom_info(struct fxdev *fdev)
 {
-    uint8_t info;
     int retval;
 
     printf("Chip ID:\n");
 
-    retval = ezusb_read(
-        "fxdev_eeprom_info",
-        FX_CMD_EEPROM_SIZE,
-        0, &info, 1
-    );
-
-    if (retval)
+    if ((retval = fxdev_eeprom_geometry(fdev)))
         return retval;
 
-    printf("  eeprom info: 0x%02x\n", info);
+    printf("  eeprom info: 0x%02x\n", fdev->eeprom->info);
+    printf("  eeprom type: %s\n", fdev->eeprom->name);
+    printf("  eeprom page: %u bytes\n", fdev->eeprom->page);
+    printf("  eeprom capacity: 0x%05x bytes\n", fdev->eeprom->capacity);
     printf("  Done!\n");
     return 0;
 }
 
-int fxdev_eeprom_erase(void)
+int fxdev_eeprom_erase(struct fxdev *fdev)
 {
     uint8_t data[16];
     int retval;
@@ -256,7 +1813,9 @@ int fxdev_eeprom_erase(void)
     printf("Chip erase eeprom...\n");
 
     memset(data, 0xff, sizeof(data));
-    retval = ezusb_eeprom_write(FX_EEPROM_MODE, &data, 16, NULL);
+    retval = ezusb_eeprom_write(FX_EEPROM_MODE, &data, 16, fdev);
+    if (!retval)
+        retval = ezusb_flush(fdev);
     if (retval)
         return retval;
 
@@ -264,17 +1823,31 @@ int fxdev_eeprom_erase(void)
     return 0;
 }
 
-int fxdev_eeprom_write(const void *data, size_t length, bool hex)
+int fxdev_eeprom_write(struct fxdev *fdev, const struct fximage *image)
 {
     int retval;
 
     printf("Chip write eeprom...\n");
-    printf("  Length: 0x%04lx\n", length);
+    printf("  Length: 0x%04lx\n", image->bytes);
 
-    if (hex)
-        retval = ihex_parse(data, ezusb_eeprom_write, NULL);
-    else
-        retval = ezusb_eeprom_write(0, data, length, NULL);
+    retval = ezusb_eeprom_image(fdev, image);
+    if (retval)
+        return retval;
+
+    printf("  Done!\n");
+    return 0;
+}
+
+int fxdev_eeprom_verify(struct fxdev *fdev, const struct fximage *image)
+{
+    int retval;
+
+    printf("Chip verify eeprom...\n");
+
+    if ((retval = fxdev_preload(fdev)))
+        return retval;
+
+    retval = ezusb_image_verify(fdev, image, NULL, -1);
     if (retval)
         return retval;
 
@@ -282,14 +1855,16 @@ int fxdev_eeprom_write(const void *data, size_t length, bool hex)
     return 0;
 }
 
-int fxdev_eeprom_mode(uint8_t mode)
+int fxdev_eeprom_mode(struct fxdev *fdev, uint8_t mode)
 {
     int retval;
 
     printf("Chip write bootmode...\n");
     printf("  Boot mode: 0x%02x\n", mode);
 
-    retval = ezusb_eeprom_write(FX_EEPROM_MODE, &mode, 1, NULL);
+    retval = ezusb_eeprom_write(FX_EEPROM_MODE, &mode, 1, fdev);
+    if (!retval)
+        retval = ezusb_flush(fdev);
     if (retval)
         return retval;
 
@@ -297,14 +1872,16 @@ int fxdev_eeprom_mode(uint8_t mode)
     return 0;
 }
 
-int fxdev_eeprom_vendor(uint16_t vendor)
+int fxdev_eeprom_vendor(struct fxdev *fdev, uint16_t vendor)
 {
     int retval;
 
     printf("Chip write vendor...\n");
     printf("  Vendor ID: 0x%04x\n", vendor);
 
-    retval = ezusb_eeprom_write(FX_EEPROM_VENDOR, &vendor, 2, NULL);
+    retval = ezusb_eeprom_write(FX_EEPROM_VENDOR, &vendor, 2, fdev);
+    if (!retval)
+        retval = ezusb_flush(fdev);
     if (retval)
         return retval;
 
@@ -312,14 +1889,16 @@ int fxdev_eeprom_vendor(uint16_t vendor)
     return 0;
 }
 
-int fxdev_eeprom_product(uint16_t product)
+int fxdev_eeprom_product(struct fxdev *fdev, uint16_t product)
 {
     int retval;
 
     printf("Chip write product...\n");
     printf("  Product ID: 0x%04x\n", product);
 
-    retval = ezusb_eeprom_write(FX_EEPROM_PRODUCT, &product, 2, NULL);
+    retval = ezusb_eeprom_write(FX_EEPROM_PRODUCT, &product, 2, fdev);
+    if (!retval)
+        retval = ezusb_flush(fdev);
     if (retval)
         return retval;
 
@@ -327,14 +1906,16 @@ int fxdev_eeprom_product(uint16_t product)
     return 0;
 }
 
-int fxdev_eeprom_device(uint16_t device)
+int fxdev_eeprom_device(struct fxdev *fdev, uint16_t device)
 {
     int retval;
 
     printf("Chip write device...\n");
     printf("  Device ID: 0x%04x\n", device);
 
-    retval = ezusb_eeprom_write(FX_EEPROM_DEVICE, &device, 2, NULL);
+    retval = ezusb_eeprom_write(FX_EEPROM_DEVICE, &device, 2, fdev);
+    if (!retval)
+        retval = ezusb_flush(fdev);
     if (retval)
         return retval;
 
@@ -342,14 +1923,16 @@ int fxdev_eeprom_device(uint16_t device)
     return 0;
 }
 
-int fxdev_eeprom_config(uint8_t config)
+int fxdev_eeprom_config(struct fxdev *fdev, uint8_t config)
 {
     int retval;
 
     printf("Chip write config...\n");
     printf("  Config: 0x%02x\n", config);
 
-    retval = ezusb_eeprom_write(FX_EEPROM_DEVICE, &config, 1, NULL);
+    retval = ezusb_eeprom_write(FX_EEPROM_CONFIG, &config, 1, fdev);
+    if (!retval)
+        retval = ezusb_flush(fdev);
     if (retval)
         return retval;
 
@@ -357,34 +1940,100 @@ int fxdev_eeprom_config(uint8_t config)
     return 0;
 }
 
-int fxdev_eeprom_firmware(const void *data, size_t length)
+static const struct {
+    unsigned int field;
+    uint8_t offset;
+    uint8_t length;
+} ezusb_header_fields[] = {
+    { FXDEV_HEADER_MODE,    FX_EEPROM_MODE,     1 },
+    { FXDEV_HEADER_VENDOR,  FX_EEPROM_VENDOR,   2 },
+    { FXDEV_HEADER_PRODUCT, FX_EEPROM_PRODUCT,  2 },
+    { FXDEV_HEADER_DEVICE,  FX_EEPROM_DEVICE,   2 },
+    { FXDEV_HEADER_CONFIG,  FX_EEPROM_CONFIG,   1 },
+};
+
+int fxdev_eeprom_header(struct fxdev *fdev, const struct fxdev_header *header, unsigned int fields)
 {
-    uint16_t address;
-    uint8_t transfer[8] = {};
+    uint8_t data[FX_EEPROM_HEADER];
+    unsigned int start = FX_EEPROM_HEADER, end = 0, covered = 0, count;
     int retval;
 
-    printf("Chip write firmware...\n");
-    printf("  Length: 0x%04lx\n", length);
+    printf("Chip write header...\n");
 
-    transfer[FX_FIRMWARE_LENH] = length >> 8;
-    transfer[FX_FIRMWARE_LENL] = length;
+    for (count = 0; count < ARRAY_SIZE(ezusb_header_fields); ++count) {
+        if (!(fields & ezusb_header_fields[count].field))
+            continue;
+        start = min(start, (unsigned int)ezusb_header_fields[count].offset);
+        end = max(end, (unsigned int)(ezusb_header_fields[count].offset +
+                                      ezusb_header_fields[count].length));
+        covered += ezusb_header_fields[count].length;
+    }
 
-    retval = ezusb_eeprom_write(FX_EEPROM_HEADER, transfer, 4, NULL);
-    if (retval)
+    if (start >= end)
+        return -EINVAL;
+
+    if ((retval = fxdev_eeprom_geometry(fdev)))
         return retval;
 
-    retval = ezusb_eeprom_write(FX_EEPROM_FIRMWARE, data, length, NULL);
+    /* fields left out between the ones we write must keep their value */
+    if (covered < end - start) {
+        retval = ezusb_read(
+            fdev, "fxdev_eeprom_header", FX_CMD_RW_EEPROM,
+            start, data + start, end - start
+        );
+        if (retval)
+            return retval;
+    }
+
+    if (fields & FXDEV_HEADER_MODE) {
+        data[FX_EEPROM_MODE] = header->mode;
+        printf("  Boot mode: 0x%02x\n", header->mode);
+    }
+
+    if (fields & FXDEV_HEADER_VENDOR) {
+        put_unaligned_le16(header->vendor, data + FX_EEPROM_VENDOR);
+        printf("  Vendor ID: 0x%04x\n", header->vendor);
+    }
+
+    if (fields & FXDEV_HEADER_PRODUCT) {
+        put_unaligned_le16(header->product, data + FX_EEPROM_PRODUCT);
+        printf("  Product ID: 0x%04x\n", header->product);
+    }
+
+    if (fields & FXDEV_HEADER_DEVICE) {
+        put_unaligned_le16(header->device, data + FX_EEPROM_DEVICE);
+        printf("  Device ID: 0x%04x\n", header->device);
+    }
+
+    if (fields & FXDEV_HEADER_CONFIG) {
+        data[FX_EEPROM_CONFIG] = header->config;
+        printf("  Config: 0x%02x\n", header->config);
+    }
+
+    retval = ezusb_eeprom_write(start, data + start, end - start, fdev);
+    if (!retval)
+        retval = ezusb_flush(fdev);
     if (retval)
         return retval;
 
-    address = ezusb_reset_reg();
+    printf("  Done!\n");
+    return 0;
+}
+
+int fxdev_eeprom_firmware(struct fxdev *fdev, const struct fximage *image)
+{
+    struct fximage c2;
+    int retval;
+
+    printf("Chip write firmware...\n");
+    printf("  Length: 0x%04lx\n", image->bytes);
 
-    transfer[FX_FIRMWARE_LENH] = FX_FIRMWARE_LAST;
-    transfer[FX_FIRMWARE_LENL] = 0x01;
-    transfer[FX_FIRMWARE_ADDRH] = address >> 8;
-    transfer[FX_FIRMWARE_ADDRL] = address;
+    retval = fximage_build_c2(&c2, image, ezusb_reset_reg(fdev), ezusb_is_external(fdev));
+    if (retval)
+        return retval;
 
-    retval = ezusb_eeprom_write(FX_EEPROM_FIRMWARE + length, transfer, 8, NULL);
+    retval = ezusb_eeprom_image(fdev, &c2);
+    fximage_release(&c2);
     if (retval)
         return retval;
 
@@ -392,18 +2041,64 @@ int fxdev_eeprom_firmware(const void *data, size_t length)
     return 0;
 }
 
-int fxdev_reset(void)
+static int ezusb_compile_write(uint16_t address, const void *data, size_t length, void *pdata)
+{
+    FILE *stream = pdata;
+
+    if (fwrite(data, 1, length, stream) != length)
+        return -EIO;
+
+    return 0;
+}
+
+/*
+ * Lay out the complete boot eeprom without a device: header, C2 records
+ * and the final CPUCS write, ready for any eeprom programmer.
+ */
+int fxdev_compile(struct fxdev *fdev, const struct fximage *image,
+                  const struct fxdev_header *header, FILE *stream)
+{
+    uint8_t data[FX_EEPROM_HEADER];
+    struct fximage c2;
+    int retval;
+
+    data[FX_EEPROM_MODE] = header->mode;
+    put_unaligned_le16(header->vendor, data + FX_EEPROM_VENDOR);
+    put_unaligned_le16(header->product, data + FX_EEPROM_PRODUCT);
+    put_unaligned_le16(header->device, data + FX_EEPROM_DEVICE);
+    data[FX_EEPROM_CONFIG] = header->config;
+
+    retval = fximage_build_c2(&c2, image, ezusb_reset_reg(fdev), ezusb_is_external(fdev));
+    if (retval)
+        return retval;
+
+    /* records follow the header back to back, the image has no holes */
+    retval = ezusb_compile_write(0, data, sizeof(data), stream);
+    if (!retval)
+        retval = fximage_range(&c2, 0, fximage_end(&c2), ezusb_compile_write, stream);
+
+    printf("  Segments: %u, records: %lu\n", image->count, c2.records);
+    printf("  Image: 0x%04x bytes for 0x%04lx bytes of firmware\n", fximage_end(&c2), image->bytes);
+
+    fximage_release(&c2);
+    return retval;
+}
+
+int fxdev_reset(struct fxdev *fdev)
 {
     int retval;
 
     printf("Chip reset...\n");
 
-    if ((retval = ezusb_reset(true)))
+    if ((retval = ezusb_reset(fdev, true)))
         return retval;
 
     usleep(100);
 
-    if ((retval = ezusb_reset(false)))
+    if ((retval = ezusb_reset(fdev, false)))
+        return retval;
+
+    if (fdev->renumerate && (retval = fdev->transport->reopen(fdev)))
         return retval;
 
     printf("  Done!\n");
@@ -7,10 +7,12 @@
 #define _FXPROG_H_
 
 #include "fxhw.h"
+#include <limits.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <libusb-1.0/libusb.h>
 
 enum fxdev_type {
@@ -19,21 +21,550 @@ enum fxdev_type {
     DEV_TYPE_FX2LP,
 };
 
-extern libusb_device_handle *fx_usb_device;
-extern enum fxdev_type device_type;
+typedef int (*fx_write_t)(uint16_t address, const void *data, size_t length, void *pdata);
+typedef int (*is_external_t)(uint16_t addr, size_t length);
 
-extern int ihex_parse(const void *image, int (*fn)(uint16_t address, const void *data, size_t length, void *pdata), void *pdata);
-extern int fxdev_ram_write(const void *data, size_t length, bool hex);
-extern int fxdev_eeprom_info(void);
-extern int fxdev_eeprom_erase(void);
-extern int fxdev_eeprom_write(const void *data, size_t length, bool hex);
-extern int fxdev_eeprom_mode(uint8_t mode);
-extern int fxdev_eeprom_vendor(uint16_t vendor);
-extern int fxdev_eeprom_product(uint16_t product);
-extern int fxdev_eeprom_device(uint16_t device);
-extern int fxdev_eeprom_config(uint8_t config);
-extern int fxdev_eeprom_firmware(const void *data, size_t length);
-extern int fxdev_reset(void);
+struct fxdev;
+struct ezusb_engine;
 
-#endif  /* _FXPROG_H_ */
+/**
+ * struct fxdev_transport - how control transfers reach a device
+ * @name: transport name for diagnostics
+ * @submit: queue a filled control transfer, its callback reports completion
+ * @event: reap completions, returns once @completed is set, progress was made
+ *	or the fx_clock() @deadline passed, 0 for none
+ * @reopen: find the device again after it renumerated
+ * @altsetting: select an alternate setting of interface 0
+ * @clear_halt: clear a stalled bulk endpoint
+ * @close: release everything the transport holds for the device
+ */
+struct fxdev_transport {
+    const char *name;
+    int (*submit)(struct fxdev *fdev, struct libusb_transfer *transfer);
+    int (*event)(struct fxdev *fdev, int *completed, double deadline);
+    int (*reopen)(struct fxdev *fdev);
+    int (*altsetting)(struct fxdev *fdev, int alt);
+    int (*clear_halt)(struct fxdev *fdev, uint8_t endpoint);
+    void (*close)(struct fxdev *fdev);
+};
+
+/**
+ * struct fxsim_config - behaviour of the simulated device
+ * @latency: host turnaround per control transfer in microseconds
+ * @rate: control pipe payload throughput in KB/s, 0 for unlimited
+ * @cycle: eeprom page write cycle in microseconds
+ * @eeprom: value answered to FX_CMD_EEPROM_SIZE
+ * @bulk: loader bulk pipe payload throughput in KB/s, 0 for unlimited
+ * @flaky: one in this many control transfers fails with an i/o error, 0 for none
+ * @control: largest control payload the host side accepts, 0 for unlimited
+ * @strict: vendor commands stall until downloaded firmware runs
+ * @loader: downloaded firmware behaves as the companion bulk loader
+ */
+struct fxsim_config {
+    unsigned int latency;
+    unsigned int rate;
+    unsigned int cycle;
+    uint8_t eeprom;
+    unsigned int bulk;
+    unsigned int flaky;
+    unsigned int control;
+    bool strict;
+    bool loader;
+};
+
+#define FXTRACE_MAGIC           "FXTR"
+#define FXTRACE_VERSION         1
+
+/**
+ * struct fxtrace_header - start of a transfer trace file, little endian
+ * @magic: FXTRACE_MAGIC
+ * @version: FXTRACE_VERSION
+ * @type: chip family the trace was taken on
+ * @queue_depth: control transfers the recording kept in flight
+ * @reserved: zero
+ */
+struct fxtrace_header {
+    char magic[4];
+    uint8_t version;
+    uint8_t type;
+    uint16_t queue_depth;
+    uint32_t reserved;
+} __packed;
+
+/**
+ * struct fxtrace_record - one control transfer, in completion order
+ * @start: first submit in microseconds since the trace was opened
+ * @latency: microseconds from first submit to final completion
+ * @hash: crc32c of the payload sent or received
+ * @addr: wValue of the request
+ * @length: wLength of the request
+ * @type: bmRequestType, selects the direction
+ * @opcode: vendor request
+ * @status: libusb error the transfer ended with, 0 on success
+ * @retries: resubmissions before the final completion
+ * @lead: first payload byte, enough to replay cpucs writes
+ * @reserved: zero
+ */
+struct fxtrace_record {
+    uint32_t start;
+    uint32_t latency;
+    uint32_t hash;
+    uint16_t addr;
+    uint16_t length;
+    uint8_t type;
+    uint8_t opcode;
+    int8_t status;
+    uint8_t retries;
+    uint8_t lead;
+    uint8_t reserved[3];
+} __packed;
+
+/**
+ * struct fxtrace - open trace recording
+ * @file: output stream
+ * @start: clock when the trace was opened
+ * @records: transfers written so far
+ */
+struct fxtrace {
+    FILE *file;
+    double start;
+    unsigned long records;
+};
+
+#define FXJOURNAL_MAGIC         "FXJL"
+#define FXJOURNAL_VERSION       1
+
+/**
+ * struct fxjournal_header - start of a resume journal file, little endian
+ * @magic: FXJOURNAL_MAGIC
+ * @version: FXJOURNAL_VERSION
+ * @reserved: zero
+ * @segment: eeprom bytes per journaled segment
+ * @hash: crc32c of the image segments and their placement
+ */
+struct fxjournal_header {
+    char magic[4];
+    uint8_t version;
+    uint8_t reserved;
+    uint16_t segment;
+    uint32_t hash;
+} __packed;
+
+/**
+ * struct fxjournal - eeprom segments an interrupted run got through
+ * @file: journal open for appending
+ * @path: journal file under the user cache directory
+ * @committed: segments written and verified, by segment number
+ * @count: segments set in @committed
+ */
+struct fxjournal {
+    FILE *file;
+    char path[PATH_MAX];
+    bool committed[0x10000 / FX_JOURNAL_SEGMENT];
+    unsigned int count;
+};
+
+/* latency buckets double from 16us, the last one is open ended */
+#define FXDEV_STATS_BUCKETS     16
+#define FXDEV_STATS_SHIFT       4
+
+enum fxdev_stats_slot {
+    FXDEV_STATS_INTERNAL,
+    FXDEV_STATS_EEPROM,
+    FXDEV_STATS_MEMORY,
+    FXDEV_STATS_EEPROM_SIZE,
+    FXDEV_STATS_OTHER,
+    FXDEV_STATS_BULK,
+    FXDEV_STATS_SLOTS,
+};
+
+enum fxretry_class {
+    FXRETRY_FATAL,
+    FXRETRY_TRANSIENT,
+    FXRETRY_STALL,
+};
+
+/**
+ * struct fxretry_config - tunables of the retry and timeout policy
+ * @backoff: wait before the first retry in microseconds, doubled for each one after
+ * @backoff_max: longest wait between two attempts in microseconds
+ * @jitter: percent of a backoff that is randomized away
+ * @timeout_min: shortest adapted control timeout in milliseconds
+ * @timeout_max: longest adapted control timeout in milliseconds
+ * @adapt: derive control timeouts from the latencies seen so far
+ */
+struct fxretry_config {
+    unsigned int backoff;
+    unsigned int backoff_max;
+    unsigned int jitter;
+    unsigned int timeout_min;
+    unsigned int timeout_max;
+    bool adapt;
+};
+
+/**
+ * struct fxretry_rtt - smoothed latency of one vendor request, per byte
+ * @samples: transfers that completed on their first attempt
+ * @srtt: smoothed seconds per byte
+ * @rttvar: smoothed deviation of @srtt
+ */
+struct fxretry_rtt {
+    unsigned long samples;
+    double srtt;
+    double rttvar;
+};
+
+/**
+ * struct fxdev_policy - what the retry policy decided
+ * @fatal: failures given up at once, the device is gone or the request cannot work
+ * @transient: retries scheduled after a backoff
+ * @stalls: stalled transfers, a control request gets one more attempt
+ * @exhausted: transfers that failed on their last attempt
+ * @halts: bulk endpoints cleared after a stall
+ * @stretched: retries after a timeout that went out with a doubled timeout
+ * @adapted: control transfers sent with a timeout derived from latency
+ * @backoff: seconds of backoff scheduled
+ * @timeout: longest adapted timeout handed out, in milliseconds
+ */
+struct fxdev_policy {
+    unsigned long fatal;
+    unsigned long transient;
+    unsigned long stalls;
+    unsigned long exhausted;
+    unsigned long halts;
+    unsigned long stretched;
+    unsigned long adapted;
+    double backoff;
+    unsigned int timeout;
+};
+
+/**
+ * struct fxdev_opstats - profile of one vendor request in one direction
+ * @transfers: completed transfers
+ * @bytes: payload bytes moved by @transfers
+ * @retries: resubmissions, counted when the transfer finally completes
+ * @errors: transfers that failed after all retries
+ * @total: summed latency from first submit to completion, in seconds
+ * @max: worst latency, in seconds
+ * @histogram: transfers per latency bucket
+ */
+struct fxdev_opstats {
+    unsigned long transfers;
+    unsigned long bytes;
+    unsigned long retries;
+    unsigned long errors;
+    double total;
+    double max;
+    unsigned long histogram[FXDEV_STATS_BUCKETS];
+};
+
+/**
+ * struct fxdev_stats - transfer accounting of one device
+ * @transfers: completed control transfers
+ * @bytes: payload bytes moved by @transfers
+ * @retries: transfers that had to be resubmitted
+ * @errors: transfers that failed after all retries
+ * @policy: retry and timeout decisions
+ * @ops: per request and direction profile, only filled when profiling
+ */
+struct fxdev_stats {
+    unsigned long transfers;
+    unsigned long bytes;
+    unsigned long retries;
+    unsigned long errors;
+    struct fxdev_policy policy;
+    struct fxdev_opstats ops[FXDEV_STATS_SLOTS][2];
+};
 
+/**
+ * struct fxdev_eeprom - boot eeprom geometry decoded from FX_CMD_EEPROM_SIZE
+ * @info: value reported by the firmware
+ * @name: human readable part family
+ * @width: address bytes sent to the eeprom
+ * @page: write page size, writes never cross it
+ * @capacity: addressable bytes
+ */
+struct fxdev_eeprom {
+    uint8_t info;
+    const char *name;
+    unsigned int width;
+    unsigned int page;
+    uint32_t capacity;
+};
+
+/**
+ * struct fxdev - per-device context of libfxprog
+ * @ctx: libusb context the handle belongs to
+ * @handle: opened and claimed device handle
+ * @transport: control transfer backend, libusb unless simulated
+ * @priv: private data of @transport
+ * @vendor: usb vendor id the device was opened with
+ * @product: usb product id the device was opened with
+ * @bus: bus number of the physical port, kept across renumeration
+ * @address: device address of the current enumeration
+ * @ports: port path from the root hub
+ * @depth: valid entries in @ports
+ * @type: chip family, selects memory map and reset register
+ * @queue_depth: control transfers kept in flight
+ * @chunk: largest control transfer payload, probed per port with @probe
+ * @timeout: per-transfer timeout in milliseconds
+ * @retry: attempts per transfer before giving up
+ * @policy: how failed transfers are retried and timeouts chosen
+ * @rtt: latency estimate per vendor request, for adapted timeouts
+ * @verify: read back and compare everything written
+ * @delta: only rewrite eeprom pages whose content changed
+ * @resume: journal eeprom writes per segment, skip what a failed run committed
+ * @probe: size @chunk for this port before the first operation, cached per port
+ * @reprobe: ignore the cached size and probe again
+ * @preload: vendor request firmware loaded before eeprom and external access
+ * @preloaded: @preload is currently running
+ * @loader: @preload is the companion bulk loader, probe for it once running
+ * @bulk: the loader answered, eeprom and external memory go over bulk
+ * @crc: the loader checksums eeprom ranges, verify reads back mismatches only
+ * @seq: sequence number of the next loader frame
+ * @frames: loader frames sent and not yet confirmed
+ * @renumerate: started firmware renumerates, follow it and reopen
+ * @profile: timestamp every transfer and fill the per request statistics
+ * @trace: record every transfer, NULL when not tracing
+ * @stats: transfer accounting
+ * @eeprom: eeprom geometry, probed on first eeprom access
+ * @engine: asynchronous transfer engine, set up on first use
+ */
+struct fxdev {
+    libusb_context *ctx;
+    libusb_device_handle *handle;
+    const struct fxdev_transport *transport;
+    void *priv;
+    uint16_t vendor;
+    uint16_t product;
+    uint8_t bus;
+    uint8_t address;
+    uint8_t ports[FX_USB_PORT_DEPTH];
+    int depth;
+    enum fxdev_type type;
+    unsigned int queue_depth;
+    unsigned int chunk;
+    unsigned int timeout;
+    unsigned int retry;
+    struct fxretry_config policy;
+    struct fxretry_rtt rtt[FXDEV_STATS_SLOTS];
+    bool verify;
+    bool delta;
+    bool resume;
+    bool probe;
+    bool reprobe;
+    const struct fximage *preload;
+    bool preloaded;
+    bool loader;
+    bool bulk;
+    bool crc;
+    uint8_t seq;
+    unsigned int frames;
+    bool renumerate;
+    bool profile;
+    struct fxtrace *trace;
+    struct fxdev_stats stats;
+    const struct fxdev_eeprom *eeprom;
+    struct ezusb_engine *engine;
+};
+
+/**
+ * struct fx_coalesce - merge address-adjacent writes into large transfers
+ * @write: downstream writer called once per merged run
+ * @is_external: memory region classifier, NULL for eeprom
+ * @pdata: private data handed to @write
+ * @limit: size of @buffer, the longest run handed to @write
+ * @address: start address of the pending run
+ * @length: bytes pending in @buffer
+ * @external: region of the pending run
+ * @records: number of writes pushed in
+ * @transfers: number of runs handed to @write
+ */
+struct fx_coalesce {
+    fx_write_t write;
+    is_external_t is_external;
+    void *pdata;
+    size_t limit;
+    uint16_t address;
+    size_t length;
+    bool external;
+    unsigned long records;
+    unsigned long transfers;
+    uint8_t *buffer;
+};
+
+struct fximage_seg {
+    uint16_t address;
+    size_t length;
+    uint8_t *data;
+};
+
+/**
+ * struct fximage - sparse memory image, parsed once and then read-only
+ * @segs: non-overlapping segments sorted by address, adjacent ones merged
+ * @count: number of valid segments
+ * @size: allocated segments
+ * @records: number of records parsed into the image
+ * @bytes: total payload bytes
+ * @borrowed: segment data points into caller memory, never freed or grown
+ */
+struct fximage {
+    struct fximage_seg *segs;
+    unsigned int count;
+    unsigned int size;
+    unsigned long records;
+    size_t bytes;
+    bool borrowed;
+};
+
+/* a full length record: colon, 2 * (255 + 5) digits and CRLF */
+#define IHEX_LINE_MAX   524
+
+/**
+ * struct ihex_stream - incremental HEX parser, bounded to one line
+ * @line: line cut at a chunk edge, completed by the next chunk
+ * @length: bytes held in @line
+ * @base: extended linear address of following records
+ * @comment: inside a comment line that is being skipped
+ * @done: the EOF record was seen
+ */
+struct ihex_stream {
+    char line[IHEX_LINE_MAX];
+    size_t length;
+    unsigned int base;
+    bool comment;
+    bool done;
+};
+
+enum fxdev_header_field {
+    FXDEV_HEADER_MODE       = 1U << 0,
+    FXDEV_HEADER_VENDOR     = 1U << 1,
+    FXDEV_HEADER_PRODUCT    = 1U << 2,
+    FXDEV_HEADER_DEVICE     = 1U << 3,
+    FXDEV_HEADER_CONFIG     = 1U << 4,
+};
+
+/**
+ * struct fxdev_header - boot eeprom header, written in one transfer
+ * @mode: boot mode byte, 0xc0 or 0xc2
+ * @vendor: usb vendor id reported after boot
+ * @product: usb product id reported after boot
+ * @device: device release number
+ * @config: configuration byte
+ */
+struct fxdev_header {
+    uint8_t mode;
+    uint16_t vendor;
+    uint16_t product;
+    uint16_t device;
+    uint8_t config;
+};
+
+static inline double fx_clock(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+extern void fxdev_stats_record(struct fxdev_stats *stats, uint8_t type, uint8_t opcode, size_t bytes, double latency, unsigned int retries, int error);
+extern void fxdev_stats_bulk(struct fxdev_stats *stats, uint8_t endpoint, size_t bytes, double latency, int error);
+extern enum fxdev_stats_slot fxdev_stats_slot(uint8_t opcode);
+extern const char *fxdev_stats_name(enum fxdev_stats_slot slot);
+extern void fxdev_stats_merge(struct fxdev_stats *dest, const struct fxdev_stats *src);
+extern void fxdev_stats_report(const struct fxdev_stats *stats, FILE *stream, bool json);
+
+extern struct fxtrace *fxtrace_open(const char *name, enum fxdev_type type, unsigned int queue_depth);
+extern void fxtrace_record(struct fxtrace *trace, struct libusb_transfer *transfer, double submitted, unsigned int retries, int error);
+extern int fxtrace_close(struct fxtrace *trace);
+extern int fxtrace_read_header(FILE *file, struct fxtrace_header *header);
+extern int fxtrace_read(FILE *file, struct fxtrace_record *record);
+
+extern int fxjournal_open(struct fxjournal *journal, struct fxdev *fdev, const struct fximage *image);
+extern int fxjournal_commit(struct fxjournal *journal, unsigned int segment);
+extern void fxjournal_close(struct fxjournal *journal, bool complete);
+extern int fx_cache_dir(char *buf, size_t size);
+
+extern int fxprobe_load(struct fxdev *fdev, unsigned int *chunk);
+extern int fxprobe_store(struct fxdev *fdev, unsigned int chunk);
+
+extern const struct fxretry_config fxretry_default;
+extern enum fxretry_class fxretry_classify(int error);
+extern double fxretry_backoff(const struct fxretry_config *config, unsigned int retry, unsigned int *seed);
+extern void fxretry_sample(struct fxretry_rtt *rtt, double latency, size_t len);
+extern unsigned int fxretry_timeout(const struct fxdev *fdev, const struct fxretry_rtt *rtt, size_t len);
+extern int fxretry_parse(struct fxdev *fdev, char *opts);
+
+extern uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+extern uint16_t crc16_ccitt(uint16_t crc, const void *data, size_t length);
+
+extern int ezusb_request(struct fxdev *fdev, const char *label, uint8_t direction, uint8_t opcode, uint16_t value, uint16_t index, void *data, size_t len);
+extern int ezusb_submit(struct fxdev *fdev, const char *label, uint8_t direction, uint8_t opcode, uint16_t addr, void *data, size_t len);
+extern int ezusb_submit_bulk(struct fxdev *fdev, const char *label, uint8_t endpoint, const void *head, size_t hlen, void *data, size_t len);
+extern int ezusb_poll(struct fxdev *fdev);
+extern int ezusb_flush(struct fxdev *fdev);
+extern void ezusb_release(struct fxdev *fdev);
+
+extern int ezusb_loader_probe(struct fxdev *fdev);
+extern int ezusb_loader_write(struct fxdev *fdev, uint8_t op, uint16_t addr, const void *data, size_t len);
+extern int ezusb_loader_read(struct fxdev *fdev, uint8_t op, uint16_t addr, void *data, size_t len);
+extern int ezusb_loader_sync(struct fxdev *fdev);
+
+extern int fx_coalesce_init(struct fx_coalesce *co, fx_write_t write, is_external_t is_external, void *pdata, size_t limit);
+extern void fx_coalesce_release(struct fx_coalesce *co);
+extern int fx_coalesce_push(uint16_t address, const void *data, size_t length, void *pdata);
+extern int fx_coalesce_flush(struct fx_coalesce *co);
+
+extern void fximage_init(struct fximage *image);
+extern void fximage_release(struct fximage *image);
+extern int fximage_insert(struct fximage *image, uint16_t address, const void *data, size_t length);
+extern int fximage_append(uint16_t address, const void *data, size_t length, void *pdata);
+extern int fximage_load_ihex(struct fximage *image, const void *data);
+extern int fximage_load_binary(struct fximage *image, uint16_t address, const void *data, size_t length);
+extern int fximage_own(struct fximage *image);
+extern const struct fximage_seg *fximage_lookup(const struct fximage *image, uint16_t address);
+extern bool fximage_overlaps(const struct fximage *image, uint16_t address, size_t length);
+extern uint32_t fximage_end(const struct fximage *image);
+extern int fximage_range(const struct fximage *image, uint32_t start, uint32_t end, fx_write_t fn, void *pdata);
+extern int fximage_build_c2(struct fximage *c2, const struct fximage *image, uint16_t cpucs, is_external_t is_external);
+
+extern int ihex_decoder(const char *name);
+extern int ihex_parse(const void *image, fx_write_t fn, void *pdata);
+extern void ihex_stream_init(struct ihex_stream *stream);
+extern int ihex_stream_feed(struct ihex_stream *stream, const void *data, size_t length, fx_write_t fn, void *pdata);
+extern int ihex_stream_finish(struct ihex_stream *stream, fx_write_t fn, void *pdata);
+
+extern const struct fxdev_transport fxdev_libusb;
+extern const struct fximage fxdev_preload_image;
+extern const struct fxsim_config fxsim_default;
+extern int fxsim_parse(struct fxsim_config *config, char *opts);
+extern int fxsim_open(struct fxdev *fdev, const struct fxsim_config *config);
+extern void fxsim_report(struct fxdev *fdev);
+
+extern void fxdev_init(struct fxdev *fdev, libusb_context *ctx, enum fxdev_type type);
+extern int fxdev_open(struct fxdev *fdev, libusb_device *usbdev);
+extern int fxdev_open_vid_pid(struct fxdev *fdev, uint16_t vendor, uint16_t product);
+extern void fxdev_close(struct fxdev *fdev);
+
+extern int fxdev_preload(struct fxdev *fdev);
+extern int fxdev_probe(struct fxdev *fdev);
+extern int fxdev_ram_write(struct fxdev *fdev, const struct fximage *image);
+extern int fxdev_ram_stream(struct fxdev *fdev, int fd);
+extern int fxdev_ram_verify(struct fxdev *fdev, const struct fximage *image);
+extern int fxdev_eeprom_geometry(struct fxdev *fdev);
+extern int fxdev_eeprom_info(struct fxdev *fdev);
+extern int fxdev_eeprom_erase(struct fxdev *fdev);
+extern int fxdev_eeprom_write(struct fxdev *fdev, const struct fximage *image);
+extern int fxdev_eeprom_verify(struct fxdev *fdev, const struct fximage *image);
+extern int fxdev_eeprom_mode(struct fxdev *fdev, uint8_t mode);
+extern int fxdev_eeprom_vendor(struct fxdev *fdev, uint16_t vendor);
+extern int fxdev_eeprom_product(struct fxdev *fdev, uint16_t product);
+extern int fxdev_eeprom_device(struct fxdev *fdev, uint16_t device);
+extern int fxdev_eeprom_config(struct fxdev *fdev, uint8_t config);
+extern int fxdev_eeprom_header(struct fxdev *fdev, const struct fxdev_header *header, unsigned int fields);
+extern int fxdev_eeprom_firmware(struct fxdev *fdev, const struct fximage *image);
+extern int fxdev_compile(struct fxdev *fdev, const struct fximage *image, const struct fxdev_header *header, FILE *stream);
+extern int fxdev_reset(struct fxdev *fdev);
+
+#endif  /* _FXPROG_H_ */
@@ -0,0 +1,203 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright(c) 2021-2022 John Sanpe <sanpeqf@gmail.com>
+ */
+
+#include "fxprog.h"
+#include <ctype.h>
+#include <time.h>
+
+#define BENCH_SIZE      (64UL << 20)
+#define BENCH_ROUNDS    5
+
+struct bench_sum {
+    unsigned long bytes;
+    uint32_t hash;
+};
+
+/* The record parser fxprog shipped up to v1.1, kept as the baseline */
+static unsigned int legacy_strtohex(const char *str, unsigned int length)
+{
+    unsigned int value;
+
+    for (value = 0; length; --length) {
+        if (*str >= '0' && *str <= '9')
+            value = (value * 16) + (*str++ - '0');
+        else if (tolower(*str) >= 'a' && tolower(*str) <= 'f')
+            value = (value * 16) + (tolower(*str++) - 'a' + 10);
+        else
+            return 0;
+    }
+
+    return value;
+}
+
+static bool legacy_checksum(const char *start, const char *end)
+{
+    uint8_t cumul;
+
+    for (cumul = 0; start < end; start += 2)
+        cumul += legacy_strtohex(start, 2);
+
+    cumul = 0x100 - cumul;
+    return legacy_strtohex(end, 2) == cumul;
+}
+
+static int legacy_parse(const char *image, fx_write_t fn, void *pdata)
+{
+    unsigned int length, offset, type, count;
+    const char *line, *end;
+    char buff[255];
+    int retval;
+
+    for (line = image; *line; line = end + 1) {
+        end = strchr(line + 1, '\n');
+        if (*line != ':' || !end)
+            return -EINVAL;
+
+        length = legacy_strtohex(line + 1, 2);
+        offset = legacy_strtohex(line + 3, 4);
+        type = legacy_strtohex(line + 7, 2);
+
+        if (((end - line - 9 - 2) / 2) != length)
+            return -EFAULT;
+
+        if (!legacy_checksum(line + 1, end - 2))
+            return -EFAULT;
+
+        if (type == 1)
+            return 0;
+
+        if (type)
+            continue;
+
+        for (count = 0; count < length; ++count)
+            buff[count] = legacy_strtohex(line + 9 + count * 2, 2);
+        if ((retval = fn(offset, buff, length, pdata)))
+            return retval;
+    }
+
+    return -ENFILE;
+}
+
+static int bench_collect(uint16_t address, const void *data, size_t length, void *pdata)
+{
+    struct bench_sum *sum = pdata;
+    const uint8_t *byte = data;
+
+    sum->bytes += length;
+    while (length--)
+        sum->hash = (sum->hash * 31) + *byte++;
+
+    return 0;
+}
+
+static char *bench_generate(size_t size, unsigned int width)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    unsigned int address = 0, count, sum;
+    uint8_t record[5 + 255];
+    char *image, *pos;
+
+    image = malloc(size + 64);
+    if (!image)
+        return NULL;
+
+    srand(1);
+    for (pos = image; pos + (width + 5) * 2 + 2 < image + size;) {
+        record[0] = width;
+        record[1] = address >> 8;
+        record[2] = address;
+        record[3] = 0;
+        for (count = 0; count < width; ++count)
+            record[4 + count] = rand();
+
+        for (sum = 0, count = 0; count < width + 4; ++count)
+            sum += record[count];
+        record[width + 4] = -sum;
+
+        *pos++ = ':';
+        for (count = 0; count < width + 5; ++count) {
+            *pos++ = digits[record[count] >> 4];
+            *pos++ = digits[record[count] & 0xf];
+        }
+        *pos++ = '\n';
+        address = (address + width) & 0xffff;
+    }
+
+    strcpy(pos, ":00000001FF\n");
+    return image;
+}
+
+static double bench_run(const char *name, const char *image, size_t size, bool legacy, struct bench_sum *sum)
+{
+    struct timespec start, stop;
+    double best = 0, seconds;
+    unsigned int round;
+    int retval;
+
+    if (!legacy && ihex_decoder(name))
+        return 0;
+
+    for (round = 0; round < BENCH_ROUNDS; ++round) {
+        memset(sum, 0, sizeof(*sum));
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        if (legacy)
+            retval = legacy_parse(image, bench_collect, sum);
+        else
+            retval = ihex_parse(image, bench_collect, sum);
+
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+        if (retval) {
+            fprintf(stderr, "%s: parse failed: %d\n", name, retval);
+            exit(1);
+        }
+
+        seconds = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+        if (!best || seconds < best)
+            best = seconds;
+    }
+
+    return size / best / 1e6;
+}
+
+int main(int argc, char *const argv[])
+{
+    static const char *decoders[] = {"scalar", "sse2", "avx2"};
+    static const unsigned int widths[] = {16, 32, 255};
+    struct bench_sum reference, sum;
+    unsigned int width, index;
+    size_t size = BENCH_SIZE;
+    double legacy, speed;
+    char *image;
+
+    if (argc > 1)
+        size = strtoul(argv[1], NULL, 0) << 20;
+
+    for (width = 0; width < ARRAY_SIZE(widths); ++width) {
+        if (!(image = bench_generate(size, widths[width])))
+            return -ENOMEM;
+
+        legacy = bench_run("legacy", image, size, true, &reference);
+        printf("%3u bytes/record:\n", widths[width]);
+        printf("  %-8s %8.1f MB/s\n", "legacy", legacy);
+
+        for (index = 0; index < ARRAY_SIZE(decoders); ++index) {
+            speed = bench_run(decoders[index], image, size, false, &sum);
+            if (!speed) {
+                printf("  %-8s      n/a\n", decoders[index]);
+                continue;
+            }
+            if (sum.bytes != reference.bytes || sum.hash != reference.hash) {
+                fprintf(stderr, "%s: decoded data differs from legacy parser\n", decoders[index]);
+                return 1;
+            }
+            printf("  %-8s %8.1f MB/s  x%.1f\n", decoders[index], speed, speed / legacy);
+        }
+
+        free(image);
+    }
+
+    return 0;
+}
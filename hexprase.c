@@ -3,16 +3,14 @@
  * Copyright(c) 2021-2022 John Sanpe <sanpeqf@gmail.com>
  */
 
+#define _GNU_SOURCE
 #include "fxprog.h"
-#include <ctype.h>
+#include <stdatomic.h>
 
-struct ihex_head{
-    char code;
-    char length[2];
-    char offset[4];
-    char type[2];
-    char data[0];
-} __packed;
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define IHEX_X86 1
+#endif
 
 enum ihex_type {
     IHEX_TYPE_DATA      = 0,
@@ -23,103 +21,352 @@ enum ihex_type {
     IHEX_TYPE_SADDR     = 5,
 };
 
-static unsigned int strtohex(const char *str, unsigned int length)
+/* length, offset, type and checksum around the data bytes */
+#define IHEX_OVERHEAD   5
+#define IHEX_RECORD_MAX (255 + IHEX_OVERHEAD)
+
+typedef int (*ihex_decode_t)(const char *str, size_t count, uint8_t *data, unsigned int *sum);
+
+#define H(c) [c] = (c) - '0' + 1
+#define L(c) [c] = (c) - 'a' + 11, [(c) - 'a' + 'A'] = (c) - 'a' + 11
+
+/* nibble value plus one, zero marks an invalid character */
+static const uint8_t ihex_table[256] = {
+    H('0'), H('1'), H('2'), H('3'), H('4'),
+    H('5'), H('6'), H('7'), H('8'), H('9'),
+    L('a'), L('b'), L('c'), L('d'), L('e'), L('f'),
+};
+
+#undef H
+#undef L
+
+static int ihex_decode_scalar(const char *str, size_t count, uint8_t *data, unsigned int *sum)
 {
-    unsigned int value;
-
-    for (value = 0; length; --length) {
-        if (*str >= '0' && *str <= '9')
-            value = (value * 16) + (*str++ - '0');
-        else if (tolower(*str) >= 'a' && tolower(*str) <= 'f')
-            value = (value * 16) + (tolower(*str++) - 'a' + 10);
-        else
-            return 0;
+    unsigned int high, low;
+
+    for (; count; --count, str += 2) {
+        high = ihex_table[(uint8_t)str[0]];
+        low = ihex_table[(uint8_t)str[1]];
+        if (unlikely(!high || !low))
+            return -EINVAL;
+        *data = ((high - 1) << 4) | (low - 1);
+        *sum += *data++;
     }
 
-    return value;
+    return 0;
 }
 
-bool ihex_checksum(const char *start, const char *end)
+#if defined(IHEX_X86) && defined(__SSE2__)
+static inline __m128i ihex_nibble_sse2(__m128i chars, __m128i *valid)
 {
-    uint8_t cumul;
+    __m128i digit, alpha, isdigit, isalpha;
+
+    digit = _mm_sub_epi8(chars, _mm_set1_epi8('0'));
+    alpha = _mm_sub_epi8(_mm_or_si128(chars, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
 
-    for (cumul = 0; start < end; start += 2)
-        cumul += strtohex(start, 2);
+    /* unsigned x <= n as min(x, n) == x */
+    isdigit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+    isalpha = _mm_cmpeq_epi8(_mm_min_epu8(alpha, _mm_set1_epi8(5)), alpha);
+    *valid = _mm_or_si128(isdigit, isalpha);
 
-    cumul = 0x100 - cumul;
-    return strtohex(end, 2) == cumul;
+    return _mm_or_si128(
+        _mm_and_si128(isdigit, digit),
+        _mm_and_si128(isalpha, _mm_add_epi8(alpha, _mm_set1_epi8(10)))
+    );
 }
 
-int ihex_parse(const void *image, int (*fn)(uint16_t address, const void *data, size_t length, void *pdata), void *pdata)
+static int ihex_decode_sse2(const char *str, size_t count, uint8_t *data, unsigned int *sum)
 {
-    const struct ihex_head *line, *next;
-    unsigned int base;
-    char buff[255];
-    int retval;
+    __m128i chars, nibble, valid, bytes, total = _mm_setzero_si128();
 
-    for (line = image; line; line = next) {
-        unsigned int length, offset, type;
-        unsigned int count;
-        const char *end;
-        uint32_t addr;
+    for (; count >= 8; count -= 8, str += 16, data += 8) {
+        chars = _mm_loadu_si128((const __m128i *)str);
+        nibble = ihex_nibble_sse2(chars, &valid);
+        if (unlikely(_mm_movemask_epi8(valid) != 0xffff))
+            return -EINVAL;
 
-        if (line->code == '#')
-            continue;
+        /* (first << 4) | second within each 16-bit lane */
+        bytes = _mm_or_si128(
+            _mm_and_si128(_mm_slli_epi16(nibble, 4), _mm_set1_epi16(0x00f0)),
+            _mm_srli_epi16(nibble, 8)
+        );
+        bytes = _mm_packus_epi16(bytes, _mm_setzero_si128());
+        _mm_storel_epi64((__m128i *)data, bytes);
+        total = _mm_add_epi64(total, _mm_sad_epu8(bytes, _mm_setzero_si128()));
+    }
 
-        if (line->code != ':') {
-            fprintf(stderr, "Error IHEX format\n");
+    *sum += _mm_cvtsi128_si32(total);
+    return ihex_decode_scalar(str, count, data, sum);
+}
+#endif
+
+#if defined(IHEX_X86)
+__attribute__((target("avx2")))
+static int ihex_decode_avx2(const char *str, size_t count, uint8_t *data, unsigned int *sum)
+{
+    __m256i chars, digit, alpha, isdigit, isalpha, nibble, bytes;
+    __m256i total = _mm256_setzero_si256();
+    __m128i tail;
+
+    for (; count >= 16; count -= 16, str += 32, data += 16) {
+        chars = _mm256_loadu_si256((const __m256i *)str);
+        digit = _mm256_sub_epi8(chars, _mm256_set1_epi8('0'));
+        alpha = _mm256_sub_epi8(_mm256_or_si256(chars, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+        isdigit = _mm256_cmpeq_epi8(_mm256_min_epu8(digit, _mm256_set1_epi8(9)), digit);
+        isalpha = _mm256_cmpeq_epi8(_mm256_min_epu8(alpha, _mm256_set1_epi8(5)), alpha);
+
+        if (unlikely(_mm256_movemask_epi8(_mm256_or_si256(isdigit, isalpha)) != -1))
             return -EINVAL;
-        }
 
-        end = strchr(line->data, '\n');
-        if (!end) {
-            fprintf(stderr, "EOF without EOF record\n");
-            return -ENFILE;
-        }
+        nibble = _mm256_or_si256(
+            _mm256_and_si256(isdigit, digit),
+            _mm256_and_si256(isalpha, _mm256_add_epi8(alpha, _mm256_set1_epi8(10)))
+        );
 
-        next = (void *)end + 1;
+        bytes = _mm256_or_si256(
+            _mm256_and_si256(_mm256_slli_epi16(nibble, 4), _mm256_set1_epi16(0x00f0)),
+            _mm256_srli_epi16(nibble, 8)
+        );
 
-        /* Get ihex line information */
-        length = strtohex(&line->length[0], 2);
-        offset = strtohex(&line->offset[0], 4);
-        type = strtohex(&line->type[0], 2);
-        addr = ((base & 0xffff) << 16) | (offset & 0xffff);
+        /* packus works per 128-bit lane, gather both low halves */
+        bytes = _mm256_packus_epi16(bytes, _mm256_setzero_si256());
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+        bytes = _mm256_permute4x64_epi64(bytes, 0x08);
+        _mm_storeu_si128((__m128i *)data, _mm256_castsi256_si128(bytes));
+    }
 
-        /* Check the actual length of the data */
-        if (((end - line->data - 2) / 2) != length) {
-            fprintf(stderr, "Error IHEX length\n");
-            return -EFAULT;
+    tail = _mm_add_epi64(_mm256_castsi256_si128(total), _mm256_extracti128_si256(total, 1));
+    *sum += _mm_cvtsi128_si32(_mm_add_epi64(tail, _mm_unpackhi_epi64(tail, tail)));
+
+    /* avoid the AVX-SSE transition penalty in the legacy-encoded tail */
+    _mm256_zeroupper();
+# if defined(__SSE2__)
+    return ihex_decode_sse2(str, count, data, sum);
+# else
+    return ihex_decode_scalar(str, count, data, sum);
+# endif
+}
+#endif
+
+static const struct {
+    const char *name;
+    ihex_decode_t decode;
+} ihex_decoders[] = {
+#if defined(IHEX_X86)
+    { "avx2",   ihex_decode_avx2    },
+#endif
+#if defined(IHEX_X86) && defined(__SSE2__)
+    { "sse2",   ihex_decode_sse2    },
+#endif
+    { "scalar", ihex_decode_scalar  },
+};
+
+/* parsers run on gang and daemon threads, whichever comes first picks it */
+static _Atomic(ihex_decode_t) ihex_decode;
+
+static bool ihex_decoder_usable(unsigned int index)
+{
+#if defined(IHEX_X86)
+    if (ihex_decoders[index].decode == ihex_decode_avx2)
+        return __builtin_cpu_supports("avx2");
+#endif
+    return true;
+}
+
+int ihex_decoder(const char *name)
+{
+    unsigned int index;
+
+    for (index = 0; index < ARRAY_SIZE(ihex_decoders); ++index) {
+        if (name && strcmp(name, ihex_decoders[index].name))
+            continue;
+        if (!ihex_decoder_usable(index))
+            continue;
+        atomic_store_explicit(&ihex_decode, ihex_decoders[index].decode, memory_order_relaxed);
+        return 0;
+    }
+
+    return -ENOTSUP;
+}
+
+static inline ihex_decode_t ihex_decoder_get(void)
+{
+    ihex_decode_t decode;
+
+    decode = atomic_load_explicit(&ihex_decode, memory_order_relaxed);
+    if (unlikely(!decode)) {
+        ihex_decoder(NULL);
+        decode = atomic_load_explicit(&ihex_decode, memory_order_relaxed);
+    }
+
+    return decode;
+}
+
+/* one record without its newline, 0 to go on, 1 after the EOF record */
+static int ihex_line(struct ihex_stream *stream, const char *line, const char *end,
+                     fx_write_t fn, void *pdata)
+{
+    uint8_t record[IHEX_RECORD_MAX];
+    unsigned int sum;
+    size_t count;
+    uint32_t addr;
+    int retval;
+
+    if (end > line && end[-1] == '\r')
+        end--;
+
+    if (line == end || *line == '#')
+        return 0;
+
+    if (*line++ != ':') {
+        fprintf(stderr, "Error IHEX format\n");
+        return -EINVAL;
+    }
+
+    /* Validate, decode and checksum the whole record in one pass */
+    count = (end - line) / 2;
+    if ((end - line) % 2 || count < IHEX_OVERHEAD || count > IHEX_RECORD_MAX) {
+        fprintf(stderr, "Error IHEX length\n");
+        return -EFAULT;
+    }
+
+    sum = 0;
+    if (ihex_decoder_get()(line, count, record, &sum)) {
+        fprintf(stderr, "Error IHEX format\n");
+        return -EINVAL;
+    }
+
+    /* Check the actual length of the data */
+    if (record[0] + IHEX_OVERHEAD != count) {
+        fprintf(stderr, "Error IHEX length\n");
+        return -EFAULT;
+    }
+
+    if (sum & 0xff) {
+        fprintf(stderr, "Error IHEX checksum\n");
+        return -EFAULT;
+    }
+
+    addr = ((stream->base & 0xffff) << 16) | (record[1] << 8) | record[2];
+
+    switch (record[3]) {
+        case IHEX_TYPE_DATA:
+            retval = fn(addr, &record[4], record[0], pdata);
+            if (retval)
+                return retval;
+            break;
+
+        case IHEX_TYPE_EADDR:
+            if (record[0] != 2) {
+                fprintf(stderr, "Error IHEX addr format\n");
+                return -ENODATA;
+            }
+            stream->base = (record[4] << 8) | record[5];
+            break;
+
+        case IHEX_TYPE_EOF:
+            stream->done = true;
+            return 1;
+
+        default:
+            break;
+    }
+
+    return 0;
+}
+
+int ihex_parse(const void *image, fx_write_t fn, void *pdata)
+{
+    struct ihex_stream stream = {};
+    const char *line, *next, *end;
+    int retval;
+
+    for (line = image; *line; line = next) {
+        end = strchrnul(line, '\n');
+        next = *end ? end + 1 : end;
+
+        retval = ihex_line(&stream, line, end, fn, pdata);
+        if (retval)
+            return retval < 0 ? retval : 0;
+    }
+
+    fprintf(stderr, "EOF without EOF record\n");
+    return -ENFILE;
+}
+
+void ihex_stream_init(struct ihex_stream *stream)
+{
+    memset(stream, 0, sizeof(*stream));
+}
+
+/*
+ * Chunks may end anywhere, a line cut at the edge is carried over in
+ * the stream and completed by the next chunk. Whole lines inside a
+ * chunk are parsed in place. Anything after the EOF record is ignored.
+ */
+int ihex_stream_feed(struct ihex_stream *stream, const void *data, size_t length,
+                     fx_write_t fn, void *pdata)
+{
+    const char *line = data, *end, *limit = line + length;
+    size_t xfer;
+    int retval;
+
+    while (line < limit && !stream->done) {
+        end = memchr(line, '\n', limit - line);
+
+        /* comments may be long, they are dropped rather than carried */
+        if (stream->comment || (!stream->length && *line == '#')) {
+            stream->comment = !end;
+            line = end ? end + 1 : limit;
+            continue;
+        }
+
+        if (end && !stream->length) {
+            retval = ihex_line(stream, line, end, fn, pdata);
+            if (retval < 0)
+                return retval;
+            line = end + 1;
+            continue;
         }
 
-        if (!ihex_checksum((void *)line + 1, (void *)end - 2)) {
-            fprintf(stderr, "Error IHEX checksum\n");
+        xfer = (end ? end : limit) - line;
+        if (stream->length + xfer > sizeof(stream->line)) {
+            fprintf(stderr, "Error IHEX length\n");
             return -EFAULT;
         }
 
-        switch (type) {
-            case IHEX_TYPE_DATA:
-                for (count = 0; count < length; ++count)
-                    buff[count] = strtohex(&line->data[count * 2], 2);
-                retval = fn(addr, buff, length, pdata);
-                if (retval)
-                    return retval;
-                break;
-
-            case IHEX_TYPE_EADDR:
-                if (length != 4) {
-                    fprintf(stderr, "Error IHEX addr format\n");
-                    return -ENODATA;
-                }
-                base = strtohex(&line->data[0], 4);
-                break;
-
-            case IHEX_TYPE_EOF:
-                return 0;
-
-            default:
-                continue;
+        memcpy(stream->line + stream->length, line, xfer);
+        stream->length += xfer;
+        line += xfer;
+
+        if (end) {
+            retval = ihex_line(stream, stream->line, stream->line + stream->length, fn, pdata);
+            if (retval < 0)
+                return retval;
+            stream->length = 0;
+            line++;
         }
     }
 
-    return -ENFILE;
+    return 0;
+}
+
+int ihex_stream_finish(struct ihex_stream *stream, fx_write_t fn, void *pdata)
+{
+    int retval;
+
+    /* the last line may come without a newline */
+    if (stream->length && !stream->done) {
+        retval = ihex_line(stream, stream->line, stream->line + stream->length, fn, pdata);
+        stream->length = 0;
+        if (retval < 0)
+            return retval;
+    }
+
+    if (!stream->done) {
+        fprintf(stderr, "EOF without EOF record\n");
+        return -ENFILE;
+    }
+
+    return 0;
 }
@@ -0,0 +1,426 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright(c) 2021-2022 John Sanpe <sanpeqf@gmail.com>
+ */
+
+#include "fxprog.h"
+
+void fximage_init(struct fximage *image)
+{
+    memset(image, 0, sizeof(*image));
+}
+
+void fximage_release(struct fximage *image)
+{
+    while (!image->borrowed && image->count--)
+        free(image->segs[image->count].data);
+
+    free(image->segs);
+    fximage_init(image);
+}
+
+static inline uint32_t seg_end(const struct fximage_seg *seg)
+{
+    return (uint32_t)seg->address + seg->length;
+}
+
+/* index of the first segment ending after @address */
+static unsigned int fximage_search(const struct fximage *image, uint32_t address)
+{
+    unsigned int low = 0, high = image->count, mid;
+
+    while (low < high) {
+        mid = (low + high) / 2;
+        if (seg_end(&image->segs[mid]) <= address)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+static int seg_extend(struct fximage_seg *seg, const void *data, size_t length, bool front)
+{
+    uint8_t *buffer;
+
+    buffer = realloc(seg->data, seg->length + length);
+    if (!buffer)
+        return -ENOMEM;
+
+    if (front) {
+        memmove(buffer + length, buffer, seg->length);
+        memcpy(buffer, data, length);
+        seg->address -= length;
+    } else
+        memcpy(buffer + seg->length, data, length);
+
+    seg->data = buffer;
+    seg->length += length;
+    return 0;
+}
+
+static int fximage_merge(struct fximage *image, unsigned int index)
+{
+    struct fximage_seg *prev = &image->segs[index - 1];
+    struct fximage_seg *next = &image->segs[index];
+    int retval;
+
+    if ((retval = seg_extend(prev, next->data, next->length, false)))
+        return retval;
+
+    free(next->data);
+    memmove(next, next + 1, sizeof(*next) * (image->count - index - 1));
+    image->count--;
+    return 0;
+}
+
+int fximage_insert(struct fximage *image, uint16_t address, const void *data, size_t length)
+{
+    struct fximage_seg *seg, *segs;
+    uint32_t end = (uint32_t)address + length;
+    unsigned int index;
+    int retval;
+
+    if (!length)
+        return 0;
+
+    if (image->borrowed)
+        return -EPERM;
+
+    if (end > 0x10000) {
+        fprintf(stderr, "Image data beyond 64KB at 0x%04x\n", address);
+        return -EFAULT;
+    }
+
+    /* records usually arrive in order, try the tail first */
+    if (image->count && seg_end(&image->segs[image->count - 1]) <= address)
+        index = image->count;
+    else
+        index = fximage_search(image, address);
+
+    if (index < image->count && image->segs[index].address < end) {
+        fprintf(stderr, "Image data overlaps at 0x%04x\n",
+                max(address, image->segs[index].address));
+        return -EEXIST;
+    }
+
+    image->bytes += length;
+
+    if (index && seg_end(&image->segs[index - 1]) == address) {
+        seg = &image->segs[index - 1];
+        if ((retval = seg_extend(seg, data, length, false)))
+            return retval;
+        if (index < image->count && image->segs[index].address == end)
+            return fximage_merge(image, index);
+        return 0;
+    }
+
+    if (index < image->count && image->segs[index].address == end)
+        return seg_extend(&image->segs[index], data, length, true);
+
+    if (image->count == image->size) {
+        segs = realloc(image->segs, sizeof(*segs) * max(image->size * 2, 16U));
+        if (!segs)
+            return -ENOMEM;
+        image->segs = segs;
+        image->size = max(image->size * 2, 16U);
+    }
+
+    seg = &image->segs[index];
+    memmove(seg + 1, seg, sizeof(*seg) * (image->count - index));
+    image->count++;
+
+    seg->address = address;
+    seg->length = 0;
+    seg->data = NULL;
+    return seg_extend(seg, data, length, false);
+}
+
+int fximage_append(uint16_t address, const void *data, size_t length, void *pdata)
+{
+    struct fximage *image = pdata;
+
+    image->records++;
+    return fximage_insert(image, address, data, length);
+}
+
+int fximage_load_ihex(struct fximage *image, const void *data)
+{
+    int retval;
+
+    fximage_init(image);
+
+    retval = ihex_parse(data, fximage_append, image);
+    if (retval)
+        fximage_release(image);
+
+    return retval;
+}
+
+/*
+ * A raw image is one contiguous run, the segment refers to @data in
+ * place so a mapped file goes to the transfers without a copy. @data
+ * must stay valid as long as the image.
+ */
+int fximage_load_binary(struct fximage *image, uint16_t address, const void *data, size_t length)
+{
+    fximage_init(image);
+
+    if ((uint32_t)address + length > 0x10000) {
+        fprintf(stderr, "Image data beyond 64KB at 0x%04x\n", address);
+        return -EFAULT;
+    }
+
+    if (!length)
+        return 0;
+
+    image->segs = malloc(sizeof(*image->segs));
+    if (!image->segs)
+        return -ENOMEM;
+
+    image->segs->address = address;
+    image->segs->length = length;
+    image->segs->data = (uint8_t *)data;
+    image->count = image->size = 1;
+    image->records = 1;
+    image->bytes = length;
+    image->borrowed = true;
+    return 0;
+}
+
+/* copy borrowed segment data, the image stops depending on the caller's memory */
+int fximage_own(struct fximage *image)
+{
+    unsigned int index;
+    uint8_t **copies;
+
+    if (!image->borrowed)
+        return 0;
+
+    /* all or nothing, a failed copy leaves the image borrowed */
+    if (!(copies = calloc(image->count, sizeof(*copies))))
+        return -ENOMEM;
+
+    for (index = 0; index < image->count; ++index) {
+        if (!(copies[index] = malloc(image->segs[index].length))) {
+            while (index--)
+                free(copies[index]);
+            free(copies);
+            return -ENOMEM;
+        }
+    }
+
+    for (index = 0; index < image->count; ++index) {
+        memcpy(copies[index], image->segs[index].data, image->segs[index].length);
+        image->segs[index].data = copies[index];
+    }
+
+    free(copies);
+    image->borrowed = false;
+    return 0;
+}
+
+const struct fximage_seg *fximage_lookup(const struct fximage *image, uint16_t address)
+{
+    unsigned int index;
+
+    index = fximage_search(image, address);
+    if (index < image->count && image->segs[index].address <= address)
+        return &image->segs[index];
+
+    return NULL;
+}
+
+bool fximage_overlaps(const struct fximage *image, uint16_t address, size_t length)
+{
+    unsigned int index;
+
+    index = fximage_search(image, address);
+    return index < image->count && image->segs[index].address < (uint32_t)address + length;
+}
+
+uint32_t fximage_end(const struct fximage *image)
+{
+    if (!image->count)
+        return 0;
+
+    return seg_end(&image->segs[image->count - 1]);
+}
+
+int fximage_range(const struct fximage *image, uint32_t start, uint32_t end,
+                  fx_write_t fn, void *pdata)
+{
+    const struct fximage_seg *seg;
+    uint32_t from, to;
+    unsigned int index;
+    int retval;
+
+    for (index = fximage_search(image, start); index < image->count; ++index) {
+        seg = &image->segs[index];
+        if (seg->address >= end)
+            break;
+
+        from = max(start, (uint32_t)seg->address);
+        to = min(end, seg_end(seg));
+
+        retval = fn(from, seg->data + (from - seg->address), to - from, pdata);
+        if (retval)
+            return retval;
+    }
+
+    return 0;
+}
+
+/*
+ * A record costs its 4 byte header in eeprom and a setup pass in the boot
+ * rom, padding a gap up to that size is never worse than starting over.
+ */
+#define C2_GAP_FILL     4
+
+/**
+ * struct c2_build - C2 record packer
+ * @c2: eeprom image being built
+ * @address: eeprom address of the next record
+ * @base: load address of the pending record
+ * @fill: payload bytes in the pending record
+ * @record: pending record, header and payload
+ */
+struct c2_build {
+    struct fximage *c2;
+    uint32_t address;
+    uint16_t base;
+    size_t fill;
+    uint8_t record[FX_FIRMWARE_RECORD + 4];
+};
+
+static int c2_emit(struct c2_build *build, size_t length)
+{
+    int retval;
+
+    if (build->address + length > 0x10000) {
+        fprintf(stderr, "C2 image exceeds 64KB\n");
+        return -EFBIG;
+    }
+
+    if ((retval = fximage_insert(build->c2, build->address, build->record, length)))
+        return retval;
+
+    build->address += length;
+    build->c2->records++;
+    return 0;
+}
+
+static int c2_flush(struct c2_build *build)
+{
+    int retval;
+
+    if (!build->fill)
+        return 0;
+
+    build->record[FX_FIRMWARE_LENH] = build->fill >> 8;
+    build->record[FX_FIRMWARE_LENL] = build->fill;
+    build->record[FX_FIRMWARE_ADDRH] = build->base >> 8;
+    build->record[FX_FIRMWARE_ADDRL] = build->base;
+
+    retval = c2_emit(build, build->fill + 4);
+    build->fill = 0;
+    return retval;
+}
+
+/* append to the pending record, NULL @data pads with zeros */
+static int c2_push(struct c2_build *build, uint16_t address, const uint8_t *data, size_t length)
+{
+    size_t xfer;
+    int retval;
+
+    while (length) {
+        if (build->fill == FX_FIRMWARE_RECORD && (retval = c2_flush(build)))
+            return retval;
+
+        if (!build->fill)
+            build->base = address;
+
+        xfer = min(length, FX_FIRMWARE_RECORD - build->fill);
+        if (data) {
+            memcpy(build->record + 4 + build->fill, data, xfer);
+            data += xfer;
+        } else
+            memset(build->record + 4 + build->fill, 0, xfer);
+
+        build->fill += xfer;
+        address += xfer;
+        length -= xfer;
+    }
+
+    return 0;
+}
+
+/*
+ * Segments closer than a record header share one record, the gap is
+ * loaded as zeros, which fewer records load faster from eeprom. Only
+ * gaps in plain internal RAM, as @is_external tells it, are filled:
+ * zeros in register or endpoint space are writes the image never asked for.
+ * The boot ROM loads internal RAM only, an image reaching beyond it is
+ * refused rather than burnt incomplete.
+ */
+int fximage_build_c2(struct fximage *c2, const struct fximage *image, uint16_t cpucs,
+                     is_external_t is_external)
+{
+    struct c2_build build = {
+        .c2 = c2,
+        .address = FX_EEPROM_HEADER,
+    };
+    const struct fximage_seg *seg;
+    uint32_t next = 0;
+    unsigned int index;
+    int retval;
+
+    fximage_init(c2);
+
+    for (index = 0; index < image->count; ++index) {
+        seg = &image->segs[index];
+
+        if ((retval = is_external(seg->address, seg->length))) {
+            if (retval > 0) {
+                fprintf(
+                    stderr, "C2 boot loads internal RAM only, 0x%04x-0x%04x is not\n",
+                    seg->address, seg_end(seg) - 1
+                );
+                retval = -EFAULT;
+            }
+            goto failed;
+        }
+
+        if (build.fill && build.fill < FX_FIRMWARE_RECORD &&
+            seg->address - next <= C2_GAP_FILL &&
+            !is_external(next, seg->address - next))
+            retval = c2_push(&build, next, NULL, seg->address - next);
+        else
+            retval = c2_flush(&build);
+
+        if (retval || (retval = c2_push(&build, seg->address, seg->data, seg->length)))
+            goto failed;
+
+        next = seg_end(seg);
+    }
+
+    if ((retval = c2_flush(&build)))
+        goto failed;
+
+    /* last record releases the CPU out of reset */
+    build.record[FX_FIRMWARE_LENH] = FX_FIRMWARE_LAST;
+    build.record[FX_FIRMWARE_LENL] = 0x01;
+    build.record[FX_FIRMWARE_ADDRH] = cpucs >> 8;
+    build.record[FX_FIRMWARE_ADDRL] = cpucs;
+    build.record[4] = 0x00;
+
+    if ((retval = c2_emit(&build, 5)))
+        goto failed;
+
+    return 0;
+
+failed:
+    fximage_release(c2);
+    return retval;
+}
@@ -0,0 +1,671 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright(c) 2021-2022 John Sanpe <sanpeqf@gmail.com>
+ */
+
+#include "fxjob.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+const struct fx_opdesc fx_opdescs[] = {
+    [FX_OP_MEMORY] = {
+        "memory", FX_ARG_FILE, 0,
+        "Failed to load memory with data",
+    },
+    [FX_OP_INFO] = {
+        "info", FX_ARG_NONE, 0,
+        "Failed to read the eeprom info",
+    },
+    [FX_OP_ERASE] = {
+        "erase", FX_ARG_NONE, 0,
+        "Failed to erase the entire eeprom",
+    },
+    [FX_OP_FLASH] = {
+        "flash", FX_ARG_FILE, 0,
+        "Failed to write eeprom with data",
+    },
+    [FX_OP_MODE] = {
+        "bootmode", FX_ARG_VALUE, FXDEV_HEADER_MODE,
+        "Failed to write bootmode",
+    },
+    [FX_OP_VENDOR] = {
+        "vendor", FX_ARG_VALUE, FXDEV_HEADER_VENDOR,
+        "Failed to get write vendor",
+    },
+    [FX_OP_PRODUCT] = {
+        "product", FX_ARG_VALUE, FXDEV_HEADER_PRODUCT,
+        "Failed to get write product",
+    },
+    [FX_OP_DEVICE] = {
+        "device", FX_ARG_VALUE, FXDEV_HEADER_DEVICE,
+        "Failed to get write device",
+    },
+    [FX_OP_CONFIG] = {
+        "config", FX_ARG_VALUE, FXDEV_HEADER_CONFIG,
+        "Failed to get write config",
+    },
+    [FX_OP_FIRMWARE] = {
+        "firmware", FX_ARG_FILE, 0,
+        "Failed to write firmware",
+    },
+    [FX_OP_VERIFY_FLASH] = {
+        "verify-flash", FX_ARG_FILE, 0,
+        "Failed to verify eeprom",
+    },
+    [FX_OP_VERIFY_MEMORY] = {
+        "verify-memory", FX_ARG_FILE, 0,
+        "Failed to verify memory",
+    },
+    [FX_OP_RESET] = {
+        "reset", FX_ARG_NONE, 0,
+        "Failed to reset chip",
+    },
+};
+
+
+static inline bool file_is_hex(const char *file)
+{
+    return strstr(file, ".hex") || strstr(file, ".ihx");
+}
+
+static void fx_file_unload(struct fx_file *file)
+{
+    fximage_release(&file->image);
+    if (file->map)
+        munmap(file->map, file->mapsize);
+    file->map = NULL;
+    file->loaded = false;
+}
+
+int fx_file_load(struct fx_file *file)
+{
+    struct stat stat;
+    void *data;
+    int fd, retval;
+
+    if (file->loaded || file->stream)
+        return 0;
+
+    if ((fd = open(file->name, O_RDONLY)) < 0) {
+        retval = -errno;
+        fprintf(stderr, "Cannot open file: %s: %s\n", file->name, strerror(errno));
+        return retval;
+    }
+
+    if (fstat(fd, &stat) < 0) {
+        retval = -errno;
+        fprintf(stderr, "file fstat err: %s\n", strerror(errno));
+        close(fd);
+        return retval;
+    }
+
+    data = mmap(NULL, stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        retval = -errno;
+        fprintf(stderr, "file mmap err: %s\n", strerror(errno));
+        close(fd);
+        return retval;
+    }
+
+    close(fd);
+
+    /* parse once, every operation and device shares the same image */
+    if (file_is_hex(file->name)) {
+        retval = fximage_load_ihex(&file->image, data);
+        munmap(data, stat.st_size);
+    } else {
+        /* raw data is sent straight from the mapping, keep it */
+        retval = fximage_load_binary(&file->image, file->offset, data, stat.st_size);
+        file->map = data;
+        file->mapsize = stat.st_size;
+    }
+
+    if (retval) {
+        fprintf(stderr, "Cannot parse file: %s\n", file->name);
+        fx_file_unload(file);
+        return retval;
+    }
+
+    file->mtime = stat.st_mtim;
+    file->loaded = true;
+    return 0;
+}
+
+/* an entry still good for @name at @offset, one changed on disk is marked stale */
+static bool fx_file_current(struct fx_file *file, const char *name, uint16_t offset,
+                            const struct stat *stat)
+{
+    if (file->stale || file->offset != offset || strcmp(file->name, name))
+        return false;
+
+    if (file->loaded && stat && (stat->st_mtim.tv_sec != file->mtime.tv_sec ||
+                                 stat->st_mtim.tv_nsec != file->mtime.tv_nsec)) {
+        file->stale = true;
+        return false;
+    }
+
+    return true;
+}
+
+struct fx_file *fx_job_file(struct fx_job *job, const char *name)
+{
+    struct fx_file *file;
+    struct stat stat;
+    bool known;
+
+    known = !lstat(name, &stat);
+
+    /* every operation naming the same file shares one parsed image */
+    for (file = job->files; file; file = file->next) {
+        if (fx_file_current(file, name, job->offset, known ? &stat : NULL))
+            return file;
+    }
+
+    file = calloc(1, sizeof(*file));
+    if (!file)
+        return NULL;
+
+    if (!(file->name = strdup(name))) {
+        free(file);
+        return NULL;
+    }
+
+    fximage_init(&file->image);
+    file->offset = job->offset;
+    file->stream = !strcmp(name, "-");
+    file->next = job->files;
+    job->files = file;
+    return file;
+}
+
+int fx_job_add(struct fx_job *job, enum fx_op_type type, const char *arg)
+{
+    struct fx_op *ops;
+
+    if (job->count == job->size) {
+        ops = realloc(job->ops, (job->size + 16) * sizeof(*ops));
+        if (!ops)
+            return -ENOMEM;
+        job->ops = ops;
+        job->size += 16;
+    }
+
+    ops = &job->ops[job->count];
+    memset(ops, 0, sizeof(*ops));
+    ops->type = type;
+
+    if (fx_opdescs[type].arg == FX_ARG_FILE) {
+        if (!(ops->file = fx_job_file(job, arg)))
+            return -ENOMEM;
+        /* only a memory load can start before the whole image is known */
+        if (ops->file->stream && type != FX_OP_MEMORY)
+            return -EINVAL;
+    } else if (fx_opdescs[type].arg == FX_ARG_VALUE) {
+        ops->value = strtoul(arg, NULL, 0);
+    }
+
+    job->count++;
+    return 0;
+}
+
+int fx_job_load(struct fx_job *job)
+{
+    unsigned int index;
+    int retval;
+
+    /* the file list may be shared, only parse what this job uses */
+    for (index = 0; index < job->count; ++index) {
+        if (!job->ops[index].file)
+            continue;
+        if ((retval = fx_file_load(job->ops[index].file)))
+            return retval;
+    }
+
+    return 0;
+}
+
+/*
+ * A cached image outlives the job that loaded it, and the file may be
+ * truncated or rewritten under a mapping meanwhile. Copy raw images out
+ * and drop the mapping, a change on disk then only shows as a new mtime.
+ */
+int fx_job_own(struct fx_job *job)
+{
+    struct fx_file *file;
+    int retval;
+
+    for (file = job->files; file; file = file->next) {
+        if (!file->loaded || !file->map)
+            continue;
+        if ((retval = fximage_own(&file->image)))
+            return retval;
+
+        munmap(file->map, file->mapsize);
+        file->map = NULL;
+    }
+
+    return 0;
+}
+
+/*
+ * One operation per line, named like the long options, '#' starts a
+ * comment: "memory app.hex", "vendor 0x04b4", "verify-flash data.hex".
+ * "offset 0x1000" places the raw binary files named after it.
+ */
+int fx_job_parse(struct fx_job *job, FILE *stream, const char *name, FILE *log)
+{
+    char *line = NULL, *cmd, *arg, *save;
+    const struct fx_opdesc *desc;
+    unsigned int number = 0;
+    size_t size = 0;
+    int type, retval = 0;
+
+    while (!retval && getline(&line, &size, stream) >= 0) {
+        number++;
+        line[strcspn(line, "#")] = '\0';
+
+        if (!(cmd = strtok_r(line, " \t\r\n", &save)))
+            continue;
+        arg = strtok_r(NULL, " \t\r\n", &save);
+
+        if (!strcmp(cmd, "offset")) {
+            if (!arg || strtok_r(NULL, " \t\r\n", &save)) {
+                fprintf(log, "%s:%u: 'offset' takes one argument\n", name, number);
+                retval = -EINVAL;
+                break;
+            }
+            job->offset = strtoul(arg, NULL, 0);
+            continue;
+        }
+
+        for (type = 0; type < ARRAY_SIZE(fx_opdescs); ++type) {
+            if (!strcmp(fx_opdescs[type].name, cmd))
+                break;
+        }
+
+        if (type == ARRAY_SIZE(fx_opdescs)) {
+            fprintf(log, "%s:%u: unknown operation '%s'\n", name, number, cmd);
+            retval = -EINVAL;
+            break;
+        }
+
+        desc = &fx_opdescs[type];
+        if (!arg != (desc->arg == FX_ARG_NONE) || strtok_r(NULL, " \t\r\n", &save)) {
+            fprintf(log, "%s:%u: '%s' takes %s argument\n", name, number, cmd,
+                    desc->arg == FX_ARG_NONE ? "no" : "one");
+            retval = -EINVAL;
+            break;
+        }
+
+        if ((retval = fx_job_add(job, type, arg)))
+            fprintf(log, "%s:%u: cannot add '%s': %s\n", name, number, cmd, strerror(-retval));
+    }
+
+    free(line);
+    return retval;
+}
+
+bool fx_job_streams(const struct fx_job *job)
+{
+    unsigned int index;
+
+    for (index = 0; index < job->count; ++index) {
+        if (job->ops[index].file && job->ops[index].file->stream)
+            return true;
+    }
+
+    return false;
+}
+
+/* stable, repeated operations of one type keep their command line order */
+void fx_job_sort(struct fx_job *job)
+{
+    unsigned int index, walk;
+    struct fx_op op;
+
+    for (index = 1; index < job->count; ++index) {
+        op = job->ops[index];
+        for (walk = index; walk && job->ops[walk - 1].type > op.type; --walk)
+            job->ops[walk] = job->ops[walk - 1];
+        job->ops[walk] = op;
+    }
+}
+
+void fx_job_release(struct fx_job *job, bool files)
+{
+    struct fx_file *file, *next;
+
+    free(job->ops);
+    job->ops = NULL;
+    job->count = job->size = 0;
+
+    if (!files)
+        return;
+
+    for (file = job->files; file; file = next) {
+        next = file->next;
+        fx_file_unload(file);
+        free(file->name);
+        free(file);
+    }
+
+    job->files = NULL;
+}
+
+/*
+ * Trade @job's own files for the loaded entries @cache already has, and
+ * hand the ones @job loaded itself over to @cache. What neither applies
+ * to stays with @job. Holds taken on a file follow its operations.
+ */
+void fx_job_share(struct fx_job *job, struct fx_job *cache)
+{
+    struct fx_file **link, *file, *shared;
+    struct stat stat;
+    unsigned int index;
+    bool known;
+
+    for (link = &job->files; (file = *link);) {
+        known = !lstat(file->name, &stat);
+        for (shared = cache->files; shared; shared = shared->next) {
+            if (shared->loaded && fx_file_current(shared, file->name, file->offset,
+                                                  known ? &stat : NULL))
+                break;
+        }
+
+        if (shared) {
+            for (index = 0; index < job->count; ++index) {
+                if (job->ops[index].file == file)
+                    job->ops[index].file = shared;
+            }
+            shared->users += file->users;
+            *link = file->next;
+            fx_file_unload(file);
+            free(file->name);
+            free(file);
+        } else if (file->loaded) {
+            *link = file->next;
+            file->next = cache->files;
+            cache->files = file;
+        } else {
+            link = &file->next;
+        }
+    }
+}
+
+/* pin the files a queued job refers to, fx_job_prune() leaves them alone */
+void fx_job_hold(struct fx_job *job, bool hold)
+{
+    unsigned int index;
+
+    for (index = 0; index < job->count; ++index) {
+        if (job->ops[index].file)
+            job->ops[index].file->users += hold ? 1 : -1;
+    }
+}
+
+static bool fx_job_uses(const struct fx_job *job, const struct fx_file *file)
+{
+    unsigned int index;
+
+    for (index = 0; index < job->count; ++index) {
+        if (job->ops[index].file == file)
+            return true;
+    }
+
+    return false;
+}
+
+/* free superseded files once no job, the cache's own included, refers to them */
+void fx_job_prune(struct fx_job *cache)
+{
+    struct fx_file **link, *file;
+
+    for (link = &cache->files; (file = *link);) {
+        if (!file->stale || file->users || fx_job_uses(cache, file)) {
+            link = &file->next;
+            continue;
+        }
+
+        *link = file->next;
+        fx_file_unload(file);
+        free(file->name);
+        free(file);
+    }
+}
+
+static inline int fx_fail(const char **errmsg, const char *msg, int retval)
+{
+    *errmsg = msg;
+    return retval;
+}
+
+void fx_timing_init(struct fx_timing *timing)
+{
+    timing->count = 0;
+    timing->start = timing->last = fx_clock();
+}
+
+void fx_timing_stage(struct fx_timing *timing, const char *name)
+{
+    double now = fx_clock();
+
+    if (!timing || timing->count == ARRAY_SIZE(timing->stages))
+        return;
+
+    timing->stages[timing->count].name = name;
+    timing->stages[timing->count].seconds = now - timing->last;
+    timing->count++;
+    timing->last = now;
+}
+
+void fx_timing_report(struct fx_timing *timing)
+{
+    unsigned int count;
+
+    printf("Timing:\n");
+    for (count = 0; count < timing->count; ++count)
+        printf("  %-16s %7.3fs\n", timing->stages[count].name, timing->stages[count].seconds);
+    printf("  %-16s %7.3fs\n", "total", timing->last - timing->start);
+}
+
+void fx_usb_path(libusb_device *usbdev, char *buff, size_t size)
+{
+    uint8_t ports[FX_USB_PORT_DEPTH];
+    int count, index, len;
+
+    len = snprintf(buff, size, "%u", libusb_get_bus_number(usbdev));
+    count = libusb_get_port_numbers(usbdev, ports, sizeof(ports));
+
+    for (index = 0; index < count && len < size; ++index)
+        len += snprintf(buff + len, size - len, "%c%u", index ? '.' : '-', ports[index]);
+}
+
+static void fx_header_set(struct fxdev_header *header, const struct fx_op *op)
+{
+    switch (op->type) {
+        case FX_OP_MODE:
+            header->mode = op->value;
+            break;
+
+        case FX_OP_VENDOR:
+            header->vendor = op->value;
+            break;
+
+        case FX_OP_PRODUCT:
+            header->product = op->value;
+            break;
+
+        case FX_OP_DEVICE:
+            header->device = op->value;
+            break;
+
+        case FX_OP_CONFIG: default:
+            header->config = op->value;
+            break;
+    }
+}
+
+int fx_run(struct fxdev *fdev, const struct fx_job *job, const char **errmsg,
+           struct fx_timing *timing)
+{
+    const struct fx_opdesc *desc;
+    struct fxdev_header header;
+    const struct fx_op *op;
+    unsigned int index, fields;
+    int retval;
+
+    /* sized before anything is moved with it */
+    if (fdev->probe) {
+        if ((retval = fxdev_probe(fdev)))
+            return fx_fail(errmsg, "Failed to probe transfer size", retval);
+        fx_timing_stage(timing, "probe");
+    }
+
+    for (index = 0; index < job->count; ++index) {
+        op = &job->ops[index];
+        desc = &fx_opdescs[op->type];
+
+        /* adjacent header fields go out as a single eeprom write */
+        if (desc->field) {
+            for (fields = 0; index < job->count; ++index) {
+                op = &job->ops[index];
+                desc = &fx_opdescs[op->type];
+                if (!desc->field || (fields & desc->field))
+                    break;
+
+                fields |= desc->field;
+                fx_header_set(&header, op);
+            }
+
+            index--;
+            if ((retval = fxdev_eeprom_header(fdev, &header, fields)))
+                return fx_fail(errmsg, "Failed to write eeprom header", retval);
+            fx_timing_stage(timing, "header");
+            continue;
+        }
+
+        switch (op->type) {
+            case FX_OP_INFO:
+                retval = fxdev_eeprom_info(fdev);
+                break;
+
+            case FX_OP_ERASE:
+                retval = fxdev_eeprom_erase(fdev);
+                break;
+
+            case FX_OP_FLASH:
+                retval = fxdev_eeprom_write(fdev, &op->file->image);
+                break;
+
+            case FX_OP_FIRMWARE:
+                retval = fxdev_eeprom_firmware(fdev, &op->file->image);
+                break;
+
+            case FX_OP_MEMORY:
+                if (op->file->stream)
+                    retval = fxdev_ram_stream(fdev, STDIN_FILENO);
+                else
+                    retval = fxdev_ram_write(fdev, &op->file->image);
+                break;
+
+            case FX_OP_VERIFY_FLASH:
+                retval = fxdev_eeprom_verify(fdev, &op->file->image);
+                break;
+
+            case FX_OP_VERIFY_MEMORY:
+                retval = fxdev_ram_verify(fdev, &op->file->image);
+                break;
+
+            case FX_OP_RESET: default:
+                retval = fxdev_reset(fdev);
+                break;
+        }
+
+        if (retval)
+            return fx_fail(errmsg, desc->errmsg, retval);
+        fx_timing_stage(timing, desc->name);
+    }
+
+    return 0;
+}
+
+/*
+ * Every firmware file goes into one boot image, header fields default to
+ * a C2 load with the stock vendor and product ids.
+ */
+int fx_compile(struct fxdev *fdev, const struct fx_job *job, const char *name)
+{
+    struct fxdev_header header = {
+        .mode = FX_EEPROM_BOOT_C2,
+        .vendor = FX_USB_VENDOR,
+        .product = FX_USB_PRODUCT,
+    };
+    const struct fximage_seg *seg;
+    const struct fx_op *op;
+    struct fximage image;
+    unsigned int index, count;
+    FILE *stream;
+    int retval = 0;
+
+    fximage_init(&image);
+
+    for (index = 0; index < job->count; ++index) {
+        op = &job->ops[index];
+
+        if (fx_opdescs[op->type].field) {
+            fx_header_set(&header, op);
+            continue;
+        }
+
+        if (op->type != FX_OP_FIRMWARE) {
+            fprintf(stderr, "Cannot compile '%s', only firmware and header fields\n",
+                    fx_opdescs[op->type].name);
+            retval = -EINVAL;
+            goto finish;
+        }
+
+        /* a shared address in two inputs is an error, not an override */
+        for (count = 0; count < op->file->image.count; ++count) {
+            seg = &op->file->image.segs[count];
+            if ((retval = fximage_insert(&image, seg->address, seg->data, seg->length))) {
+                fprintf(stderr, "Cannot merge file: %s\n", op->file->name);
+                goto finish;
+            }
+        }
+    }
+
+    if (!image.count) {
+        fprintf(stderr, "Nothing to compile\n");
+        retval = -EINVAL;
+        goto finish;
+    }
+
+    printf("Compile boot image %s...\n", name);
+    printf("  Boot mode: 0x%02x, vendor: 0x%04x, product: 0x%04x, device: 0x%04x, config: 0x%02x\n",
+           header.mode, header.vendor, header.product, header.device, header.config);
+
+    if (!(stream = fopen(name, "wb"))) {
+        retval = -errno;
+        fprintf(stderr, "Cannot open output: %s: %s\n", name, strerror(errno));
+        goto finish;
+    }
+
+    retval = fxdev_compile(fdev, &image, &header, stream);
+    if (fclose(stream) && !retval)
+        retval = -errno;
+
+    /* never leave a truncated image behind for a programmer to pick up */
+    if (retval) {
+        fprintf(stderr, "Cannot write output: %s\n", name);
+        unlink(name);
+        goto finish;
+    }
+
+    printf("  Done!\n");
+
+finish:
+    fximage_release(&image);
+    return retval;
+}
@@ -0,0 +1,194 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright(c) 2021-2022 John Sanpe <sanpeqf@gmail.com>
+ */
+
+#include "fxprog.h"
+#include <ctype.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* segment number and its complement, a torn record fails the check */
+#define FXJOURNAL_RECORD    4
+
+static uint32_t fxjournal_hash(const struct fximage *image)
+{
+    const struct fximage_seg *seg;
+    uint8_t head[6];
+    uint32_t crc = 0;
+    unsigned int index;
+
+    for (index = 0; index < image->count; ++index) {
+        seg = &image->segs[index];
+        put_unaligned_le16(seg->address, head);
+        put_unaligned_le32(seg->length, head + 2);
+        crc = crc32c(crc, head, sizeof(head));
+        crc = crc32c(crc, seg->data, seg->length);
+    }
+
+    return crc;
+}
+
+/* a serial number follows the board, the port path only the fixture */
+static void fxjournal_identity(struct fxdev *fdev, char *buf, size_t size)
+{
+    struct libusb_device_descriptor desc;
+    unsigned char serial[64];
+    size_t len;
+    int count, index;
+
+    if (fdev->handle &&
+        !libusb_get_device_descriptor(libusb_get_device(fdev->handle), &desc) &&
+        desc.iSerialNumber &&
+        (count = libusb_get_string_descriptor_ascii(
+            fdev->handle, desc.iSerialNumber, serial, sizeof(serial))) > 0) {
+        snprintf(buf, size, "%04x-%04x-%.*s", fdev->vendor, fdev->product, count, serial);
+    } else if (fdev->depth) {
+        len = snprintf(buf, size, "bus%u-", fdev->bus);
+        for (index = 0; index < fdev->depth && len < size; ++index)
+            len += snprintf(buf + len, size - len, index ? ".%u" : "%u", fdev->ports[index]);
+    } else {
+        snprintf(buf, size, "%s", fdev->transport->name);
+    }
+
+    /* keep it a plain file name whatever the serial holds */
+    for (; *buf; ++buf) {
+        if (!isalnum((unsigned char)*buf) && !strchr("-._", *buf))
+            *buf = '_';
+    }
+}
+
+/* the per-user cache directory, created on first use */
+int fx_cache_dir(char *buf, size_t size)
+{
+    const char *base;
+    char *walk;
+
+    if ((base = getenv("XDG_CACHE_HOME")) && *base)
+        snprintf(buf, size, "%s/fxprog", base);
+    else if ((base = getenv("HOME")) && *base)
+        snprintf(buf, size, "%s/.cache/fxprog", base);
+    else
+        return -ENOENT;
+
+    /* the cache directory itself may not exist yet either */
+    for (walk = strchr(buf + 1, '/'); ; walk = strchr(walk + 1, '/')) {
+        if (walk)
+            *walk = '\0';
+        if (mkdir(buf, 0755) && errno != EEXIST)
+            return -errno;
+        if (!walk)
+            return 0;
+        *walk = '/';
+    }
+}
+
+/*
+ * Pick up what an earlier run against the same board and the same image
+ * committed. A journal written for anything else starts over empty.
+ */
+int fxjournal_open(struct fxjournal *journal, struct fxdev *fdev, const struct fximage *image)
+{
+    struct fxjournal_header header, expect = {
+        .magic = FXJOURNAL_MAGIC,
+        .version = FXJOURNAL_VERSION,
+    };
+    uint8_t record[FXJOURNAL_RECORD];
+    char name[96];
+    uint16_t segment;
+    uint32_t hash;
+    size_t len;
+    long good;
+    int retval;
+
+    memset(journal, 0, sizeof(*journal));
+    hash = fxjournal_hash(image);
+    put_unaligned_le16(FX_JOURNAL_SEGMENT, &expect.segment);
+    put_unaligned_le32(hash, &expect.hash);
+
+    if ((retval = fx_cache_dir(journal->path, sizeof(journal->path)))) {
+        fprintf(stderr, "Cannot create journal directory: %s\n", strerror(-retval));
+        return retval;
+    }
+
+    fxjournal_identity(fdev, name, sizeof(name));
+    len = strlen(journal->path);
+    if (snprintf(journal->path + len, sizeof(journal->path) - len, "/%s-%08x.journal",
+                 name, hash) >= sizeof(journal->path) - len) {
+        fprintf(stderr, "Journal path too long: %s\n", journal->path);
+        return -ENAMETOOLONG;
+    }
+
+    journal->file = fopen(journal->path, "r+b");
+    if (journal->file && fread(&header, sizeof(header), 1, journal->file) == 1 &&
+        !memcmp(&header, &expect, sizeof(header))) {
+        good = sizeof(header);
+
+        while (fread(record, sizeof(record), 1, journal->file) == 1) {
+            segment = get_unaligned_le16(record);
+            if ((segment ^ get_unaligned_le16(record + 2)) != 0xffff ||
+                segment >= ARRAY_SIZE(journal->committed))
+                break;
+            journal->count += !journal->committed[segment];
+            journal->committed[segment] = true;
+            good += sizeof(record);
+        }
+
+        /* drop whatever the failure tore, appends go after the last good record */
+        if (!ftruncate(fileno(journal->file), good) && !fseek(journal->file, good, SEEK_SET))
+            return 0;
+
+        memset(journal->committed, 0, sizeof(journal->committed));
+        journal->count = 0;
+    }
+
+    if (journal->file)
+        fclose(journal->file);
+
+    if (!(journal->file = fopen(journal->path, "wb"))) {
+        fprintf(stderr, "Cannot open journal: %s: %s\n", journal->path, strerror(errno));
+        return -errno;
+    }
+
+    if (fwrite(&expect, sizeof(expect), 1, journal->file) != 1 || fflush(journal->file)) {
+        fprintf(stderr, "Cannot write journal: %s: %s\n", journal->path, strerror(errno));
+        fclose(journal->file);
+        journal->file = NULL;
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/* on disk before the next segment is touched, a lost record only costs a rewrite */
+int fxjournal_commit(struct fxjournal *journal, unsigned int segment)
+{
+    uint8_t record[FXJOURNAL_RECORD];
+
+    put_unaligned_le16(segment, record);
+    put_unaligned_le16(segment ^ 0xffff, record + 2);
+
+    if (fwrite(record, sizeof(record), 1, journal->file) != 1 ||
+        fflush(journal->file) || fsync(fileno(journal->file))) {
+        fprintf(stderr, "Cannot write journal: %s: %s\n", journal->path, strerror(errno));
+        return -EIO;
+    }
+
+    journal->count += !journal->committed[segment];
+    journal->committed[segment] = true;
+    return 0;
+}
+
+/* a finished image leaves nothing to resume */
+void fxjournal_close(struct fxjournal *journal, bool complete)
+{
+    if (!journal->file)
+        return;
+
+    fclose(journal->file);
+    journal->file = NULL;
+
+    if (complete)
+        unlink(journal->path);
+}
@@ -0,0 +1,184 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright(c) 2021-2022 John Sanpe <sanpeqf@gmail.com>
+ */
+
+#include "fxprog.h"
+#include <unistd.h>
+
+static const char *const ezusb_loader_errors[] = {
+    [FX_LOADER_OK] = "ok",
+    [FX_LOADER_ECRC] = "payload crc mismatch",
+    [FX_LOADER_EFRAME] = "malformed frame",
+    [FX_LOADER_ERANGE] = "address out of range",
+    [FX_LOADER_EEEPROM] = "eeprom not acknowledging",
+};
+
+static const char *ezusb_loader_error(uint8_t status)
+{
+    if (status < ARRAY_SIZE(ezusb_loader_errors))
+        return ezusb_loader_errors[status];
+
+    return "unknown error";
+}
+
+static int ezusb_loader_status(struct fxdev *fdev, uint8_t opcode, uint8_t *data, size_t len)
+{
+    int retval;
+
+    retval = ezusb_submit(
+        fdev, "ezusb_loader", LIBUSB_ENDPOINT_IN,
+        opcode, 0, data, len
+    );
+
+    if (retval)
+        return retval;
+
+    return ezusb_flush(fdev);
+}
+
+/*
+ * Ask the running firmware whether it is the companion loader. Anything
+ * else stalls the request, which leaves the control path in charge.
+ */
+int ezusb_loader_probe(struct fxdev *fdev)
+{
+    uint8_t info[FX_LOADER_INFO];
+    int retval;
+
+    fdev->bulk = false;
+    fdev->crc = false;
+
+    retval = ezusb_loader_status(fdev, FX_CMD_LOADER_INFO, info, sizeof(info));
+    if (retval && retval != LIBUSB_ERROR_PIPE)
+        return retval;
+
+    if (retval || get_unaligned_le16(info) != FX_LOADER_MAGIC) {
+        printf("  Bulk loader not answering, using control transfers\n");
+        return 0;
+    }
+
+    if (info[2] != FX_LOADER_VERSION) {
+        printf("  Bulk loader v%u not supported, using control transfers\n", info[2]);
+        return 0;
+    }
+
+    /* the default descriptors only expose bulk endpoints in alternate setting 1 */
+    if ((retval = fdev->transport->altsetting(fdev, FX_LOADER_ALTSETTING))) {
+        fprintf(stderr, "Cannot select bulk endpoints: %s\n", libusb_error_name(retval));
+        return retval;
+    }
+
+    fdev->bulk = true;
+    fdev->crc = info[3] & FX_LOADER_FEATURE_CRC;
+    fdev->seq = 0;
+    fdev->frames = 0;
+    printf("  Bulk loader v%u%s\n", info[2], fdev->crc ? ", on-chip crc" : "");
+    return 0;
+}
+
+static void ezusb_loader_frame(struct fxdev *fdev, uint8_t *head, uint8_t op,
+                               uint16_t addr, uint16_t len, uint16_t crc)
+{
+    head[FX_FRAME_OP] = op;
+    head[FX_FRAME_SEQ] = fdev->seq++;
+    put_unaligned_le16(addr, head + FX_FRAME_ADDR);
+    put_unaligned_le16(len, head + FX_FRAME_LENGTH);
+    put_unaligned_le16(crc, head + FX_FRAME_CRC);
+    fdev->frames++;
+}
+
+/* one frame per transfer, the loader latches a crc mismatch for the status */
+int ezusb_loader_write(struct fxdev *fdev, uint8_t op, uint16_t addr,
+                       const void *data, size_t len)
+{
+    uint8_t head[FX_FRAME_HEADER];
+    size_t xfer;
+    int retval;
+
+    for (; len; addr += xfer, data += xfer, len -= xfer) {
+        xfer = min(len, (size_t)FX_LOADER_FRAME_MAX);
+        ezusb_loader_frame(fdev, head, op, addr, xfer, crc16_ccitt(0xffff, data, xfer));
+
+        retval = ezusb_submit_bulk(
+            fdev, "ezusb_loader_write", FX_LOADER_EP_OUT,
+            head, sizeof(head), (void *)data, xfer
+        );
+        if (retval)
+            return retval;
+    }
+
+    return 0;
+}
+
+/* the request goes out framed, the data comes back raw and exactly sized */
+int ezusb_loader_read(struct fxdev *fdev, uint8_t op, uint16_t addr,
+                      void *data, size_t len)
+{
+    uint8_t head[FX_FRAME_HEADER];
+    size_t xfer;
+    int retval;
+
+    for (; len; addr += xfer, data += xfer, len -= xfer) {
+        xfer = min(len, (size_t)FX_LOADER_FRAME_MAX);
+        ezusb_loader_frame(fdev, head, op, addr, xfer, 0);
+
+        retval = ezusb_submit_bulk(
+            fdev, "ezusb_loader_read", FX_LOADER_EP_OUT,
+            head, sizeof(head), NULL, 0
+        );
+        if (retval)
+            return retval;
+
+        retval = ezusb_submit_bulk(
+            fdev, "ezusb_loader_read", FX_LOADER_EP_IN,
+            NULL, 0, data, xfer
+        );
+        if (retval)
+            return retval;
+    }
+
+    return 0;
+}
+
+/*
+ * A completed bulk transfer only means the data sits in the endpoint
+ * buffers. Poll until the loader has applied every frame, each status
+ * read returns the frames done since the previous one.
+ */
+int ezusb_loader_sync(struct fxdev *fdev)
+{
+    uint8_t status[FX_LOADER_STATUS];
+    unsigned int expect, done = 0;
+    double deadline;
+    int retval;
+
+    expect = fdev->frames;
+    fdev->frames = 0;
+    deadline = fx_clock() + fdev->timeout / 1e3;
+
+    for (;;) {
+        retval = ezusb_loader_status(fdev, FX_CMD_LOADER_STATUS, status, sizeof(status));
+        if (retval)
+            return retval;
+
+        done += get_unaligned_le16(status + 2);
+        if (status[0] != FX_LOADER_OK) {
+            fprintf(
+                stderr, "Loader rejected frame %u: %s\n",
+                status[1], ezusb_loader_error(status[0])
+            );
+            return -EIO;
+        }
+
+        if (done >= expect)
+            return 0;
+
+        if (fx_clock() > deadline) {
+            fprintf(stderr, "Loader applied %u of %u frames\n", done, expect);
+            return -ETIMEDOUT;
+        }
+
+        usleep(1000);
+    }
+}
@@ -0,0 +1,723 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright(c) 2021-2022 John Sanpe <sanpeqf@gmail.com>
+ *
+ * Companion bulk loader for the FX2/FX2LP, built with sdcc (make bulkload).
+ * It answers the same vendor requests as the stock preload firmware and
+ * adds a framed stream on the bulk endpoints of alternate setting 1:
+ *
+ *   EP2 OUT: op, seq, addr (le16), length (le16), crc16 (le16), payload
+ *   EP6 IN:  raw data of a read frame, exactly length bytes
+ *
+ * Frames are applied in order. The first error is latched together with
+ * the sequence number of the failing frame, later frames are drained but
+ * not applied until the host fetches the status with FX_CMD_LOADER_STATUS.
+ * The loader keeps the enumeration of the default device, it only takes
+ * over ep0 so vendor requests reach it.
+ *
+ * FX_CMD_CRC_EEPROM answers with the crc32c of the wIndex eeprom bytes at
+ * wValue, so the host can verify without a read back.
+ *
+ * Protocol values must match fxhw.h.
+ */
+
+#include <stdint.h>
+
+#define FX_CMD_RW_EEPROM            0xa2
+#define FX_CMD_RW_MEMORY            0xa3
+#define FX_CMD_EEPROM_SIZE          0xa5
+#define FX_CMD_LOADER_INFO          0xb0
+#define FX_CMD_LOADER_STATUS        0xb1
+#define FX_CMD_CRC_EEPROM           0xb2
+
+#define FX_EEPROM_INFO_SINGLE       0x00
+#define FX_EEPROM_INFO_DOUBLE       0x01
+
+#define FX_LOADER_MAGIC             0x4c46
+#define FX_LOADER_VERSION           1
+#define FX_LOADER_FEATURE_CRC       0x01
+
+#define FX_LOADER_OP_WRITE_MEMORY   0x01
+#define FX_LOADER_OP_WRITE_EEPROM   0x02
+#define FX_LOADER_OP_READ_MEMORY    0x03
+#define FX_LOADER_OP_READ_EEPROM    0x04
+
+#define FX_LOADER_OK                0x00
+#define FX_LOADER_ECRC              0x01
+#define FX_LOADER_EFRAME            0x02
+#define FX_LOADER_ERANGE            0x03
+#define FX_LOADER_EEEPROM           0x04
+
+#define FX_FRAME_HEADER             8
+
+/* internal code and data, registers and endpoint buffers are off limits */
+#ifndef LOADER_INTERNAL_END
+# define LOADER_INTERNAL_END        0x4000
+#endif
+#define LOADER_REGISTERS            0xe000
+
+#define EEPROM_SINGLE_DEV           0x50
+#define EEPROM_DOUBLE_DEV           0x51
+#define EEPROM_SINGLE_PAGE          8
+#define EEPROM_DOUBLE_PAGE          64
+
+#define XREG(addr)  (*(volatile __xdata uint8_t *)(addr))
+
+#define CPUCS       XREG(0xe600)
+#define FIFORESET   XREG(0xe604)
+#define REVCTL      XREG(0xe60b)
+#define EP2CFG      XREG(0xe612)
+#define EP4CFG      XREG(0xe613)
+#define EP6CFG      XREG(0xe614)
+#define EP8CFG      XREG(0xe615)
+#define OUTPKTEND   XREG(0xe649)
+#define USBIRQ      XREG(0xe65d)
+#define I2CS        XREG(0xe678)
+#define I2DAT       XREG(0xe679)
+#define I2CTL       XREG(0xe67a)
+#define USBCS       XREG(0xe680)
+#define EP0BCH      XREG(0xe68a)
+#define EP0BCL      XREG(0xe68b)
+#define EP2BCH      XREG(0xe690)
+#define EP2BCL      XREG(0xe691)
+#define EP6BCH      XREG(0xe698)
+#define EP6BCL      XREG(0xe699)
+#define EP0CS       XREG(0xe6a0)
+#define EP2468STAT  XREG(0xe6a8)
+
+#define SETUPDAT    ((volatile __xdata uint8_t *)0xe6b8)
+#define EP0BUF      ((__xdata uint8_t *)0xe740)
+#define EP2FIFOBUF  ((__xdata uint8_t *)0xf000)
+#define EP6FIFOBUF  ((__xdata uint8_t *)0xf800)
+
+#define bmSUDAV     0x01
+#define bmRENUM     0x02
+#define bmHSM       0x80
+#define bmEPSTALL   0x01
+#define bmEPBUSY    0x02
+#define bmHSNAK     0x80
+#define bmEP2EMPTY  0x01
+#define bmEP6FULL   0x20
+#define bmSTART     0x80
+#define bmSTOP      0x40
+#define bmLASTRD    0x20
+#define bmBERR      0x04
+#define bmACK       0x02
+#define bmDONE      0x01
+#define bm400KHZ    0x01
+
+#define SYNCDELAY   do { __asm__("nop"); __asm__("nop"); __asm__("nop"); __asm__("nop"); } while (0)
+
+static const __code uint16_t crc16_table[256] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+    0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+    0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+    0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+    0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+    0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+    0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+    0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+    0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+    0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+    0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+    0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+    0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+    0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+    0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+    0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+    0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+    0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+    0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+    0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+    0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+    0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0
+};
+
+/* crc32c, the same checksum the host already computes with sse4.2 */
+static const __code uint32_t crc32c_table[256] = {
+    0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4,
+    0xc79a971f, 0x35f1141c, 0x26a1e7e8, 0xd4ca64eb,
+    0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b,
+    0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24,
+    0x105ec76f, 0xe235446c, 0xf165b798, 0x030e349b,
+    0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+    0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54,
+    0x5d1d08bf, 0xaf768bbc, 0xbc267848, 0x4e4dfb4b,
+    0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a,
+    0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35,
+    0xaa64d611, 0x580f5512, 0x4b5fa6e6, 0xb93425e5,
+    0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+    0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45,
+    0xf779deae, 0x05125dad, 0x1642ae59, 0xe4292d5a,
+    0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a,
+    0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595,
+    0x417b1dbc, 0xb3109ebf, 0xa0406d4b, 0x522bee48,
+    0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+    0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687,
+    0x0c38d26c, 0xfe53516f, 0xed03a29b, 0x1f682198,
+    0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927,
+    0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38,
+    0xdbfc821c, 0x2997011f, 0x3ac7f2eb, 0xc8ac71e8,
+    0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+    0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096,
+    0xa65c047d, 0x5437877e, 0x4767748a, 0xb50cf789,
+    0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859,
+    0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46,
+    0x7198540d, 0x83f3d70e, 0x90a324fa, 0x62c8a7f9,
+    0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+    0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36,
+    0x3cdb9bdd, 0xceb018de, 0xdde0eb2a, 0x2f8b6829,
+    0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c,
+    0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93,
+    0x082f63b7, 0xfa44e0b4, 0xe9141340, 0x1b7f9043,
+    0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+    0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3,
+    0x55326b08, 0xa759e80b, 0xb4091bff, 0x466298fc,
+    0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c,
+    0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033,
+    0xa24bb5a6, 0x502036a5, 0x4370c551, 0xb11b4652,
+    0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+    0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d,
+    0xef087a76, 0x1d63f975, 0x0e330a81, 0xfc588982,
+    0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d,
+    0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622,
+    0x38cc2a06, 0xcaa7a905, 0xd9f75af1, 0x2b9cd9f2,
+    0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+    0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530,
+    0x0417b1db, 0xf67c32d8, 0xe52cc12c, 0x1747422f,
+    0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff,
+    0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0,
+    0xd3d3e1ab, 0x21b862a8, 0x32e8915c, 0xc083125f,
+    0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+    0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90,
+    0x9e902e7b, 0x6cfbad78, 0x7fab5e8c, 0x8dc0dd8f,
+    0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee,
+    0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1,
+    0x69e9f0d5, 0x9b8273d6, 0x88d28022, 0x7ab90321,
+    0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+    0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81,
+    0x34f4f86a, 0xc69f7b69, 0xd5cf889d, 0x27a40b9e,
+    0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e,
+    0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351
+};
+
+/* frame being received */
+static __xdata uint8_t frame_head[FX_FRAME_HEADER];
+static uint8_t frame_fill;
+static uint8_t frame_op;
+static uint16_t frame_addr;
+static uint16_t frame_left;
+static uint16_t frame_crc;
+
+/* eeprom page being assembled */
+static __xdata uint8_t page_buf[EEPROM_DOUBLE_PAGE];
+static uint16_t page_addr;
+static uint8_t page_fill;
+
+/* reported through FX_CMD_LOADER_STATUS */
+static uint8_t loader_status;
+static uint8_t loader_seq;
+static uint16_t loader_frames;
+
+static uint8_t usb_config;
+static uint8_t usb_alt;
+
+static __bit eeprom_double(void)
+{
+    /* the boot rom leaves the eeprom type it found in I2CS ID1:ID0 */
+    return ((I2CS >> 3) & 0x03) == 0x02;
+}
+
+static uint8_t eeprom_page(void)
+{
+    return eeprom_double() ? EEPROM_DOUBLE_PAGE : EEPROM_SINGLE_PAGE;
+}
+
+static __bit i2c_wait(void)
+{
+    while (!(I2CS & bmDONE))
+        if (I2CS & bmBERR)
+            return 0;
+    return 1;
+}
+
+static void i2c_stop(void)
+{
+    I2CS |= bmSTOP;
+    while (I2CS & bmSTOP);
+}
+
+static __bit i2c_put(uint8_t value)
+{
+    I2DAT = value;
+    return i2c_wait() && (I2CS & bmACK);
+}
+
+/* start, device address and word address, leaves the bus open */
+static __bit eeprom_select(uint16_t addr)
+{
+    __bit twice = eeprom_double();
+
+    I2CS |= bmSTART;
+    if (!i2c_put((twice ? EEPROM_DOUBLE_DEV : EEPROM_SINGLE_DEV) << 1))
+        return 0;
+    if (twice && !i2c_put(addr >> 8))
+        return 0;
+    return i2c_put(addr);
+}
+
+static __bit eeprom_write(uint16_t addr, __xdata uint8_t *data, uint8_t len)
+{
+    uint8_t dev = (eeprom_double() ? EEPROM_DOUBLE_DEV : EEPROM_SINGLE_DEV) << 1;
+
+    if (!eeprom_select(addr))
+        goto failed;
+
+    while (len--) {
+        if (!i2c_put(*data++))
+            goto failed;
+    }
+    i2c_stop();
+
+    /* the part ignores its address until the write cycle is over */
+    for (;;) {
+        I2CS |= bmSTART;
+        I2DAT = dev;
+        if (!i2c_wait())
+            goto failed;
+        if (I2CS & bmACK)
+            break;
+        i2c_stop();
+    }
+
+    i2c_stop();
+    return 1;
+
+failed:
+    i2c_stop();
+    return 0;
+}
+
+static __bit eeprom_read(uint16_t addr, __xdata uint8_t *data, uint16_t len)
+{
+    uint8_t dev = (eeprom_double() ? EEPROM_DOUBLE_DEV : EEPROM_SINGLE_DEV) << 1;
+
+    if (!eeprom_select(addr))
+        goto failed;
+
+    I2CS |= bmSTART;
+    if (!i2c_put(dev | 1))
+        goto failed;
+
+    if (len == 1)
+        I2CS |= bmLASTRD;
+
+    /* the dummy read clocks in the first byte */
+    (void)I2DAT;
+    while (len) {
+        if (!i2c_wait())
+            goto failed;
+        if (len == 2)
+            I2CS |= bmLASTRD;
+        if (len == 1)
+            I2CS |= bmSTOP;
+        *data++ = I2DAT;
+        len--;
+    }
+
+    while (I2CS & bmSTOP);
+    return 1;
+
+failed:
+    i2c_stop();
+    return 0;
+}
+
+static void loader_fail(uint8_t status)
+{
+    if (loader_status == FX_LOADER_OK) {
+        loader_status = status;
+        loader_seq = frame_head[1];
+    }
+}
+
+static __bit page_flush(void)
+{
+    __bit done = 1;
+
+    if (page_fill && loader_status == FX_LOADER_OK)
+        done = eeprom_write(page_addr, page_buf, page_fill);
+
+    page_fill = 0;
+    return done;
+}
+
+static void frame_read(void)
+{
+    uint16_t addr = frame_addr, left = frame_left;
+    uint16_t packet, count;
+
+    packet = USBCS & bmHSM ? 512 : 64;
+
+    for (; left; left -= count, addr += count) {
+        count = left < packet ? left : packet;
+        while (EP2468STAT & bmEP6FULL);
+
+        if (frame_op == FX_LOADER_OP_READ_EEPROM) {
+            if (!eeprom_read(addr, EP6FIFOBUF, count))
+                loader_fail(FX_LOADER_EEEPROM);
+        } else {
+            uint16_t index;
+            for (index = 0; index < count; ++index)
+                EP6FIFOBUF[index] = *(__xdata uint8_t *)(addr + index);
+        }
+
+        EP6BCH = count >> 8;
+        SYNCDELAY;
+        EP6BCL = count;
+    }
+}
+
+static void frame_begin(void)
+{
+    uint16_t end;
+
+    frame_op = frame_head[0];
+    frame_addr = frame_head[2] | (uint16_t)frame_head[3] << 8;
+    frame_left = frame_head[4] | (uint16_t)frame_head[5] << 8;
+    frame_crc = 0xffff;
+    end = frame_addr + frame_left;
+    page_fill = 0;
+
+    if (loader_status == FX_LOADER_OK)
+        loader_seq = frame_head[1];
+
+    if (frame_op < FX_LOADER_OP_WRITE_MEMORY || frame_op > FX_LOADER_OP_READ_EEPROM) {
+        loader_fail(FX_LOADER_EFRAME);
+    } else if (end && end < frame_addr) {
+        loader_fail(FX_LOADER_ERANGE);
+    } else if (frame_op == FX_LOADER_OP_WRITE_MEMORY || frame_op == FX_LOADER_OP_READ_MEMORY) {
+        if (frame_addr < LOADER_INTERNAL_END || !end || end > LOADER_REGISTERS)
+            loader_fail(FX_LOADER_ERANGE);
+    } else if (!eeprom_double() && (end > 0x100 || !end)) {
+        loader_fail(FX_LOADER_ERANGE);
+    }
+
+    /* reads carry no payload, the data goes straight out on ep6 */
+    if (frame_op == FX_LOADER_OP_READ_MEMORY || frame_op == FX_LOADER_OP_READ_EEPROM) {
+        if (loader_status == FX_LOADER_OK)
+            frame_read();
+        frame_left = 0;
+    }
+}
+
+static void frame_data(uint8_t value)
+{
+    frame_crc = (frame_crc << 8) ^ crc16_table[(frame_crc >> 8) ^ value];
+
+    if (loader_status != FX_LOADER_OK)
+        goto next;
+
+    if (frame_op == FX_LOADER_OP_WRITE_MEMORY) {
+        *(__xdata uint8_t *)frame_addr = value;
+        goto next;
+    }
+
+    if (!page_fill)
+        page_addr = frame_addr;
+    page_buf[page_fill++] = value;
+
+    /* a page write never crosses the page boundary */
+    if (!((frame_addr + 1) & (eeprom_page() - 1)) && !page_flush())
+        loader_fail(FX_LOADER_EEEPROM);
+
+next:
+    frame_addr++;
+    frame_left--;
+}
+
+static void frame_end(void)
+{
+    uint16_t crc = frame_head[6] | (uint16_t)frame_head[7] << 8;
+
+    if (frame_op == FX_LOADER_OP_WRITE_EEPROM && !page_flush())
+        loader_fail(FX_LOADER_EEEPROM);
+
+    if ((frame_op == FX_LOADER_OP_WRITE_MEMORY || frame_op == FX_LOADER_OP_WRITE_EEPROM) &&
+        frame_crc != crc)
+        loader_fail(FX_LOADER_ECRC);
+
+    loader_frames++;
+    frame_fill = 0;
+}
+
+static void bulk_packet(void)
+{
+    uint16_t count, index;
+
+    count = EP2BCL | (uint16_t)EP2BCH << 8;
+
+    for (index = 0; index < count; ++index) {
+        if (frame_fill < FX_FRAME_HEADER) {
+            frame_head[frame_fill++] = EP2FIFOBUF[index];
+            if (frame_fill == FX_FRAME_HEADER) {
+                frame_begin();
+                if (!frame_left)
+                    frame_end();
+            }
+            continue;
+        }
+
+        frame_data(EP2FIFOBUF[index]);
+        if (!frame_left)
+            frame_end();
+    }
+
+    /* hand the buffer back to the usb side */
+    OUTPKTEND = 0x82;
+    SYNCDELAY;
+}
+
+static void bulk_reset(void)
+{
+    FIFORESET = 0x80;
+    SYNCDELAY;
+    FIFORESET = 0x02;
+    SYNCDELAY;
+    FIFORESET = 0x06;
+    SYNCDELAY;
+    FIFORESET = 0x00;
+    SYNCDELAY;
+
+    /* arm both ep2 buffers */
+    OUTPKTEND = 0x82;
+    SYNCDELAY;
+    OUTPKTEND = 0x82;
+    SYNCDELAY;
+
+    frame_fill = 0;
+}
+
+static void bulk_setup(void)
+{
+    REVCTL = 0x03;
+    SYNCDELAY;
+    EP2CFG = 0xa2;
+    SYNCDELAY;
+    EP4CFG = 0x00;
+    SYNCDELAY;
+    EP6CFG = 0xe2;
+    SYNCDELAY;
+    EP8CFG = 0x00;
+    SYNCDELAY;
+    bulk_reset();
+}
+
+/* FX_CMD_CRC_EEPROM, read in ep0 sized pieces through the idle ep0 buffer */
+static __bit crc_range(uint16_t addr, uint16_t len)
+{
+    uint32_t crc = 0xffffffff;
+    uint8_t count, index;
+    uint16_t end = addr + len;
+
+    if (end && end < addr)
+        return 0;
+    if (!eeprom_double() && (end > 0x100 || !end))
+        return 0;
+
+    for (; len; len -= count, addr += count) {
+        count = len < 64 ? len : 64;
+        if (!eeprom_read(addr, EP0BUF, count))
+            return 0;
+        for (index = 0; index < count; ++index)
+            crc = crc32c_table[(uint8_t)crc ^ EP0BUF[index]] ^ (crc >> 8);
+    }
+
+    crc = ~crc;
+    EP0BUF[0] = crc;
+    EP0BUF[1] = crc >> 8;
+    EP0BUF[2] = crc >> 16;
+    EP0BUF[3] = crc >> 24;
+    return 1;
+}
+
+static void ep0_send(uint8_t count)
+{
+    EP0BCH = 0;
+    EP0BCL = count;
+}
+
+/* FX_CMD_RW_EEPROM and FX_CMD_RW_MEMORY, in ep0 sized pieces */
+static __bit ep0_transfer(uint8_t in, uint8_t eeprom, uint16_t addr, uint16_t len)
+{
+    uint8_t count, index;
+
+    for (; len; len -= count, addr += count) {
+        count = len < 64 ? len : 64;
+        while (EP0CS & bmEPBUSY);
+
+        if (in) {
+            if (eeprom && !eeprom_read(addr, EP0BUF, count))
+                return 0;
+            for (index = 0; !eeprom && index < count; ++index)
+                EP0BUF[index] = *(__xdata uint8_t *)(addr + index);
+            ep0_send(count);
+            continue;
+        }
+
+        EP0BCL = 0;
+        while (EP0CS & bmEPBUSY);
+        count = EP0BCL;
+
+        if (eeprom) {
+            uint8_t page = eeprom_page(), piece;
+            for (index = 0; index < count; index += piece) {
+                piece = page - ((addr + index) & (page - 1));
+                if (piece > count - index)
+                    piece = count - index;
+                if (!eeprom_write(addr + index, EP0BUF + index, piece))
+                    return 0;
+            }
+        } else {
+            for (index = 0; index < count; ++index)
+                *(__xdata uint8_t *)(addr + index) = EP0BUF[index];
+        }
+    }
+
+    return 1;
+}
+
+static __bit setup_standard(void)
+{
+    switch (SETUPDAT[1]) {
+        case 0x00: /* GET_STATUS */
+            EP0BUF[0] = 0;
+            EP0BUF[1] = 0;
+            ep0_send(2);
+            return 1;
+
+        case 0x01: case 0x03: /* CLEAR_FEATURE, SET_FEATURE */
+            return 1;
+
+        case 0x08: /* GET_CONFIGURATION */
+            EP0BUF[0] = usb_config;
+            ep0_send(1);
+            return 1;
+
+        case 0x09: /* SET_CONFIGURATION */
+            usb_config = SETUPDAT[2];
+            return 1;
+
+        case 0x0a: /* GET_INTERFACE */
+            EP0BUF[0] = usb_alt;
+            ep0_send(1);
+            return 1;
+
+        case 0x0b: /* SET_INTERFACE */
+            usb_alt = SETUPDAT[2];
+            bulk_reset();
+            return 1;
+
+        /* descriptors stay with the host from the default enumeration */
+        default:
+            return 0;
+    }
+}
+
+static __bit setup_vendor(void)
+{
+    uint8_t in = SETUPDAT[0] & 0x80;
+    uint16_t addr = SETUPDAT[2] | (uint16_t)SETUPDAT[3] << 8;
+    uint16_t index = SETUPDAT[4] | (uint16_t)SETUPDAT[5] << 8;
+    uint16_t len = SETUPDAT[6] | (uint16_t)SETUPDAT[7] << 8;
+
+    switch (SETUPDAT[1]) {
+        case FX_CMD_RW_EEPROM:
+            return ep0_transfer(in, 1, addr, len);
+
+        case FX_CMD_RW_MEMORY:
+            return ep0_transfer(in, 0, addr, len);
+
+        case FX_CMD_EEPROM_SIZE:
+            EP0BUF[0] = eeprom_double() ? FX_EEPROM_INFO_DOUBLE : FX_EEPROM_INFO_SINGLE;
+            ep0_send(1);
+            return 1;
+
+        case FX_CMD_LOADER_INFO:
+            EP0BUF[0] = FX_LOADER_MAGIC & 0xff;
+            EP0BUF[1] = FX_LOADER_MAGIC >> 8;
+            EP0BUF[2] = FX_LOADER_VERSION;
+            EP0BUF[3] = FX_LOADER_FEATURE_CRC;
+            ep0_send(4);
+            return 1;
+
+        case FX_CMD_LOADER_STATUS:
+            EP0BUF[0] = loader_status;
+            EP0BUF[1] = loader_seq;
+            EP0BUF[2] = loader_frames;
+            EP0BUF[3] = loader_frames >> 8;
+            loader_status = FX_LOADER_OK;
+            loader_frames = 0;
+            ep0_send(4);
+            return 1;
+
+        /* the data stage naks until the range is walked */
+        case FX_CMD_CRC_EEPROM:
+            if (!crc_range(addr, index))
+                return 0;
+            ep0_send(4);
+            return 1;
+
+        default:
+            return 0;
+    }
+}
+
+static void setup(void)
+{
+    __bit done;
+
+    if ((SETUPDAT[0] & 0x60) == 0x40)
+        done = setup_vendor();
+    else if (!(SETUPDAT[0] & 0x60))
+        done = setup_standard();
+    else
+        done = 0;
+
+    if (done)
+        EP0CS |= bmHSNAK;
+    else
+        EP0CS |= bmEPSTALL;
+}
+
+void main(void)
+{
+    /* 48MHz, no clock out */
+    CPUCS = (CPUCS & ~0x1a) | 0x10;
+    I2CTL = bm400KHZ;
+
+    bulk_setup();
+
+    /* take ep0 from the core, the device address stays as it is */
+    USBCS |= bmRENUM;
+
+    for (;;) {
+        if (USBIRQ & bmSUDAV) {
+            USBIRQ = bmSUDAV;
+            setup();
+        }
+
+        if (!(EP2468STAT & bmEP2EMPTY))
+            bulk_packet();
+    }
+}
@@ -42,6 +42,51 @@
  */
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
 
+/**
+ * put_unaligned_le16 - store a 16-bit value little endian at any address
+ * @val: value to store
+ * @p: destination bytes
+ */
+#define put_unaligned_le16(val, p) ({                   \
+    uint8_t *_p = (uint8_t *)(p);                       \
+    uint16_t _val = (val);                              \
+    _p[0] = _val & 0xff;                                \
+    _p[1] = _val >> 8;                                  \
+})
+
+/**
+ * put_unaligned_le32 - store a 32-bit value little endian at any address
+ * @val: value to store
+ * @p: destination bytes
+ */
+#define put_unaligned_le32(val, p) ({                   \
+    uint8_t *_p = (uint8_t *)(p);                       \
+    uint32_t _val = (val);                              \
+    _p[0] = _val & 0xff;                                \
+    _p[1] = (_val >> 8) & 0xff;                         \
+    _p[2] = (_val >> 16) & 0xff;                        \
+    _p[3] = _val >> 24;                                 \
+})
+
+/**
+ * get_unaligned_le16 - load a 16-bit little endian value from any address
+ * @p: source bytes
+ */
+#define get_unaligned_le16(p) ({                        \
+    const uint8_t *_p = (const uint8_t *)(p);           \
+    (uint16_t)(_p[0] | _p[1] << 8);                     \
+})
+
+/**
+ * get_unaligned_le32 - load a 32-bit little endian value from any address
+ * @p: source bytes
+ */
+#define get_unaligned_le32(p) ({                        \
+    const uint8_t *_p = (const uint8_t *)(p);           \
+    (uint32_t)_p[0] | (uint32_t)_p[1] << 8 |            \
+    (uint32_t)_p[2] << 16 | (uint32_t)_p[3] << 24;      \
+})
+
 /*
  *   gcc: https://gcc.gnu.org/onlinedocs/gcc/Common-Type-Attributes.html#index-packed-type-attribute
  * clang: https://gcc.gnu.org/onlinedocs/gcc/Common-Variable-Attributes.html#index-packed-variable-attribute
@@ -3,51 +3,46 @@
  * Copyright(c) 2021-2022 John Sanpe <sanpeqf@gmail.com>
  */
 
-#include "fxprog.h"
-#include <fcntl.h>
+#include "fxjob.h"
 #include <err.h>
 #include <getopt.h>
-
-#include <unistd.h>
-#include <fcntl.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
-
-static int firmware_fd;
-static void *firmware_data;
-static struct stat firmware_stat;
-
-enum flags_bit {
-    __FLAG_INFO,
-    __FLAG_ERASE,
-    __FLAG_FLASH,
-    __FLAG_MODE,
-    __FLAG_VENDOR,
-    __FLAG_PRODUCT,
-    __FLAG_DEVICE,
-    __FLAG_CONFIG,
-    __FLAG_FIRMWARE,
-    __FLAG_MEMORY,
-    __FLAG_RESET,
+#include <pthread.h>
+
+struct fx_gang {
+    pthread_t thread;
+    struct fxdev fdev;
+    libusb_device *usbdev;
+    const struct fx_job *job;
+    const char *errmsg;
+    char path[32];
+    double seconds;
+    int retval;
 };
 
-#define FLAG_INFO       (1LU << __FLAG_INFO)
-#define FLAG_ERASE      (1LU << __FLAG_ERASE)
-#define FLAG_FLASH      (1LU << __FLAG_FLASH)
-#define FLAG_MODE       (1LU << __FLAG_MODE)
-#define FLAG_VENDOR     (1LU << __FLAG_VENDOR)
-#define FLAG_PRODUCT    (1LU << __FLAG_PRODUCT)
-#define FLAG_DEVICE     (1LU << __FLAG_DEVICE)
-#define FLAG_CONFIG     (1LU << __FLAG_CONFIG)
-#define FLAG_FIRMWARE   (1LU << __FLAG_FIRMWARE)
-#define FLAG_MEMORY     (1LU << __FLAG_MEMORY)
-#define FLAG_RESET      (1LU << __FLAG_RESET)
-
 static const struct option options[] = {
     {"help",        no_argument,        0,  'h'},
     {"device",      required_argument,  0,  'd'},
     {"port",        required_argument,  0,  'p'},
     {"preload",     required_argument,  0,  'l'},
+    {"loader",      required_argument,  0,  'L'},
+    {"queue",       required_argument,  0,  'q'},
+    {"retry",       required_argument,  0,  'y'},
+    {"probe",       optional_argument,  0,  'z'},
+    {"gang",        no_argument,        0,  'g'},
+    {"batch",       required_argument,  0,  'b'},
+    {"renumerate",  no_argument,        0,  'n'},
+    {"simulate",    optional_argument,  0,  'S'},
+    {"daemon",      required_argument,  0,  's'},
+    {"auto",        no_argument,        0,  'a'},
+    {"workers",     required_argument,  0,  'j'},
+    {"connect",     required_argument,  0,  'k'},
+    {"stats",       optional_argument,  0,  't'},
+    {"trace",       required_argument,  0,  'T'},
+    {"compile",     required_argument,  0,  'O'},
+    {"verify",      no_argument,        0,  'c'},
+    {"delta",       no_argument,        0,  'u'},
+    {"resume",      no_argument,        0,  'R'},
+    {"offset",      required_argument,  0,  'o'},
     {"info",        no_argument,        0,  'i'},
     {"erase",       no_argument,        0,  'e'},
     {"flash",       required_argument,  0,  'w'},
@@ -55,6 +50,7 @@ static const struct option options[] = {
     {"vendor",      required_argument,  0,  'V'},
     {"product",     required_argument,  0,  'P'},
     {"device",      required_argument,  0,  'D'},
+    {"config",      required_argument,  0,  'C'},
     {"firmware",    required_argument,  0,  'F'},
     {"memory",      required_argument,  0,  'm'},
     {"reset",       no_argument,        0,  'r'},
@@ -68,7 +64,29 @@ static __noreturn void usage(void)
     printf("\t-h, --help                 display this message\n");
     printf("\t-d, --device    <type>     device type: fx fx2 fx2lp\n");
     printf("\t-p, --port      <vid:pid>  set device vendor and product\n");
-    printf("\t-m, --memory    <file>     load firmware to memory\n");
+    printf("\t-l, --preload   <file>     vendor request firmware, built-in by default\n");
+    printf("\t-L, --loader    <file>     bulk loader firmware, control transfers if it stays quiet\n");
+    printf("\t-q, --queue     <depth>    usb transfers kept in flight\n");
+    printf("\t-y, --retry     <opts>     retry policy for failed transfers\n");
+    printf("\t                           opts: attempts=n,timeout=ms,backoff=us,cap=us,jitter=percent,tmin=ms,tmax=ms,adapt\n");
+    printf("\t-z, --probe[=force]        size control transfers for this port, cached after the first run\n");
+    printf("\t-g, --gang                 program every matching device in parallel\n");
+    printf("\t-b, --batch     <file>     run the operations listed in file, - for stdin\n");
+    printf("\t-S, --simulate[=<opts>]    use a simulated device instead of usb\n");
+    printf("\t                           opts: latency=us,rate=KB/s,cycle=us,eeprom=info,bulk=KB/s,flaky=n,control=bytes,strict,loader\n");
+    printf("\t-s, --daemon    <socket>   stay resident and accept jobs on a unix socket\n");
+    printf("\t-a, --auto                 daemon runs the given operations on arriving boards\n");
+    printf("\t-j, --workers   <count>    daemon jobs run in parallel\n");
+    printf("\t-k, --connect   <socket>   send the operations to a daemon, none asks for stats\n");
+    printf("\t-t, --stats[=json]         profile every transfer and report at the end\n");
+    printf("\t-T, --trace     <file>     record every control transfer for fxreplay\n");
+    printf("\t-O, --compile   <file>     build a .iic boot image from -F files and header, no device\n");
+    printf("\t-n, --renumerate           follow the device when started firmware renumerates\n");
+    printf("\t-c, --verify               read back and compare written data\n");
+    printf("\t-u, --delta                only rewrite eeprom pages that changed\n");
+    printf("\t-R, --resume               journal eeprom writes, skip what a failed run committed\n");
+    printf("\t-o, --offset    <addr>     place binary files named after it at addr\n");
+    printf("\t-m, --memory    <file>     load firmware to memory, - streams HEX from stdin\n");
     printf("\t-i, --info                 read the eeprom info\n");
     printf("\t-e, --erase                erase the entire eeprom\n");
     printf("\t-w, --flash     <file>     write eeprom with data from filename\n");
@@ -91,85 +109,163 @@ static __noreturn void version(void)
     exit(1);
 }
 
-static int fx_usb_init(uint16_t usb_vendor, uint16_t usb_product)
+static void fx_option(struct fx_job *job, enum fx_op_type type, const char *arg)
 {
     int retval;
 
-    if ((retval = libusb_init(NULL))) {
-        fprintf(stderr, "Cannot initialize libusb: %s\n", libusb_error_name(retval));
-        return retval;
-    };
+    if ((retval = fx_job_add(job, type, arg)))
+        errx(-1, "Cannot add operation '%s': %s", fx_opdescs[type].name, strerror(-retval));
+}
 
-    fx_usb_device = libusb_open_device_with_vid_pid(NULL, usb_vendor, usb_product);
-    if (!fx_usb_device) {
-        fprintf(stderr, "Cannot found bootloader mode chip\n");
-        return -ENODEV;
-    }
+static void fx_batch(struct fx_job *job, const char *name)
+{
+    FILE *stream;
 
-    if (libusb_kernel_driver_active(fx_usb_device, 0)) {
-        if ((retval = libusb_detach_kernel_driver(fx_usb_device, 0))) {
-            fprintf(stderr, "Cannot to detach kernel driver: %s\n", libusb_error_name(retval));
-            return retval;
-        }
-    }
+    stream = strcmp(name, "-") ? fopen(name, "r") : stdin;
+    if (!stream)
+        err(-1, "Cannot open batch: %s", name);
 
-    if ((retval = libusb_claim_interface(fx_usb_device, 0))) {
-        fprintf(stderr, "Cannot claim interface: %s\n", libusb_error_name(retval));
-        return retval;
-    };
+    if (fx_job_parse(job, stream, name, stderr))
+        exit(-1);
 
-    return 0;
+    if (stream != stdin)
+        fclose(stream);
 }
 
-static inline bool file_is_hex(const char *file)
+static void *fx_gang_worker(void *pdata)
 {
-    return strstr(file, ".hex") || strstr(file, ".ihx");
+    struct fx_gang *gang = pdata;
+    double start = fx_clock();
+
+    gang->errmsg = "Cannot open device";
+
+    if (!(gang->retval = fxdev_open(&gang->fdev, gang->usbdev))) {
+        gang->retval = fx_run(&gang->fdev, gang->job, &gang->errmsg, NULL);
+        fxdev_close(&gang->fdev);
+    }
+
+    gang->seconds = fx_clock() - start;
+    return NULL;
 }
 
-static bool mmap_firmware(const char *file)
+static int fx_gang_run(const struct fxdev *proto, uint16_t usb_vendor, uint16_t usb_product,
+                       const struct fx_job *job, bool json)
 {
+    struct fxdev_stats stats = {};
+    struct libusb_device_descriptor desc;
+    libusb_device **list;
+    struct fx_gang *gang;
+    unsigned int count = 0, failed = 0, index;
+    double start;
+    ssize_t number;
     int retval;
-    bool hex;
 
-    if ((firmware_fd = open(file, O_RDONLY)) < 0)
-        err(-1, "Cannot open file: %s", file);
+    if ((number = libusb_get_device_list(NULL, &list)) < 0) {
+        fprintf(stderr, "Cannot list usb devices: %s\n", libusb_error_name(number));
+        return number;
+    }
+
+    gang = calloc(number, sizeof(*gang));
+    if (!gang) {
+        libusb_free_device_list(list, 1);
+        return -ENOMEM;
+    }
+
+    for (index = 0; index < number; ++index) {
+        if (libusb_get_device_descriptor(list[index], &desc))
+            continue;
+        if (desc.idVendor != usb_vendor || desc.idProduct != usb_product)
+            continue;
+        gang[count].fdev = *proto;
+        gang[count].usbdev = list[index];
+        gang[count].job = job;
+        fx_usb_path(list[index], gang[count].path, sizeof(gang[count].path));
+        count++;
+    }
+
+    if (!count) {
+        fprintf(stderr, "Cannot found bootloader mode chip\n");
+        retval = -ENODEV;
+        goto finish;
+    }
+
+    printf("Gang programming %u devices...\n", count);
+    start = fx_clock();
 
-    if ((retval = fstat(firmware_fd, &firmware_stat)) < 0)
-        err(retval, "file fstat err");
+    for (index = 0; index < count; ++index) {
+        if ((retval = pthread_create(&gang[index].thread, NULL, fx_gang_worker, &gang[index]))) {
+            gang[index].retval = -retval;
+            gang[index].errmsg = "Cannot create thread";
+        }
+    }
+
+    for (index = 0; index < count; ++index) {
+        if (gang[index].thread)
+            pthread_join(gang[index].thread, NULL);
+    }
 
-    firmware_data = mmap(NULL, firmware_stat.st_size, PROT_READ, MAP_SHARED, firmware_fd, 0);
-    if (firmware_data == MAP_FAILED)
-        err(-1, "file mmap err");
+    printf("Gang summary:\n");
+    printf("  %-16s %-6s %8s\n", "Device", "Result", "Time");
+
+    for (index = 0; index < count; ++index) {
+        printf(
+            "  %-16s %-6s %7.3fs", gang[index].path,
+            gang[index].retval ? "FAIL" : "PASS", gang[index].seconds
+        );
+        if (gang[index].retval) {
+            printf("  %s (%d)", gang[index].errmsg, gang[index].retval);
+            failed++;
+        }
+        printf("\n");
+    }
 
-    if (file_is_hex(file))
-        hex = true;
-    else
-        hex = false;
+    printf("  %u passed, %u failed in %.3fs\n", count - failed, failed, fx_clock() - start);
+
+    if (proto->profile) {
+        for (index = 0; index < count; ++index)
+            fxdev_stats_merge(&stats, &gang[index].fdev.stats);
+        fxdev_stats_report(&stats, stdout, json);
+    }
 
-    return hex;
+    retval = failed ? -EIO : 0;
+
+finish:
+    libusb_free_device_list(list, 1);
+    free(gang);
+    return retval;
 }
 
 int main(int argc, char *const argv[])
 {
     uint16_t usb_vendor = FX_USB_VENDOR;
     uint16_t usb_product = FX_USB_PRODUCT;
-    const char *flash, *memory, *firmware;
-    unsigned long flags = 0;
-    uint16_t vendor, product, device;
-    uint8_t mode, config;
+    struct fx_job job = {};
+    struct fx_file preload = {};
+    struct fxsim_config sim = fxsim_default;
+    struct fxd_config daemon = {
+        .workers = 1,
+    };
+    const char *connect = NULL, *trace = NULL, *compile = NULL;
+    bool simulate = false, autojob = false, json = false;
+    struct fx_timing timing;
+    const char *batch = NULL;
+    bool gang = false;
+    struct fxdev fdev;
+    const char *errmsg;
     int optidx, retval;
     char arg, *tmp;
-    bool hex;
 
-    while ((arg = getopt_long(argc, argv, "hd:p:l:iew:B:V:P:D:C:F:m:rv", options, &optidx)) != -1) {
+    fxdev_init(&fdev, NULL, DEV_TYPE_FX);
+
+    while ((arg = getopt_long(argc, argv, "hd:p:l:L:q:y:z::gb:nS::s:aj:k:t::T:O:cuRo:iew:B:V:P:D:C:F:m:rv", options, &optidx)) != -1) {
         switch (arg) {
             case 'd':
                 if (!strcmp(optarg, "fx"))
-                    device_type = DEV_TYPE_FX;
+                    fdev.type = DEV_TYPE_FX;
                 else if (!strcmp(optarg, "fx2"))
-                    device_type = DEV_TYPE_FX2;
+                    fdev.type = DEV_TYPE_FX2;
                 else if (!strcmp(optarg, "fx2lp"))
-                    device_type = DEV_TYPE_FX2LP;
+                    fdev.type = DEV_TYPE_FX2LP;
                 else
                     usage();
                 break;
@@ -181,58 +277,142 @@ int main(int argc, char *const argv[])
                 usb_product = strtoul(tmp, NULL, 0);
                 break;
 
+            case 'l':
+                preload.name = optarg;
+                break;
+
+            case 'L':
+                preload.name = optarg;
+                fdev.loader = true;
+                break;
+
+            case 'q':
+                fdev.queue_depth = strtoul(optarg, NULL, 0);
+                if (!fdev.queue_depth)
+                    usage();
+                break;
+
+            case 'y':
+                if (fxretry_parse(&fdev, optarg))
+                    usage();
+                break;
+
+            case 'z':
+                fdev.probe = true;
+                if (optarg && strcmp(optarg, "force"))
+                    usage();
+                fdev.reprobe = !!optarg;
+                break;
+
+            case 'g':
+                gang = true;
+                break;
+
+            case 'b':
+                batch = optarg;
+                break;
+
+            case 'n':
+                fdev.renumerate = true;
+                break;
+
+            case 'S':
+                simulate = true;
+                if (fxsim_parse(&sim, optarg))
+                    usage();
+                break;
+
+            case 's':
+                daemon.socket = optarg;
+                break;
+
+            case 'a':
+                autojob = true;
+                break;
+
+            case 'j':
+                daemon.workers = strtoul(optarg, NULL, 0);
+                if (!daemon.workers)
+                    usage();
+                break;
+
+            case 'k':
+                connect = optarg;
+                break;
+
+            case 't':
+                if (optarg && strcmp(optarg, "json"))
+                    usage();
+                fdev.profile = true;
+                json = !!optarg;
+                break;
+
+            case 'T':
+                trace = optarg;
+                break;
+
+            case 'O':
+                compile = optarg;
+                break;
+
+            case 'c':
+                fdev.verify = true;
+                break;
+
+            case 'u':
+                fdev.delta = true;
+                break;
+
+            case 'R':
+                fdev.resume = true;
+                break;
+
+            case 'o':
+                job.offset = strtoul(optarg, NULL, 0);
+                break;
+
             case 'm':
-                flags |= FLAG_MEMORY;
-                memory = optarg;
+                fx_option(&job, FX_OP_MEMORY, optarg);
                 break;
 
             case 'i':
-                flags |= FLAG_INFO;
+                fx_option(&job, FX_OP_INFO, NULL);
                 break;
 
             case 'e':
-                flags |= FLAG_ERASE;
+                fx_option(&job, FX_OP_ERASE, NULL);
                 break;
 
             case 'w':
-                flags |= FLAG_FLASH;
-                flash = optarg;
+                fx_option(&job, FX_OP_FLASH, optarg);
                 break;
 
             case 'B':
-                flags |= FLAG_MODE;
-                mode = strtoul(optarg, NULL, 0);
+                fx_option(&job, FX_OP_MODE, optarg);
                 break;
 
             case 'V':
-                flags |= FLAG_VENDOR;
-                vendor = strtoul(optarg, NULL, 0);
+                fx_option(&job, FX_OP_VENDOR, optarg);
                 break;
 
             case 'P':
-                flags |= FLAG_PRODUCT;
-                product = strtoul(optarg, NULL, 0);
+                fx_option(&job, FX_OP_PRODUCT, optarg);
                 break;
 
             case 'D':
-                flags |= FLAG_DEVICE;
-                device = strtoul(optarg, NULL, 0);
+                fx_option(&job, FX_OP_DEVICE, optarg);
                 break;
 
             case 'C':
-                flags |= FLAG_CONFIG;
-                config = strtoul(optarg, NULL, 0);
+                fx_option(&job, FX_OP_CONFIG, optarg);
                 break;
 
             case 'F':
-                if (file_is_hex(optarg))
-                    usage();
-                flags |= FLAG_FIRMWARE;
-                firmware = optarg;
+                fx_option(&job, FX_OP_FIRMWARE, optarg);
                 break;
 
             case 'r':
-                flags |= FLAG_RESET;
+                fx_option(&job, FX_OP_RESET, NULL);
                 break;
 
             case 'v':
@@ -246,55 +426,106 @@ int main(int argc, char *const argv[])
     if (argc < 2)
         usage();
 
-    printf("Fxprog v1.1\n");
-    retval = fx_usb_init(usb_vendor, usb_product);
-    if (retval)
-        return retval;
+    /* flags keep their historical order, a batch runs as written */
+    fx_job_sort(&job);
+    if (batch)
+        fx_batch(&job, batch);
+
+    /* the daemon loads the images itself */
+    if (connect)
+        return fx_daemon_connect(connect, &job);
 
-    if (flags & FLAG_MEMORY) {
-        hex = mmap_firmware(memory);
-        retval = fxdev_ram_write(firmware_data, firmware_stat.st_size, hex);
-        if (retval)
-            err(retval, "Failed to load memory with data");
+    if (preload.name) {
+        if ((retval = fx_file_load(&preload)))
+            return retval;
+        fdev.preload = &preload.image;
     }
 
-    if ((flags & FLAG_INFO) && (retval = fxdev_eeprom_info()))
-        err(retval, "Failed to read the eeprom info");
+    if ((retval = fx_job_load(&job)))
+        return retval;
+
+    printf("Fxprog v1.1\n");
+
+    /* offline, nothing below needs a device */
+    if (compile)
+        return fx_compile(&fdev, &job, compile);
 
-    if ((flags & FLAG_ERASE) && (retval = fxdev_eeprom_erase()))
-        err(retval, "Failed to erase the entire eeprom");
+    if (fx_job_streams(&job) && (gang || daemon.socket))
+        errx(-1, "Stdin can only feed a single device");
 
-    if (flags & FLAG_FLASH) {
-        hex = mmap_firmware(flash);
-        retval = fxdev_eeprom_write(firmware_data, firmware_stat.st_size, hex);
-        if (retval)
-            err(retval, "Failed to write eeprom with data");
+    if (trace) {
+        if (gang || daemon.socket)
+            errx(-1, "Trace follows a single device");
+        if (!(fdev.trace = fxtrace_open(trace, fdev.type, fdev.queue_depth)))
+            return -EIO;
     }
 
-    if ((flags & FLAG_MODE) && (retval = fxdev_eeprom_mode(mode)))
-        err(retval, "Failed to write bootmode");
+    if (daemon.socket) {
+        if (simulate || gang)
+            errx(-1, "Daemon mode needs real devices");
+        if (autojob && !job.count)
+            errx(-1, "Auto-program needs operations to run");
+        if ((retval = fx_job_own(&job)))
+            return retval;
+
+        if ((retval = libusb_init(NULL))) {
+            fprintf(stderr, "Cannot initialize libusb: %s\n", libusb_error_name(retval));
+            return retval;
+        }
+
+        daemon.proto = &fdev;
+        daemon.vendor = usb_vendor;
+        daemon.product = usb_product;
+        daemon.autojob = autojob ? &job : NULL;
+        daemon.cache = &job;
 
-    if ((flags & FLAG_VENDOR) && (retval = fxdev_eeprom_vendor(vendor)))
-        err(retval, "Failed to get write vendor");
+        retval = fx_daemon(&daemon);
+        libusb_exit(NULL);
+        return retval;
+    }
 
-    if ((flags & FLAG_PRODUCT) && (retval = fxdev_eeprom_product(product)))
-        err(retval, "Failed to get write product");
+    if (simulate) {
+        if (gang)
+            errx(-1, "Gang mode needs real devices");
 
-    if ((flags & FLAG_DEVICE) && (retval = fxdev_eeprom_device(device)))
-        err(retval, "Failed to get write device");
+        fx_timing_init(&timing);
+        if ((retval = fxsim_open(&fdev, &sim)))
+            return retval;
+        fx_timing_stage(&timing, "open");
 
-    if ((flags & FLAG_CONFIG) && (retval = fxdev_eeprom_config(config)))
-        err(retval, "Failed to get write config");
+        if ((retval = fx_run(&fdev, &job, &errmsg, &timing)))
+            err(retval, "%s", errmsg);
 
-    if (flags & FLAG_FIRMWARE) {
-        hex = mmap_firmware(firmware);
-        retval = fxdev_eeprom_firmware(firmware_data, firmware_stat.st_size);
-        if (retval)
-            err(retval, "Failed to write firmware");
+        fx_timing_report(&timing);
+        fxsim_report(&fdev);
+        if (fdev.profile)
+            fxdev_stats_report(&fdev.stats, stdout, json);
+        fxdev_close(&fdev);
+        return fxtrace_close(fdev.trace);
     }
 
-    if ((flags & FLAG_RESET) && (retval = fxdev_reset()))
-        err(retval, "Failed to reset chip");
+    if ((retval = libusb_init(NULL))) {
+        fprintf(stderr, "Cannot initialize libusb: %s\n", libusb_error_name(retval));
+        return retval;
+    };
+
+    if (gang)
+        return fx_gang_run(&fdev, usb_vendor, usb_product, &job, json);
+
+    fx_timing_init(&timing);
+    retval = fxdev_open_vid_pid(&fdev, usb_vendor, usb_product);
+    if (retval)
+        return retval;
+    fx_timing_stage(&timing, "open");
 
-    return 0;
-}
\ No newline at end of file
+    if ((retval = fx_run(&fdev, &job, &errmsg, &timing)))
+        err(retval, "%s", errmsg);
+
+    fx_timing_report(&timing);
+    if (fdev.profile)
+        fxdev_stats_report(&fdev.stats, stdout, json);
+
+    fxdev_close(&fdev);
+    libusb_exit(NULL);
+    return fxtrace_close(fdev.trace);
+}
@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright(c) 2021-2022 John Sanpe <sanpeqf@gmail.com>
+ */
+
+#include "fxprog.h"
+#include <err.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Build-time generator: parse the vendor request firmware once and emit
+ * it as merged binary segments, so fxprog carries it without any file
+ * access or HEX parsing at run time.
+ */
+int main(int argc, char *argv[])
+{
+    struct fximage image;
+    const struct fximage_seg *seg;
+    struct stat stat;
+    unsigned int count;
+    size_t index;
+    char *data;
+    int fd, retval;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: mkpreload <file.hex>\n");
+        return 1;
+    }
+
+    if ((fd = open(argv[1], O_RDONLY)) < 0)
+        err(1, "Cannot open file: %s", argv[1]);
+
+    if (fstat(fd, &stat) < 0)
+        err(1, "file fstat err");
+
+    /* the parser wants a terminated buffer */
+    data = malloc(stat.st_size + 1);
+    if (!data || read(fd, data, stat.st_size) != stat.st_size)
+        err(1, "Cannot read file: %s", argv[1]);
+
+    data[stat.st_size] = '\0';
+    close(fd);
+
+    fximage_init(&image);
+    if ((retval = fximage_load_ihex(&image, data)))
+        errx(1, "Cannot parse file: %s (%d)", argv[1], retval);
+
+    printf("/* Generated by mkpreload from %s, do not edit. */\n\n", argv[1]);
+    printf("#include \"fxprog.h\"\n");
+
+    for (count = 0; count < image.count; ++count) {
+        seg = &image.segs[count];
+        printf("\nstatic const uint8_t preload_seg%u[] = {", count);
+        for (index = 0; index < seg->length; ++index)
+            printf("%s0x%02x,", index % 12 ? " " : "\n    ", seg->data[index]);
+        printf("\n};\n");
+    }
+
+    printf("\nstatic struct fximage_seg preload_segs[] = {\n");
+    for (count = 0; count < image.count; ++count) {
+        seg = &image.segs[count];
+        printf(
+            "    { 0x%04x, %zu, (uint8_t *)preload_seg%u },\n",
+            seg->address, seg->length, count
+        );
+    }
+    printf("};\n");
+
+    printf("\nconst struct fximage fxdev_preload_image = {\n");
+    printf("    .segs = preload_segs,\n");
+    printf("    .count = %u,\n", image.count);
+    printf("    .size = %u,\n", image.count);
+    printf("    .records = %lu,\n", image.records);
+    printf("    .bytes = %zu,\n", image.bytes);
+    printf("};\n");
+
+    fximage_release(&image);
+    free(data);
+    return 0;
+}
@@ -0,0 +1,111 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright(c) 2021-2022 John Sanpe <sanpeqf@gmail.com>
+ */
+
+#include "fxprog.h"
+#include <errno.h>
+#include <unistd.h>
+
+#define FXPROBE_FILE    "transfer"
+#define FXPROBE_LINE    160
+
+/* the limit belongs to the controller and the hubs in between, not the board */
+static void fxprobe_identity(struct fxdev *fdev, char *buf, size_t size)
+{
+    size_t len;
+    int index;
+
+    if (!fdev->depth) {
+        snprintf(buf, size, "%s", fdev->transport->name);
+        return;
+    }
+
+    len = snprintf(buf, size, "bus%u-", fdev->bus);
+    for (index = 0; index < fdev->depth && len < size; ++index)
+        len += snprintf(buf + len, size - len, index ? ".%u" : "%u", fdev->ports[index]);
+}
+
+static int fxprobe_path(char *buf, size_t size)
+{
+    size_t len;
+    int retval;
+
+    if ((retval = fx_cache_dir(buf, size)))
+        return retval;
+
+    len = strlen(buf);
+    if (snprintf(buf + len, size - len, "/%s", FXPROBE_FILE) >= size - len)
+        return -ENAMETOOLONG;
+
+    return 0;
+}
+
+/* one line per port, its identity and the transfer size found for it */
+int fxprobe_load(struct fxdev *fdev, unsigned int *chunk)
+{
+    char path[PATH_MAX], line[FXPROBE_LINE], name[96], key[96];
+    unsigned int size;
+    FILE *file;
+    int retval = -ENOENT;
+
+    if (fxprobe_path(path, sizeof(path)) || !(file = fopen(path, "r")))
+        return -ENOENT;
+
+    fxprobe_identity(fdev, name, sizeof(name));
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "%95s %u", key, &size) != 2 || strcmp(key, name))
+            continue;
+
+        /* an entry this build could not use is probed over */
+        if (size >= FX_USB_TRANSFER_MIN && size <= FX_PROBE_MAX) {
+            *chunk = size;
+            retval = 0;
+        }
+    }
+
+    fclose(file);
+    return retval;
+}
+
+/* rewritten whole and renamed into place, a failed run leaves the old cache */
+int fxprobe_store(struct fxdev *fdev, unsigned int chunk)
+{
+    char path[PATH_MAX], temp[PATH_MAX], line[FXPROBE_LINE], name[96], key[96];
+    FILE *old, *new;
+    int retval;
+
+    if ((retval = fxprobe_path(path, sizeof(path)))) {
+        fprintf(stderr, "Cannot locate probe cache: %s\n", strerror(-retval));
+        return retval;
+    }
+
+    /* gang workers share the pid, the port tells their files apart */
+    fxprobe_identity(fdev, name, sizeof(name));
+    if (snprintf(temp, sizeof(temp), "%.*s.%s", (int)(sizeof(temp) - sizeof(name) - 2),
+                 path, name) >= sizeof(temp))
+        return -ENAMETOOLONG;
+
+    if (!(new = fopen(temp, "w"))) {
+        fprintf(stderr, "Cannot write probe cache: %s: %s\n", temp, strerror(errno));
+        return -errno;
+    }
+
+    if ((old = fopen(path, "r"))) {
+        while (fgets(line, sizeof(line), old)) {
+            if (sscanf(line, "%95s", key) == 1 && !strcmp(key, name))
+                continue;
+            fputs(line, new);
+        }
+        fclose(old);
+    }
+
+    fprintf(new, "%s %u\n", name, chunk);
+    if (ferror(new) | fclose(new) || rename(temp, path)) {
+        fprintf(stderr, "Cannot write probe cache: %s: %s\n", path, strerror(errno));
+        unlink(temp);
+        return -EIO;
+    }
+
+    return 0;
+}
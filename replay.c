@@ -0,0 +1,271 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright(c) 2021-2022 John Sanpe <sanpeqf@gmail.com>
+ */
+
+#include "fxprog.h"
+#include <err.h>
+#include <getopt.h>
+
+struct replay_result {
+    const char *name;
+    struct fxtrace_header header;
+    struct fxdev_stats recorded;
+    struct fxdev_stats replayed;
+    double recorded_time;
+    double replayed_time;
+};
+
+static const char *const replay_types[] = {
+    [DEV_TYPE_FX] = "fx",
+    [DEV_TYPE_FX2] = "fx2",
+    [DEV_TYPE_FX2LP] = "fx2lp",
+};
+
+static uint8_t replay_buffer[0x10000];
+
+static __noreturn void usage(void)
+{
+    printf("Usage: fxreplay [options] <trace> [<baseline>]\n");
+    printf("\t-h, --help                 display this message\n");
+    printf("\t-d, --device    <type>     override chip type: fx fx2 fx2lp\n");
+    printf("\t-q, --queue     <depth>    override transfers kept in flight\n");
+    printf("\t-S, --simulate  <opts>     latency=us,rate=KB/s,cycle=us,eeprom=info,bulk=KB/s,flaky=n,control=bytes,strict,loader\n");
+    printf("\t-x, --tolerance <percent>  replayed slowdown against baseline that fails\n");
+    exit(1);
+}
+
+static const struct option options[] = {
+    {"help",        no_argument,        0,  'h'},
+    {"device",      required_argument,  0,  'd'},
+    {"queue",       required_argument,  0,  'q'},
+    {"simulate",    required_argument,  0,  'S'},
+    {"tolerance",   required_argument,  0,  'x'},
+    { }, /* NULL */
+};
+
+static double replay_percent(double from, double to)
+{
+    return from ? (to - from) * 100 / from : 0;
+}
+
+/*
+ * Drive the recorded sequence into the simulator with the same queue
+ * depth and the same points where the host drained the queue. Payloads
+ * are not kept, only the lead byte, which is all the simulated cpucs
+ * needs to follow reset.
+ */
+static int replay_run(struct replay_result *result, const struct fxsim_config *config,
+                      int type, unsigned int queue_depth)
+{
+    struct fxtrace_record record;
+    struct fxdev fdev;
+    FILE *file;
+    double start, end;
+    uint8_t direction;
+    int retval;
+
+    if (!(file = fopen(result->name, "rb"))) {
+        fprintf(stderr, "Cannot open trace: %s: %s\n", result->name, strerror(errno));
+        return -errno;
+    }
+
+    if ((retval = fxtrace_read_header(file, &result->header))) {
+        fprintf(stderr, "Not a trace: %s\n", result->name);
+        goto finish;
+    }
+
+    if (type < 0)
+        type = result->header.type;
+    if (type >= ARRAY_SIZE(replay_types)) {
+        fprintf(stderr, "Unknown chip type in trace: %s\n", result->name);
+        retval = -EINVAL;
+        goto finish;
+    }
+
+    fxdev_init(&fdev, NULL, type);
+    fdev.queue_depth = queue_depth ? queue_depth : max(result->header.queue_depth, (uint16_t)1);
+    fdev.retry = 1;
+    fdev.profile = true;
+
+    if ((retval = fxsim_open(&fdev, config)))
+        goto finish;
+
+    start = fx_clock();
+    while ((retval = fxtrace_read(file, &record)) > 0) {
+        fxdev_stats_record(
+            &result->recorded, record.type, record.opcode,
+            record.status ? 0 : record.length, record.latency / 1e6,
+            record.retries, record.status
+        );
+
+        if (!record.status) {
+            result->recorded.transfers++;
+            result->recorded.bytes += record.length;
+        } else {
+            result->recorded.errors++;
+        }
+        result->recorded.retries += record.retries;
+
+        /*
+         * Nothing was in flight when the recording issued this one, the
+         * host waited on the earlier results, so the replay waits too.
+         */
+        if (record.start / 1e6 >= result->recorded_time)
+            ezusb_flush(&fdev);
+
+        end = (record.start + (double)record.latency) / 1e6;
+        result->recorded_time = max(result->recorded_time, end);
+
+        direction = record.type & LIBUSB_ENDPOINT_IN;
+        replay_buffer[0] = record.lead;
+
+        /* a failure reported for an earlier transfer does not drop this one */
+        retval = ezusb_submit(&fdev, "replay", direction, record.opcode,
+                              record.addr, replay_buffer, record.length);
+        if (retval && retval != -ENOMEM)
+            retval = ezusb_submit(&fdev, "replay", direction, record.opcode,
+                                  record.addr, replay_buffer, record.length);
+        if (retval == -ENOMEM)
+            break;
+    }
+
+    ezusb_flush(&fdev);
+    result->replayed_time = fx_clock() - start;
+    result->replayed = fdev.stats;
+    fxdev_close(&fdev);
+
+    if (retval < 0)
+        fprintf(stderr, "Cannot replay trace: %s (%d)\n", result->name, retval);
+
+finish:
+    fclose(file);
+    return retval < 0 ? retval : 0;
+}
+
+static void replay_report(const struct replay_result *result)
+{
+    const struct fxdev_opstats *rec, *rep;
+    unsigned int slot, dir;
+
+    printf(
+        "Replay %s: %s, queue %u\n", result->name,
+        replay_types[result->header.type], result->header.queue_depth
+    );
+    printf("  %-12s %-5s %8s %10s %7s %7s %12s %12s\n", "Request", "Dir", "Count", "Bytes",
+           "Errors", "Replay", "Recorded", "Replayed");
+
+    for (slot = 0; slot < FXDEV_STATS_SLOTS; ++slot) {
+        for (dir = 0; dir < 2; ++dir) {
+            rec = &result->recorded.ops[slot][dir];
+            rep = &result->replayed.ops[slot][dir];
+            if (!rec->transfers && !rec->errors)
+                continue;
+
+            printf(
+                "  %-12s %-5s %8lu %10lu %7lu %7lu %10.3fms %10.3fms\n", fxdev_stats_name(slot),
+                dir ? "in" : "out", rec->transfers, rec->bytes, rec->errors, rep->errors,
+                rec->transfers ? rec->total / rec->transfers * 1e3 : 0,
+                rep->transfers ? rep->total / rep->transfers * 1e3 : 0
+            );
+        }
+    }
+
+    printf(
+        "  transfers: %lu, bytes: %lu, retries: %lu\n", result->recorded.transfers,
+        result->recorded.bytes, result->recorded.retries
+    );
+    printf(
+        "  elapsed: recorded %.3fs, replayed %.3fs\n",
+        result->recorded_time, result->replayed_time
+    );
+}
+
+static bool replay_compare(const struct replay_result *result,
+                           const struct replay_result *base, double tolerance)
+{
+    double slower;
+    bool regress;
+
+    slower = replay_percent(base->replayed_time, result->replayed_time);
+    regress = result->recorded.transfers > base->recorded.transfers ||
+              result->recorded.bytes > base->recorded.bytes || slower > tolerance;
+
+    printf("Compare %s against %s:\n", result->name, base->name);
+    printf(
+        "  transfers: %lu -> %lu (%+.1f%%)\n", base->recorded.transfers,
+        result->recorded.transfers,
+        replay_percent(base->recorded.transfers, result->recorded.transfers)
+    );
+    printf(
+        "  bytes: %lu -> %lu (%+.1f%%)\n", base->recorded.bytes, result->recorded.bytes,
+        replay_percent(base->recorded.bytes, result->recorded.bytes)
+    );
+    printf(
+        "  replayed: %.3fs -> %.3fs (%+.1f%%)\n",
+        base->replayed_time, result->replayed_time, slower
+    );
+    printf("  Result: %s (tolerance %.1f%%)\n", regress ? "REGRESSION" : "ok", tolerance);
+
+    return regress;
+}
+
+int main(int argc, char *const argv[])
+{
+    struct fxsim_config config = fxsim_default;
+    struct replay_result result = {}, base = {};
+    unsigned int queue_depth = 0;
+    double tolerance = 5;
+    int optidx, type = -1;
+    char arg;
+
+    while ((arg = getopt_long(argc, argv, "hd:q:S:x:", options, &optidx)) != -1) {
+        switch (arg) {
+            case 'd':
+                for (type = 0; type < ARRAY_SIZE(replay_types); ++type) {
+                    if (!strcmp(optarg, replay_types[type]))
+                        break;
+                }
+                if (type == ARRAY_SIZE(replay_types))
+                    usage();
+                break;
+
+            case 'q':
+                queue_depth = strtoul(optarg, NULL, 0);
+                if (!queue_depth)
+                    usage();
+                break;
+
+            case 'S':
+                if (fxsim_parse(&config, optarg))
+                    usage();
+                break;
+
+            case 'x':
+                tolerance = strtod(optarg, NULL);
+                break;
+
+            case 'h': default:
+                usage();
+        }
+    }
+
+    if (optind == argc || argc - optind > 2)
+        usage();
+
+    result.name = argv[optind];
+    if (replay_run(&result, &config, type, queue_depth))
+        return 1;
+    replay_report(&result);
+
+    if (argc - optind == 1)
+        return 0;
+
+    /* both sides replay on the same simulated device, timing is comparable */
+    base.name = argv[optind + 1];
+    if (replay_run(&base, &config, type, queue_depth))
+        return 1;
+    replay_report(&base);
+
+    return replay_compare(&result, &base, tolerance);
+}
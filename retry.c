@@ -0,0 +1,156 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright(c) 2021-2022 John Sanpe <sanpeqf@gmail.com>
+ */
+
+#include "fxprog.h"
+#include <errno.h>
+
+/* a transfer costs this many payload bytes before it moves any */
+#define FXRETRY_SETUP_COST  64
+/* first attempts seen before a timeout is derived from them */
+#define FXRETRY_WARMUP      8
+
+const struct fxretry_config fxretry_default = {
+    .backoff = 1000, .backoff_max = 100000, .jitter = 50,
+    .timeout_min = 50, .timeout_max = 5000,
+};
+
+enum fxretry_class fxretry_classify(int error)
+{
+    switch (error) {
+        /* nothing to talk to, or nothing a second try changes */
+        case LIBUSB_ERROR_NO_DEVICE:
+        case LIBUSB_ERROR_NOT_FOUND:
+        case LIBUSB_ERROR_ACCESS:
+        case LIBUSB_ERROR_INVALID_PARAM:
+        case LIBUSB_ERROR_NOT_SUPPORTED:
+        case LIBUSB_ERROR_NO_MEM:
+        case LIBUSB_ERROR_OVERFLOW:
+        case LIBUSB_ERROR_INTERRUPTED:
+            return FXRETRY_FATAL;
+
+        case LIBUSB_ERROR_PIPE:
+            return FXRETRY_STALL;
+
+        case LIBUSB_ERROR_TIMEOUT:
+        case LIBUSB_ERROR_IO:
+        case LIBUSB_ERROR_BUSY:
+        default:
+            return FXRETRY_TRANSIENT;
+    }
+}
+
+/*
+ * Exponential in the retry number, capped, with part of it randomized
+ * away so devices sharing a hub do not keep retrying in lockstep.
+ */
+double fxretry_backoff(const struct fxretry_config *config, unsigned int retry,
+                       unsigned int *seed)
+{
+    double wait;
+
+    if (!config->backoff || !retry)
+        return 0;
+
+    wait = (double)config->backoff * (1U << min(retry - 1, 16U));
+    wait = min(wait, (double)config->backoff_max);
+    wait -= wait * config->jitter / 100 * (rand_r(seed) / (RAND_MAX + 1.0));
+
+    return wait / 1e6;
+}
+
+/* smoothed as in RFC 6298, but per byte so one estimate covers every size */
+void fxretry_sample(struct fxretry_rtt *rtt, double latency, size_t len)
+{
+    double unit, diff;
+
+    unit = latency / (len + FXRETRY_SETUP_COST);
+    if (!rtt->samples++) {
+        rtt->srtt = unit;
+        rtt->rttvar = unit / 2;
+        return;
+    }
+
+    diff = unit > rtt->srtt ? unit - rtt->srtt : rtt->srtt - unit;
+    rtt->rttvar += (diff - rtt->rttvar) / 4;
+    rtt->srtt += (unit - rtt->srtt) / 8;
+}
+
+/* milliseconds a control transfer of @len bytes gets, the fixed one until warmed up */
+unsigned int fxretry_timeout(const struct fxdev *fdev, const struct fxretry_rtt *rtt, size_t len)
+{
+    const struct fxretry_config *config = &fdev->policy;
+    double timeout;
+
+    if (!config->adapt || rtt->samples < FXRETRY_WARMUP)
+        return fdev->timeout;
+
+    timeout = (rtt->srtt + 4 * rtt->rttvar) * (len + FXRETRY_SETUP_COST) * 1e3;
+    timeout = max(timeout, (double)max(config->timeout_min, 1U));
+    timeout = min(timeout, (double)config->timeout_max);
+
+    return timeout + 0.5;
+}
+
+/* attempts=n,timeout=ms,backoff=us,cap=us,jitter=percent,adapt,tmin=ms,tmax=ms */
+int fxretry_parse(struct fxdev *fdev, char *opts)
+{
+    char *const tokens[] = {
+        "attempts", "timeout", "backoff", "cap", "jitter", "tmin", "tmax", "adapt", NULL,
+    };
+    struct fxretry_config *config = &fdev->policy;
+    char *value;
+    int index;
+
+    while (opts && *opts) {
+        index = getsubopt(&opts, tokens, &value);
+        if (index < 0 || (index < 7 && !value))
+            return -EINVAL;
+
+        switch (index) {
+            case 0:
+                fdev->retry = strtoul(value, NULL, 0);
+                if (!fdev->retry)
+                    return -EINVAL;
+                break;
+
+            case 1:
+                /* libusb waits forever on 0, nothing left to retry after */
+                fdev->timeout = strtoul(value, NULL, 0);
+                if (!fdev->timeout)
+                    return -EINVAL;
+                break;
+
+            case 2:
+                config->backoff = strtoul(value, NULL, 0);
+                break;
+
+            case 3:
+                config->backoff_max = strtoul(value, NULL, 0);
+                break;
+
+            case 4:
+                config->jitter = min(strtoul(value, NULL, 0), 100UL);
+                break;
+
+            case 5:
+                config->timeout_min = strtoul(value, NULL, 0);
+                if (!config->timeout_min)
+                    return -EINVAL;
+                break;
+
+            case 6:
+                config->timeout_max = strtoul(value, NULL, 0);
+                if (!config->timeout_max)
+                    return -EINVAL;
+                break;
+
+            case 7: default:
+                config->adapt = true;
+                break;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,619 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright(c) 2021-2022 John Sanpe <sanpeqf@gmail.com>
+ */
+
+#include "fxprog.h"
+#include <errno.h>
+
+/* eeprom reads in KB/s, a 400kHz i2c bus whoever asks for them */
+#define FXSIM_EEPROM_READ_RATE  40
+
+struct fxsim_range {
+    uint16_t start;
+    uint32_t end;
+};
+
+struct fxsim_pending {
+    struct libusb_transfer *transfer;
+    double due;
+};
+
+/**
+ * struct fxsim_loader - companion loader state
+ * @alt: alternate setting selected on interface 0
+ * @status: first error since the last status read
+ * @seq: sequence number of the failing or last frame
+ * @frames: frames applied since the last status read
+ * @pending: a read frame waits for its IN transfer
+ * @op: opcode of the pending read
+ * @addr: address of the pending read
+ * @length: length of the pending read
+ */
+struct fxsim_loader {
+    int alt;
+    uint8_t status;
+    uint8_t seq;
+    uint16_t frames;
+    bool pending;
+    uint8_t op;
+    uint16_t addr;
+    uint16_t length;
+};
+
+struct fxsim {
+    struct fxsim_config config;
+    struct fxsim_loader loader;
+    const struct fxsim_range *internal;
+    uint16_t cpucs;
+    struct fxsim_pending *queue;
+    unsigned int count;
+    unsigned int size;
+    double busy;
+    double start;
+    uint32_t capacity;
+    uint32_t page;
+    bool reset;
+    bool loaded;
+    bool running;
+    unsigned long cycles;
+    unsigned long stalls;
+    unsigned long controls;
+    unsigned long faults;
+    uint8_t ram[0x10000];
+    uint8_t eeprom[0x10000];
+};
+
+const struct fxsim_config fxsim_default = {
+    .latency = 125, .rate = 1024, .cycle = 5000,
+    .eeprom = FX_EEPROM_INFO_DOUBLE, .bulk = 2048,
+};
+
+/* on-chip memory reachable by FX_CMD_RW_INTERNAL, registers included */
+static const struct fxsim_range fxsim_fx_internal[] = {
+    { 0x0000, 0x1b40 }, { 0x7b40, 0x8000 }, { },
+};
+
+static const struct fxsim_range fxsim_fx2_internal[] = {
+    { 0x0000, 0x2000 }, { 0xe000, 0x10000 }, { },
+};
+
+static const struct fxsim_range fxsim_fx2lp_internal[] = {
+    { 0x0000, 0x4000 }, { 0xe000, 0x10000 }, { },
+};
+
+static bool fxsim_is_internal(struct fxsim *sim, uint16_t addr, size_t length)
+{
+    const struct fxsim_range *range;
+
+    for (range = sim->internal; range->end; ++range) {
+        if (addr >= range->start && addr + length <= range->end)
+            return true;
+    }
+
+    return false;
+}
+
+static bool fxsim_overlaps_internal(struct fxsim *sim, uint16_t addr, size_t length)
+{
+    const struct fxsim_range *range;
+
+    for (range = sim->internal; range->end; ++range) {
+        if (addr < range->end && addr + length > range->start)
+            return true;
+    }
+
+    return false;
+}
+
+/* loader requests need the loader, and with strict, running */
+static bool fxsim_has_loader(struct fxsim *sim)
+{
+    return sim->config.loader && (sim->running || !sim->config.strict);
+}
+
+/* the vendor firmware splits runs at page boundaries, one write cycle each */
+static unsigned int fxsim_eeprom_cycles(struct fxsim *sim, uint16_t addr, size_t length)
+{
+    if (!length)
+        return 0;
+
+    return (addr + length - 1) / sim->page - addr / sim->page + 1;
+}
+
+static void fxsim_cpucs(struct fxsim *sim, uint8_t value)
+{
+    bool reset = value & 0x01;
+
+    /* releasing reset starts whatever was downloaded */
+    if (sim->reset && !reset)
+        sim->running = sim->loaded;
+    else if (reset)
+        sim->running = false;
+
+    sim->reset = reset;
+}
+
+static enum libusb_transfer_status fxsim_control(struct fxsim *sim, struct libusb_transfer *transfer)
+{
+    struct libusb_control_setup *setup;
+    uint16_t addr, index, length;
+    uint8_t *data;
+    bool in;
+
+    setup = libusb_control_transfer_get_setup(transfer);
+    data = libusb_control_transfer_get_data(transfer);
+    addr = libusb_le16_to_cpu(setup->wValue);
+    index = libusb_le16_to_cpu(setup->wIndex);
+    length = libusb_le16_to_cpu(setup->wLength);
+    in = setup->bmRequestType & LIBUSB_ENDPOINT_IN;
+
+    if (addr + length > 0x10000)
+        return LIBUSB_TRANSFER_STALL;
+
+    /* everything but the boot rom loader needs a running firmware */
+    if (setup->bRequest != FX_CMD_RW_INTERNAL && sim->config.strict && !sim->running)
+        return LIBUSB_TRANSFER_STALL;
+
+    switch (setup->bRequest) {
+        case FX_CMD_RW_INTERNAL:
+            if (!fxsim_is_internal(sim, addr, length))
+                return LIBUSB_TRANSFER_STALL;
+            if (in) {
+                memcpy(data, sim->ram + addr, length);
+                break;
+            }
+            memcpy(sim->ram + addr, data, length);
+            if (sim->cpucs >= addr && sim->cpucs < addr + length)
+                fxsim_cpucs(sim, data[sim->cpucs - addr]);
+            if (addr != sim->cpucs || length != 1)
+                sim->loaded = true;
+            break;
+
+        case FX_CMD_RW_MEMORY:
+            if (in)
+                memcpy(data, sim->ram + addr, length);
+            else
+                memcpy(sim->ram + addr, data, length);
+            break;
+
+        case FX_CMD_RW_EEPROM:
+            if (addr + length > sim->capacity)
+                return LIBUSB_TRANSFER_STALL;
+            if (in)
+                memcpy(data, sim->eeprom + addr, length);
+            else
+                memcpy(sim->eeprom + addr, data, length);
+            break;
+
+        case FX_CMD_EEPROM_SIZE:
+            if (!in || length < 1)
+                return LIBUSB_TRANSFER_STALL;
+            data[0] = sim->config.eeprom;
+            break;
+
+        case FX_CMD_LOADER_INFO:
+            if (!fxsim_has_loader(sim) || !in || length < FX_LOADER_INFO)
+                return LIBUSB_TRANSFER_STALL;
+            put_unaligned_le16(FX_LOADER_MAGIC, data);
+            data[2] = FX_LOADER_VERSION;
+            data[3] = FX_LOADER_FEATURE_CRC;
+            length = FX_LOADER_INFO;
+            break;
+
+        case FX_CMD_LOADER_STATUS:
+            if (!fxsim_has_loader(sim) || !in || length < FX_LOADER_STATUS)
+                return LIBUSB_TRANSFER_STALL;
+            data[0] = sim->loader.status;
+            data[1] = sim->loader.seq;
+            put_unaligned_le16(sim->loader.frames, data + 2);
+            sim->loader.status = FX_LOADER_OK;
+            sim->loader.frames = 0;
+            length = FX_LOADER_STATUS;
+            break;
+
+        /* wIndex carries the length of the range */
+        case FX_CMD_CRC_EEPROM:
+            if (!fxsim_has_loader(sim) || !in || length < FX_LOADER_CRC ||
+                addr + index > sim->capacity)
+                return LIBUSB_TRANSFER_STALL;
+            put_unaligned_le32(crc32c(0, sim->eeprom + addr, index), data);
+            length = FX_LOADER_CRC;
+            break;
+
+        default:
+            return LIBUSB_TRANSFER_STALL;
+    }
+
+    transfer->actual_length = length;
+    return LIBUSB_TRANSFER_COMPLETED;
+}
+
+static uint8_t fxsim_frame(struct fxsim *sim, const uint8_t *frame, size_t size)
+{
+    struct fxsim_loader *loader = &sim->loader;
+    uint16_t addr, length, crc;
+    uint8_t op;
+
+    if (size < FX_FRAME_HEADER)
+        return FX_LOADER_EFRAME;
+
+    op = frame[FX_FRAME_OP];
+    addr = get_unaligned_le16(frame + FX_FRAME_ADDR);
+    length = get_unaligned_le16(frame + FX_FRAME_LENGTH);
+    crc = get_unaligned_le16(frame + FX_FRAME_CRC);
+    loader->seq = frame[FX_FRAME_SEQ];
+
+    switch (op) {
+        case FX_LOADER_OP_WRITE_MEMORY: case FX_LOADER_OP_WRITE_EEPROM:
+            if (size != FX_FRAME_HEADER + length)
+                return FX_LOADER_EFRAME;
+            if (crc16_ccitt(0xffff, frame + FX_FRAME_HEADER, length) != crc)
+                return FX_LOADER_ECRC;
+            break;
+
+        case FX_LOADER_OP_READ_MEMORY: case FX_LOADER_OP_READ_EEPROM:
+            if (size != FX_FRAME_HEADER)
+                return FX_LOADER_EFRAME;
+            break;
+
+        default:
+            return FX_LOADER_EFRAME;
+    }
+
+    if (addr + length > 0x10000)
+        return FX_LOADER_ERANGE;
+
+    /* the loader runs from internal memory and keeps its hands off it */
+    if (op == FX_LOADER_OP_WRITE_MEMORY || op == FX_LOADER_OP_READ_MEMORY) {
+        if (fxsim_overlaps_internal(sim, addr, length))
+            return FX_LOADER_ERANGE;
+    } else if (addr + length > sim->capacity) {
+        return FX_LOADER_ERANGE;
+    }
+
+    switch (op) {
+        case FX_LOADER_OP_WRITE_MEMORY:
+            memcpy(sim->ram + addr, frame + FX_FRAME_HEADER, length);
+            break;
+
+        case FX_LOADER_OP_WRITE_EEPROM:
+            memcpy(sim->eeprom + addr, frame + FX_FRAME_HEADER, length);
+            sim->cycles += fxsim_eeprom_cycles(sim, addr, length);
+            break;
+
+        default:
+            loader->pending = true;
+            loader->op = op;
+            loader->addr = addr;
+            loader->length = length;
+            break;
+    }
+
+    return FX_LOADER_OK;
+}
+
+static enum libusb_transfer_status fxsim_bulk(struct fxsim *sim, struct libusb_transfer *transfer)
+{
+    struct fxsim_loader *loader = &sim->loader;
+    const uint8_t *source;
+
+    if (!fxsim_has_loader(sim) || loader->alt != FX_LOADER_ALTSETTING)
+        return LIBUSB_TRANSFER_STALL;
+
+    if (transfer->endpoint == FX_LOADER_EP_IN) {
+        /* nothing asked for, the loader never arms the endpoint */
+        if (!loader->pending)
+            return LIBUSB_TRANSFER_TIMED_OUT;
+
+        source = loader->op == FX_LOADER_OP_READ_EEPROM ? sim->eeprom : sim->ram;
+        transfer->actual_length = min(transfer->length, (int)loader->length);
+        memcpy(transfer->buffer, source + loader->addr, transfer->actual_length);
+        loader->pending = false;
+        return LIBUSB_TRANSFER_COMPLETED;
+    }
+
+    if (transfer->endpoint != FX_LOADER_EP_OUT)
+        return LIBUSB_TRANSFER_STALL;
+
+    /* after an error frames are drained unapplied until the host asks */
+    if (loader->status == FX_LOADER_OK)
+        loader->status = fxsim_frame(sim, transfer->buffer, transfer->length);
+    loader->frames++;
+
+    transfer->actual_length = transfer->length;
+    return LIBUSB_TRANSFER_COMPLETED;
+}
+
+/* payload time of a bulk frame, eeprom frames also wait for the i2c side */
+static double fxsim_bulk_service(struct fxsim *sim, struct libusb_transfer *transfer)
+{
+    const uint8_t *frame = transfer->buffer;
+    double service;
+
+    service = sim->config.bulk ? transfer->length / (sim->config.bulk * 1024.0) : 0;
+    if (transfer->endpoint == FX_LOADER_EP_OUT && transfer->length >= FX_FRAME_HEADER &&
+        frame[FX_FRAME_OP] == FX_LOADER_OP_WRITE_EEPROM)
+        service += fxsim_eeprom_cycles(
+            sim, get_unaligned_le16(frame + FX_FRAME_ADDR),
+            get_unaligned_le16(frame + FX_FRAME_LENGTH)
+        ) * sim->config.cycle / 1e6;
+    if (transfer->endpoint == FX_LOADER_EP_OUT && transfer->length >= FX_FRAME_HEADER &&
+        frame[FX_FRAME_OP] == FX_LOADER_OP_READ_EEPROM)
+        service += get_unaligned_le16(frame + FX_FRAME_LENGTH) / (FXSIM_EEPROM_READ_RATE * 1024.0);
+
+    return service;
+}
+
+static int fxsim_submit(struct fxdev *fdev, struct libusb_transfer *transfer)
+{
+    struct fxsim *sim = fdev->priv;
+    struct libusb_control_setup *setup;
+    struct fxsim_pending *queue;
+    double start, service;
+    uint16_t addr, length;
+
+    if (sim->count == sim->size) {
+        queue = realloc(sim->queue, (sim->size + 8) * sizeof(*queue));
+        if (!queue)
+            return LIBUSB_ERROR_NO_MEM;
+        sim->queue = queue;
+        sim->size += 8;
+    }
+
+    /*
+     * The host turnaround overlaps with earlier transfers still on the
+     * wire, the payload phase and eeprom write cycles do not.
+     */
+    if (transfer->type == LIBUSB_TRANSFER_TYPE_BULK) {
+        service = fxsim_bulk_service(sim, transfer);
+    } else {
+        setup = libusb_control_transfer_get_setup(transfer);
+        addr = libusb_le16_to_cpu(setup->wValue);
+        length = libusb_le16_to_cpu(setup->wLength);
+
+        /* usbfs turns an oversized control transfer down at submission */
+        if (sim->config.control && length > sim->config.control)
+            return LIBUSB_ERROR_INVALID_PARAM;
+
+        service = sim->config.rate ? length / (sim->config.rate * 1024.0) : 0;
+        if (setup->bRequest == FX_CMD_RW_EEPROM && !(setup->bmRequestType & LIBUSB_ENDPOINT_IN))
+            service += fxsim_eeprom_cycles(sim, addr, length) * sim->config.cycle / 1e6;
+
+        if (setup->bRequest == FX_CMD_RW_EEPROM && (setup->bmRequestType & LIBUSB_ENDPOINT_IN))
+            service += length / (FXSIM_EEPROM_READ_RATE * 1024.0);
+
+        /* the reply is short, the chip walking the range is not */
+        if (setup->bRequest == FX_CMD_CRC_EEPROM)
+            service += libusb_le16_to_cpu(setup->wIndex) / (FXSIM_EEPROM_READ_RATE * 1024.0);
+    }
+
+    start = max(fx_clock() + sim->config.latency / 1e6, sim->busy);
+    sim->busy = start + service;
+
+    sim->queue[sim->count].transfer = transfer;
+    sim->queue[sim->count].due = sim->busy;
+    sim->count++;
+    return 0;
+}
+
+static int fxsim_event(struct fxdev *fdev, int *completed, double deadline)
+{
+    struct fxsim *sim = fdev->priv;
+    struct libusb_transfer *transfer;
+    struct libusb_control_setup *setup;
+    struct timespec wait;
+    double delay;
+
+    if (!sim->count)
+        return LIBUSB_ERROR_NOT_FOUND;
+
+    /* nothing completes before the deadline, wait only that long */
+    if (deadline && sim->queue[0].due > deadline) {
+        delay = deadline - fx_clock();
+        if (delay > 0) {
+            wait.tv_sec = delay;
+            wait.tv_nsec = (delay - wait.tv_sec) * 1e9;
+            while (nanosleep(&wait, &wait) && errno == EINTR);
+        }
+        return 0;
+    }
+
+    transfer = sim->queue[0].transfer;
+    delay = sim->queue[0].due - fx_clock();
+    memmove(sim->queue, sim->queue + 1, --sim->count * sizeof(*sim->queue));
+
+    if (delay > 0) {
+        wait.tv_sec = delay;
+        wait.tv_nsec = (delay - wait.tv_sec) * 1e9;
+        while (nanosleep(&wait, &wait) && errno == EINTR);
+    }
+
+    /* a flaky cable loses the transfer before the chip ever sees it */
+    if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL && sim->config.flaky &&
+        !(++sim->controls % sim->config.flaky)) {
+        transfer->status = LIBUSB_TRANSFER_ERROR;
+        transfer->actual_length = 0;
+        sim->faults++;
+        transfer->callback(transfer);
+        return 0;
+    }
+
+    if (transfer->type == LIBUSB_TRANSFER_TYPE_BULK)
+        transfer->status = fxsim_bulk(sim, transfer);
+    else
+        transfer->status = fxsim_control(sim, transfer);
+
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        transfer->actual_length = 0;
+        sim->stalls++;
+    } else if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+        setup = libusb_control_transfer_get_setup(transfer);
+        if (setup->bRequest == FX_CMD_RW_EEPROM && !(setup->bmRequestType & LIBUSB_ENDPOINT_IN))
+            sim->cycles += fxsim_eeprom_cycles(
+                sim, libusb_le16_to_cpu(setup->wValue),
+                libusb_le16_to_cpu(setup->wLength)
+            );
+    }
+
+    transfer->callback(transfer);
+    return 0;
+}
+
+static int fxsim_reopen(struct fxdev *fdev)
+{
+    /* the simulated device never drops off the bus */
+    return 0;
+}
+
+static int fxsim_altsetting(struct fxdev *fdev, int alt)
+{
+    struct fxsim *sim = fdev->priv;
+
+    sim->loader.alt = alt;
+    return 0;
+}
+
+static int fxsim_clear_halt(struct fxdev *fdev, uint8_t endpoint)
+{
+    /* nothing latches a halt here, a stalled endpoint stalls per request */
+    return 0;
+}
+
+static void fxsim_close(struct fxdev *fdev)
+{
+    struct fxsim *sim = fdev->priv;
+
+    if (!sim)
+        return;
+
+    free(sim->queue);
+    free(sim);
+    fdev->priv = NULL;
+}
+
+static const struct fxdev_transport fxsim_transport = {
+    .name = "simulate",
+    .submit = fxsim_submit,
+    .event = fxsim_event,
+    .reopen = fxsim_reopen,
+    .altsetting = fxsim_altsetting,
+    .clear_halt = fxsim_clear_halt,
+    .close = fxsim_close,
+};
+
+/* latency=us,rate=KB/s,cycle=us,eeprom=info,bulk=KB/s,flaky=n,control=bytes,strict,loader */
+int fxsim_parse(struct fxsim_config *config, char *opts)
+{
+    char *const tokens[] = {
+        "latency", "rate", "cycle", "eeprom", "bulk", "flaky", "control", "strict", "loader", NULL,
+    };
+    char *value;
+    int index;
+
+    while (opts && *opts) {
+        index = getsubopt(&opts, tokens, &value);
+        if (index < 0 || (index < 7 && !value))
+            return -EINVAL;
+
+        switch (index) {
+            case 0:
+                config->latency = strtoul(value, NULL, 0);
+                break;
+
+            case 1:
+                config->rate = strtoul(value, NULL, 0);
+                break;
+
+            case 2:
+                config->cycle = strtoul(value, NULL, 0);
+                break;
+
+            case 3:
+                config->eeprom = strtoul(value, NULL, 0);
+                break;
+
+            case 4:
+                config->bulk = strtoul(value, NULL, 0);
+                break;
+
+            case 5:
+                config->flaky = strtoul(value, NULL, 0);
+                break;
+
+            case 6:
+                config->control = strtoul(value, NULL, 0);
+                break;
+
+            case 7:
+                config->strict = true;
+                break;
+
+            case 8: default:
+                config->loader = true;
+                break;
+        }
+    }
+
+    return 0;
+}
+
+int fxsim_open(struct fxdev *fdev, const struct fxsim_config *config)
+{
+    struct fxsim *sim;
+
+    sim = calloc(1, sizeof(*sim));
+    if (!sim)
+        return -ENOMEM;
+
+    sim->config = *config;
+    sim->reset = true;
+    sim->start = fx_clock();
+    memset(sim->eeprom, 0xff, sizeof(sim->eeprom));
+
+    switch (fdev->type) {
+        case DEV_TYPE_FX:
+            sim->internal = fxsim_fx_internal;
+            sim->cpucs = FX_RESET_REG_FX;
+            break;
+
+        case DEV_TYPE_FX2:
+            sim->internal = fxsim_fx2_internal;
+            sim->cpucs = FX_RESET_REG_FX2;
+            break;
+
+        case DEV_TYPE_FX2LP: default:
+            sim->internal = fxsim_fx2lp_internal;
+            sim->cpucs = FX_RESET_REG_FX2;
+            break;
+    }
+
+    /* same families fxdev_eeprom_geometry() knows, anything else stalls */
+    if (config->eeprom == FX_EEPROM_INFO_SINGLE) {
+        sim->capacity = 0x100;
+        sim->page = 8;
+    } else {
+        sim->capacity = 0x10000;
+        sim->page = 64;
+    }
+
+    fdev->transport = &fxsim_transport;
+    fdev->priv = sim;
+    return 0;
+}
+
+void fxsim_report(struct fxdev *fdev)
+{
+    struct fxsim *sim = fdev->priv;
+
+    if (fdev->transport != &fxsim_transport)
+        return;
+
+    printf("Simulator:\n");
+    printf("  transfers: %lu, bytes: %lu, retries: %lu\n",
+           fdev->stats.transfers, fdev->stats.bytes, fdev->stats.retries);
+    printf("  stalls: %lu, eeprom write cycles: %lu\n", sim->stalls, sim->cycles);
+    if (sim->config.flaky)
+        printf("  injected faults: %lu\n", sim->faults);
+    printf("  elapsed: %.3fs\n", fx_clock() - sim->start);
+}
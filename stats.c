@@ -0,0 +1,220 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright(c) 2021-2022 John Sanpe <sanpeqf@gmail.com>
+ */
+
+#include "fxprog.h"
+
+static const struct fxdev_stats_desc {
+    uint8_t opcode;
+    const char *name;
+} fxdev_stats_descs[] = {
+    [FXDEV_STATS_INTERNAL] = { FX_CMD_RW_INTERNAL, "internal" },
+    [FXDEV_STATS_EEPROM] = { FX_CMD_RW_EEPROM, "eeprom" },
+    [FXDEV_STATS_MEMORY] = { FX_CMD_RW_MEMORY, "memory" },
+    [FXDEV_STATS_EEPROM_SIZE] = { FX_CMD_EEPROM_SIZE, "eeprom-size" },
+    [FXDEV_STATS_OTHER] = { 0x00, "other" },
+    [FXDEV_STATS_BULK] = { 0x00, "bulk" },
+};
+
+const char *fxdev_stats_name(enum fxdev_stats_slot slot)
+{
+    return fxdev_stats_descs[slot].name;
+}
+
+static unsigned int fxdev_stats_bucket(double latency)
+{
+    unsigned long usec = latency * 1e6;
+    unsigned int bits;
+
+    /* bit length picks the power of two the latency falls under */
+    bits = usec ? 64 - __builtin_clzl(usec) : 0;
+    if (bits <= FXDEV_STATS_SHIFT)
+        return 0;
+
+    return min(bits - FXDEV_STATS_SHIFT, FXDEV_STATS_BUCKETS - 1U);
+}
+
+static inline unsigned long fxdev_stats_bound(unsigned int bucket)
+{
+    return 1UL << (bucket + FXDEV_STATS_SHIFT);
+}
+
+static void fxdev_stats_account(struct fxdev_opstats *ops, size_t bytes, double latency,
+                                unsigned int retries, int error)
+{
+    ops->retries += retries;
+
+    if (error) {
+        ops->errors++;
+        return;
+    }
+
+    ops->transfers++;
+    ops->bytes += bytes;
+    ops->total += latency;
+    ops->max = max(ops->max, latency);
+    ops->histogram[fxdev_stats_bucket(latency)]++;
+}
+
+enum fxdev_stats_slot fxdev_stats_slot(uint8_t opcode)
+{
+    unsigned int slot;
+
+    for (slot = 0; slot < FXDEV_STATS_OTHER; ++slot) {
+        if (fxdev_stats_descs[slot].opcode == opcode)
+            break;
+    }
+
+    return slot;
+}
+
+void fxdev_stats_record(struct fxdev_stats *stats, uint8_t type, uint8_t opcode,
+                        size_t bytes, double latency, unsigned int retries, int error)
+{
+    fxdev_stats_account(&stats->ops[fxdev_stats_slot(opcode)][!!(type & LIBUSB_ENDPOINT_IN)],
+                        bytes, latency, retries, error);
+}
+
+/* loader frames are not vendor requests, they get a slot of their own */
+void fxdev_stats_bulk(struct fxdev_stats *stats, uint8_t endpoint, size_t bytes,
+                      double latency, int error)
+{
+    fxdev_stats_account(&stats->ops[FXDEV_STATS_BULK][!!(endpoint & LIBUSB_ENDPOINT_IN)],
+                        bytes, latency, 0, error);
+}
+
+void fxdev_stats_merge(struct fxdev_stats *dest, const struct fxdev_stats *src)
+{
+    const struct fxdev_opstats *from;
+    struct fxdev_opstats *to;
+    unsigned int slot, dir, bucket;
+
+    dest->transfers += src->transfers;
+    dest->bytes += src->bytes;
+    dest->retries += src->retries;
+    dest->errors += src->errors;
+
+    dest->policy.fatal += src->policy.fatal;
+    dest->policy.transient += src->policy.transient;
+    dest->policy.stalls += src->policy.stalls;
+    dest->policy.exhausted += src->policy.exhausted;
+    dest->policy.halts += src->policy.halts;
+    dest->policy.stretched += src->policy.stretched;
+    dest->policy.adapted += src->policy.adapted;
+    dest->policy.backoff += src->policy.backoff;
+    dest->policy.timeout = max(dest->policy.timeout, src->policy.timeout);
+
+    for (slot = 0; slot < FXDEV_STATS_SLOTS; ++slot) {
+        for (dir = 0; dir < 2; ++dir) {
+            from = &src->ops[slot][dir];
+            to = &dest->ops[slot][dir];
+            to->transfers += from->transfers;
+            to->bytes += from->bytes;
+            to->retries += from->retries;
+            to->errors += from->errors;
+            to->total += from->total;
+            to->max = max(to->max, from->max);
+            for (bucket = 0; bucket < FXDEV_STATS_BUCKETS; ++bucket)
+                to->histogram[bucket] += from->histogram[bucket];
+        }
+    }
+}
+
+static void fxdev_stats_text(const struct fxdev_stats *stats, FILE *stream)
+{
+    const struct fxdev_policy *policy = &stats->policy;
+    const struct fxdev_opstats *ops;
+    unsigned int slot, dir, bucket;
+
+    fprintf(stream, "Transfers:\n");
+    fprintf(stream, "  transfers: %lu, bytes: %lu, retries: %lu, errors: %lu\n",
+            stats->transfers, stats->bytes, stats->retries, stats->errors);
+    fprintf(stream, "  policy: fatal %lu, transient %lu, stalls %lu, exhausted %lu, halts %lu\n",
+            policy->fatal, policy->transient, policy->stalls, policy->exhausted, policy->halts);
+    fprintf(stream, "  backoff: %.3fms, stretched %lu, adapted %lu, longest timeout %ums\n",
+            policy->backoff * 1e3, policy->stretched, policy->adapted, policy->timeout);
+    fprintf(stream, "  %-12s %-5s %8s %10s %7s %6s %10s %10s\n", "Request", "Dir",
+            "Count", "Bytes", "Retries", "Errors", "Avg", "Max");
+
+    for (slot = 0; slot < FXDEV_STATS_SLOTS; ++slot) {
+        for (dir = 0; dir < 2; ++dir) {
+            ops = &stats->ops[slot][dir];
+            if (!ops->transfers && !ops->errors)
+                continue;
+
+            fprintf(
+                stream, "  %-12s %-5s %8lu %10lu %7lu %6lu %8.3fms %8.3fms\n",
+                fxdev_stats_descs[slot].name, dir ? "in" : "out",
+                ops->transfers, ops->bytes, ops->retries, ops->errors,
+                ops->transfers ? ops->total / ops->transfers * 1e3 : 0, ops->max * 1e3
+            );
+
+            fprintf(stream, "    latency:");
+            for (bucket = 0; bucket < FXDEV_STATS_BUCKETS; ++bucket) {
+                if (!ops->histogram[bucket])
+                    continue;
+                if (bucket == FXDEV_STATS_BUCKETS - 1)
+                    fprintf(stream, " >=%luus %lu", fxdev_stats_bound(bucket - 1),
+                            ops->histogram[bucket]);
+                else
+                    fprintf(stream, " <%luus %lu", fxdev_stats_bound(bucket),
+                            ops->histogram[bucket]);
+            }
+            fprintf(stream, "\n");
+        }
+    }
+}
+
+/* a single line, so it can be picked off the end of the log */
+static void fxdev_stats_json(const struct fxdev_stats *stats, FILE *stream)
+{
+    const struct fxdev_policy *policy = &stats->policy;
+    const struct fxdev_opstats *ops;
+    unsigned int slot, dir, bucket;
+    bool first = true;
+
+    fprintf(
+        stream, "{\"transfers\":%lu,\"bytes\":%lu,\"retries\":%lu,\"errors\":%lu,"
+        "\"policy\":{\"fatal\":%lu,\"transient\":%lu,\"stalls\":%lu,\"exhausted\":%lu,"
+        "\"halts\":%lu,\"stretched\":%lu,\"adapted\":%lu,\"backoff_us\":%.0f,"
+        "\"timeout_ms\":%u},\"bucket_shift\":%u,\"requests\":[", stats->transfers,
+        stats->bytes, stats->retries, stats->errors, policy->fatal, policy->transient,
+        policy->stalls, policy->exhausted, policy->halts, policy->stretched, policy->adapted,
+        policy->backoff * 1e6, policy->timeout, FXDEV_STATS_SHIFT
+    );
+
+    for (slot = 0; slot < FXDEV_STATS_SLOTS; ++slot) {
+        for (dir = 0; dir < 2; ++dir) {
+            ops = &stats->ops[slot][dir];
+            if (!ops->transfers && !ops->errors)
+                continue;
+
+            fprintf(
+                stream, "%s{\"request\":\"%s\",\"opcode\":%u,\"dir\":\"%s\","
+                "\"transfers\":%lu,\"bytes\":%lu,\"retries\":%lu,\"errors\":%lu,"
+                "\"total_us\":%.0f,\"max_us\":%.0f,\"histogram\":[",
+                first ? "" : ",", fxdev_stats_descs[slot].name,
+                fxdev_stats_descs[slot].opcode, dir ? "in" : "out",
+                ops->transfers, ops->bytes, ops->retries, ops->errors,
+                ops->total * 1e6, ops->max * 1e6
+            );
+
+            for (bucket = 0; bucket < FXDEV_STATS_BUCKETS; ++bucket)
+                fprintf(stream, "%s%lu", bucket ? "," : "", ops->histogram[bucket]);
+
+            fprintf(stream, "]}");
+            first = false;
+        }
+    }
+
+    fprintf(stream, "]}\n");
+}
+
+void fxdev_stats_report(const struct fxdev_stats *stats, FILE *stream, bool json)
+{
+    if (json)
+        fxdev_stats_json(stats, stream);
+    else
+        fxdev_stats_text(stats, stream);
+}
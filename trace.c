@@ -0,0 +1,116 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright(c) 2021-2022 John Sanpe <sanpeqf@gmail.com>
+ */
+
+#include "fxprog.h"
+
+struct fxtrace *fxtrace_open(const char *name, enum fxdev_type type, unsigned int queue_depth)
+{
+    struct fxtrace_header header = {
+        .magic = FXTRACE_MAGIC,
+        .version = FXTRACE_VERSION,
+        .type = type,
+    };
+    struct fxtrace *trace;
+
+    trace = calloc(1, sizeof(*trace));
+    if (!trace)
+        return NULL;
+
+    if (!(trace->file = fopen(name, "wb"))) {
+        fprintf(stderr, "Cannot open trace: %s: %s\n", name, strerror(errno));
+        free(trace);
+        return NULL;
+    }
+
+    put_unaligned_le16(queue_depth, &header.queue_depth);
+    if (fwrite(&header, sizeof(header), 1, trace->file) != 1) {
+        fprintf(stderr, "Cannot write trace: %s: %s\n", name, strerror(errno));
+        fclose(trace->file);
+        free(trace);
+        return NULL;
+    }
+
+    trace->start = fx_clock();
+    return trace;
+}
+
+/* runs in the completion path, stays a buffered append */
+void fxtrace_record(struct fxtrace *trace, struct libusb_transfer *transfer,
+                    double submitted, unsigned int retries, int error)
+{
+    struct fxtrace_record record = {};
+    struct libusb_control_setup *setup;
+    uint8_t *data;
+    size_t length;
+
+    setup = libusb_control_transfer_get_setup(transfer);
+    data = libusb_control_transfer_get_data(transfer);
+
+    /* what went out was asked for, what came in is what arrived */
+    if (setup->bmRequestType & LIBUSB_ENDPOINT_IN)
+        length = error ? 0 : transfer->actual_length;
+    else
+        length = libusb_le16_to_cpu(setup->wLength);
+
+    put_unaligned_le32((submitted - trace->start) * 1e6, &record.start);
+    put_unaligned_le32((fx_clock() - submitted) * 1e6, &record.latency);
+    put_unaligned_le32(crc32c(0, data, length), &record.hash);
+    put_unaligned_le16(libusb_le16_to_cpu(setup->wValue), &record.addr);
+    put_unaligned_le16(libusb_le16_to_cpu(setup->wLength), &record.length);
+    record.type = setup->bmRequestType;
+    record.opcode = setup->bRequest;
+    record.status = error;
+    record.retries = min(retries, 0xffU);
+    record.lead = length ? data[0] : 0;
+
+    fwrite(&record, sizeof(record), 1, trace->file);
+    trace->records++;
+}
+
+int fxtrace_close(struct fxtrace *trace)
+{
+    int retval = 0;
+
+    if (!trace)
+        return 0;
+
+    if (fclose(trace->file))
+        retval = -errno;
+
+    free(trace);
+    return retval;
+}
+
+int fxtrace_read_header(FILE *file, struct fxtrace_header *header)
+{
+    if (fread(header, sizeof(*header), 1, file) != 1)
+        return -EIO;
+
+    if (memcmp(header->magic, FXTRACE_MAGIC, sizeof(header->magic)) ||
+        header->version != FXTRACE_VERSION)
+        return -EINVAL;
+
+    header->queue_depth = get_unaligned_le16(&header->queue_depth);
+    return 0;
+}
+
+/* returns 1 per record, 0 at the end of the trace */
+int fxtrace_read(FILE *file, struct fxtrace_record *record)
+{
+    size_t count;
+
+    count = fread(record, 1, sizeof(*record), file);
+    if (!count)
+        return 0;
+    if (count != sizeof(*record))
+        return -EIO;
+
+    record->start = get_unaligned_le32(&record->start);
+    record->latency = get_unaligned_le32(&record->latency);
+    record->hash = get_unaligned_le32(&record->hash);
+    record->addr = get_unaligned_le16(&record->addr);
+    record->length = get_unaligned_le16(&record->length);
+    return 1;
+}